@@ -6,16 +6,19 @@
 #include <cstdlib>
 #include <cstdint>
 #include <algorithm>
+#include <vector>
+#include <stdexcept>
 #include "bst.h"
+#include "task_pool.h"
 
 struct KeyError
 {
 };
 
 /**
- * A special kind of node for an AVL tree, which adds the balance as a data member, plus
- * other additional helper functions. You do NOT need to implement any functionality or
- * add additional data members or helper functions.
+ * A special kind of node for an AVL tree, which adds the balance plus
+ * other additional helper functions. The balance is kept in the tag bits
+ * of the parent pointer (see Node), so an AVLNode is no bigger than a Node.
  */
 template <typename Key, typename Value>
 class AVLNode : public Node<Key, Value>
@@ -23,22 +26,26 @@ class AVLNode : public Node<Key, Value>
 public:
     // Constructor/destructor.
     AVLNode(const Key &key, const Value &value, AVLNode<Key, Value> *parent);
-    virtual ~AVLNode();
+    AVLNode(Key &&key, Value &&value, AVLNode<Key, Value> *parent);
+    AVLNode(const ItemMaker<Key, Value> &maker, AVLNode<Key, Value> *parent);
+    ~AVLNode();
 
     // Getter/setter for the node's height.
     int8_t getBalance() const;
     void setBalance(int8_t balance);
     void updateBalance(int8_t diff);
 
-    // Getters for parent, left, and right. These need to be redefined since they
+    // Getters for parent, left, and right. These hide the Node versions since they
     // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
     // for more information.
-    virtual AVLNode<Key, Value> *getParent() const override;
-    virtual AVLNode<Key, Value> *getLeft() const override;
-    virtual AVLNode<Key, Value> *getRight() const override;
+    AVLNode<Key, Value> *getParent() const;
+    AVLNode<Key, Value> *getLeft() const;
+    AVLNode<Key, Value> *getRight() const;
 
 protected:
-    int8_t balance_; // effectively a signed char
+    // balance is stored in the tag as balance + BALANCE_BIAS, so the
+    // -2..2 reached while rebalancing fits in three bits
+    static const int8_t BALANCE_BIAS = 2;
 };
 
 /*
@@ -51,8 +58,27 @@ protected:
  * An explicit constructor to initialize the elements by calling the base class constructor
  */
 template <class Key, class Value>
-AVLNode<Key, Value>::AVLNode(const Key &key, const Value &value, AVLNode<Key, Value> *parent) : Node<Key, Value>(key, value, parent), balance_(0)
+AVLNode<Key, Value>::AVLNode(const Key &key, const Value &value, AVLNode<Key, Value> *parent) : Node<Key, Value>(key, value, parent)
 {
+    setBalance(0);
+}
+
+/**
+ * As above, but moves the key and value into the node.
+ */
+template <class Key, class Value>
+AVLNode<Key, Value>::AVLNode(Key &&key, Value &&value, AVLNode<Key, Value> *parent) : Node<Key, Value>(std::move(key), std::move(value), parent)
+{
+    setBalance(0);
+}
+
+/**
+ * As above, but builds the item in place from maker.
+ */
+template <class Key, class Value>
+AVLNode<Key, Value>::AVLNode(const ItemMaker<Key, Value> &maker, AVLNode<Key, Value> *parent) : Node<Key, Value>(maker, parent)
+{
+    setBalance(0);
 }
 
 /**
@@ -69,7 +95,7 @@ AVLNode<Key, Value>::~AVLNode()
 template <class Key, class Value>
 int8_t AVLNode<Key, Value>::getBalance() const
 {
-    return balance_;
+    return static_cast<int8_t>(this->getTag()) - BALANCE_BIAS;
 }
 
 /**
@@ -78,7 +104,7 @@ int8_t AVLNode<Key, Value>::getBalance() const
 template <class Key, class Value>
 void AVLNode<Key, Value>::setBalance(int8_t balance)
 {
-    balance_ = balance;
+    this->setTag(static_cast<std::uintptr_t>(balance + BALANCE_BIAS));
 }
 
 /**
@@ -87,17 +113,17 @@ void AVLNode<Key, Value>::setBalance(int8_t balance)
 template <class Key, class Value>
 void AVLNode<Key, Value>::updateBalance(int8_t diff)
 {
-    balance_ += diff;
+    setBalance(getBalance() + diff);
 }
 
 /**
- * An overridden function for getting the parent since a static_cast is necessary to make sure
+ * Hides Node::getParent() since a static_cast is necessary to make sure
  * that our node is a AVLNode.
  */
 template <class Key, class Value>
 AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
 {
-    return static_cast<AVLNode<Key, Value> *>(this->parent_);
+    return static_cast<AVLNode<Key, Value> *>(Node<Key, Value>::getParent());
 }
 
 /**
@@ -106,7 +132,7 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
 template <class Key, class Value>
 AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
 {
-    return static_cast<AVLNode<Key, Value> *>(this->left_);
+    return static_cast<AVLNode<Key, Value> *>(Node<Key, Value>::getLeft());
 }
 
 /**
@@ -115,7 +141,7 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
 template <class Key, class Value>
 AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
 {
-    return static_cast<AVLNode<Key, Value> *>(this->right_);
+    return static_cast<AVLNode<Key, Value> *>(Node<Key, Value>::getRight());
 }
 
 /*
@@ -124,17 +150,179 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
   -----------------------------------------------
 */
 
+/**
+ * An AVLNode that also knows how many nodes are in its subtree,
+ * for trees that answer rank/select queries.
+ */
+template <typename Key, typename Value>
+class RankedAVLNode : public AVLNode<Key, Value>
+{
+public:
+    RankedAVLNode(const Key &key, const Value &value, AVLNode<Key, Value> *parent);
+    RankedAVLNode(Key &&key, Value &&value, AVLNode<Key, Value> *parent);
+    RankedAVLNode(const ItemMaker<Key, Value> &maker, AVLNode<Key, Value> *parent);
+
+    std::size_t getSize() const;
+    void setSize(std::size_t size);
+
+protected:
+    std::size_t size_;
+};
+
+/**
+ * An explicit constructor, for a node that starts out as a leaf.
+ */
+template <class Key, class Value>
+RankedAVLNode<Key, Value>::RankedAVLNode(const Key &key, const Value &value, AVLNode<Key, Value> *parent) : AVLNode<Key, Value>(key, value, parent), size_(1)
+{
+}
+
+/**
+ * As above, but moves the key and value into the node.
+ */
 template <class Key, class Value>
-class AVLTree : public BinarySearchTree<Key, Value>
+RankedAVLNode<Key, Value>::RankedAVLNode(Key &&key, Value &&value, AVLNode<Key, Value> *parent) : AVLNode<Key, Value>(std::move(key), std::move(value), parent), size_(1)
+{
+}
+
+/**
+ * As above, but builds the item in place from maker.
+ */
+template <class Key, class Value>
+RankedAVLNode<Key, Value>::RankedAVLNode(const ItemMaker<Key, Value> &maker, AVLNode<Key, Value> *parent) : AVLNode<Key, Value>(maker, parent), size_(1)
+{
+}
+
+/**
+ * A getter for the number of nodes in this node's subtree, itself included.
+ */
+template <class Key, class Value>
+std::size_t RankedAVLNode<Key, Value>::getSize() const
+{
+    return size_;
+}
+
+/**
+ * A setter for the number of nodes in this node's subtree.
+ */
+template <class Key, class Value>
+void RankedAVLNode<Key, Value>::setSize(std::size_t size)
+{
+    size_ = size;
+}
+
+/**
+ * A self-balancing AVL tree. With Ranked set, every node also tracks its
+ * subtree size so that select() and rank() run in O(log n); without it the
+ * size bookkeeping compiles away and nodes stay plain AVLNodes.
+ */
+template <class Key, class Value, class Alloc = NodePool, bool Ranked = false, class Compare = std::less<Key> >
+class AVLTree : public BinarySearchTree<Key, Value, Alloc, Compare>
 {
 public:
+    typedef typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator iterator;
+    typedef typename BinarySearchTree<Key, Value, Alloc, Compare>::reverse_iterator reverse_iterator;
+
+    AVLTree();
+    explicit AVLTree(const Compare &comp);
+    virtual ~AVLTree();
+    using BinarySearchTree<Key, Value, Alloc, Compare>::insert; // keep insert(&&) visible
     virtual void insert(const std::pair<const Key, Value> &new_item); // TODO
     virtual void remove(const Key &key);                              // TODO
+    // insert many items at once, in O(m log(n/m + 1)) for m items
+    template <typename InputIt>
+    void insertBatch(InputIt first, InputIt last);
+
+    // cut and splice in O(log n), moving nodes rather than copying items
+    void split(const Key &key, AVLTree &right); // keys >= key move to right
+    void join(AVLTree &right);                  // right's keys, all greater, move here
+    // set operations in O(m log(n/m + 1)) for trees of m <= n items,
+    // which take other's nodes and leave it empty
+    void unionWith(AVLTree &other);      // other's value wins for keys in both
+    void unionWith(AVLTree &other, TaskPool &pool); // the same, on pool's threads
+    void intersectWith(AVLTree &other);  // keep only keys also in other
+    void intersectWith(AVLTree &other, TaskPool &pool);
+    void differenceWith(AVLTree &other); // drop keys also in other
+    void differenceWith(AVLTree &other, TaskPool &pool);
+
+    // isBalanced() checks the real heights; this also checks the stored balances
+    bool verifyBalances() const;
+
+    // order statistics, only for Ranked trees
+    iterator select(std::size_t k) const; // k-th smallest, from 0
+    std::size_t rank(const Key &key) const; // number of keys less than key
 protected:
+    typedef typename std::conditional<Ranked, RankedAVLNode<Key, Value>, AVLNode<Key, Value> >::type NodeType;
+
     virtual void nodeSwap(AVLNode<Key, Value> *n1, AVLNode<Key, Value> *n2);
+    virtual void destroyNode(Node<Key, Value> *node);
+    virtual Node<Key, Value> *buildNode(const Key &key, const Value &value, int balance, std::size_t size);
+    virtual Node<Key, Value> *buildNode(Key &&key, Value &&value, int balance, std::size_t size);
+    virtual Node<Key, Value> *buildNode(const ItemMaker<Key, Value> &maker, int balance, std::size_t size);
+    virtual void linkNew(Node<Key, Value> *node, const typename BinarySearchTree<Key, Value, Alloc, Compare>::InsertPosition &position);
+    virtual std::pair<Node<Key, Value> *, bool> insertMoved(Key &&key, Value &&value, bool overwrite);
+    virtual std::pair<Node<Key, Value> *, bool> insertNear(Node<Key, Value> *finger, const Key &key, const Value &value);
+    template <typename K, typename V>
+    std::pair<Node<Key, Value> *, bool> insertImpl(K &&key, V &&value, bool overwrite,
+                                                   Node<Key, Value> *start = nullptr); // helper for insert
+    typedef typename std::vector<std::pair<Key, Value> >::iterator BatchIt;
+    virtual void mergeSorted(std::vector<std::pair<Key, Value> > &items); // helper for insertBatch
+
+    // split/join helpers. Heights count the nodes on the longest path down,
+    // so NULL is 0; callers track them, since nodes only store balances.
+    static int heightOf(AVLNode<Key, Value> *node); // O(log n), by following balances
+    AVLNode<Key, Value> *joinSubtrees(AVLNode<Key, Value> *left, int leftHeight, AVLNode<Key, Value> *middle,
+                                      AVLNode<Key, Value> *right, int rightHeight, int &height);
+    AVLNode<Key, Value> *joinSubtrees(AVLNode<Key, Value> *left, int leftHeight,
+                                      AVLNode<Key, Value> *right, int rightHeight, int &height); // no middle node
+    void splitSubtree(AVLNode<Key, Value> *node, int height, const Key &key,
+                      AVLNode<Key, Value> *&left, int &leftHeight, AVLNode<Key, Value> *&found,
+                      AVLNode<Key, Value> *&right, int &rightHeight);
+    AVLNode<Key, Value> *unionSorted(AVLNode<Key, Value> *node, int height, BatchIt first, BatchIt last, int &resultHeight);
+    static void detachChildren(AVLNode<Key, Value> *node, int height, AVLNode<Key, Value> *&left, int &leftHeight,
+                               AVLNode<Key, Value> *&right, int &rightHeight);
+    // helpers for the set operations, which consume both subtrees
+    AVLNode<Key, Value> *unionSubtrees(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight, int &height,
+                                       std::vector<AVLNode<Key, Value> *> *duplicates = nullptr);
+    AVLNode<Key, Value> *parallelUnion(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight, int &height,
+                                       TaskPool &pool, std::vector<AVLNode<Key, Value> *> &duplicates);
+    // subtrees shorter than this are merged by one thread, being too
+    // small (a few thousand nodes) to be worth a task
+    static const int PARALLEL_MIN_HEIGHT = 14;
+#ifdef TREE_STATS
+    // The forked tasks of the parallel set operations rotate nodes too, so
+    // while one runs, this thread's rotations count into the task's own
+    // RotationCounts, which its parent adds up after joining it.
+    class TaskRotations
+    {
+    public:
+        explicit TaskRotations(RotationCounts &counts) : saved_(taskRotations_) { taskRotations_ = &counts; }
+        ~TaskRotations() { taskRotations_ = saved_; }
+
+    private:
+        RotationCounts *saved_;
+    };
+    static thread_local RotationCounts *taskRotations_; // NULL outside tasks
+    RotationCounts &rebalanceCounts(); // where rebalance() counts
+#endif
+    // these two destroy the nodes they drop, or collect them in discarded
+    AVLNode<Key, Value> *intersectSubtrees(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight, int &height,
+                                           std::vector<AVLNode<Key, Value> *> *discarded = nullptr);
+    AVLNode<Key, Value> *parallelIntersect(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight, int &height,
+                                           TaskPool &pool, std::vector<AVLNode<Key, Value> *> &discarded);
+    AVLNode<Key, Value> *differenceSubtrees(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight, int &height,
+                                            std::vector<AVLNode<Key, Value> *> *discarded = nullptr);
+    AVLNode<Key, Value> *parallelDifference(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight, int &height,
+                                            TaskPool &pool, std::vector<AVLNode<Key, Value> *> &discarded);
+    void discard(AVLNode<Key, Value> *root, std::vector<AVLNode<Key, Value> *> *discarded); // a subtree, now or later
+    void destroyDiscarded(std::vector<AVLNode<Key, Value> *> &discarded);
+
+    // subtree size helpers, which do nothing unless Ranked
+    static std::size_t sizeOf(AVLNode<Key, Value> *node);
+    static void updateSize(AVLNode<Key, Value> *node);
+    static void adjustSizesToRoot(AVLNode<Key, Value> *node, int diff);
 
     // Add helper functions here
-    void insertFix(AVLNode<Key, Value> *p, AVLNode<Key, Value> *n);                                                 // insert helper
     void removeFix(AVLNode<Key, Value> *n, int diff);                                                               // remove helper
     void rebalance(AVLNode<Key, Value> *node);                                                                      // rebalance
     void rotateLeft(AVLNode<Key, Value> *node);                                                                     // rotate left
@@ -142,47 +330,111 @@ protected:
     void updateBalancesAfterDoubleRotation(AVLNode<Key, Value> *n, AVLNode<Key, Value> *c, AVLNode<Key, Value> *g); // fix balance after double rot
 };
 
+/**
+ * Default constructor for an empty tree.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLTree<Key, Value, Alloc, Ranked, Compare>::AVLTree()
+{
+}
+
+/**
+ * Constructor for an empty tree ordered by the given comparator.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLTree<Key, Value, Alloc, Ranked, Compare>::AVLTree(const Compare &comp) : BinarySearchTree<Key, Value, Alloc, Compare>(comp)
+{
+}
+
+/**
+ * Destructor, which clears the tree here rather than in the base class
+ * so that nodes are destroyed as AVLNodes.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLTree<Key, Value, Alloc, Ranked, Compare>::~AVLTree()
+{
+    this->clear();
+}
+
 /*
  * Recall: If key is already in the tree, you should
  * overwrite the current value with the updated value.
  */
-template <class Key, class Value>
-void AVLTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::insert(const std::pair<const Key, Value> &new_item)
 {
     // TODO
+    insertImpl(new_item.first, new_item.second, true);
+}
 
-    // normal bst insert
-    AVLNode<Key, Value> *parent = nullptr;
-    AVLNode<Key, Value> *current = static_cast<AVLNode<Key, Value> *>(this->root_);
+/**
+ * The AVL version of BinarySearchTree::insertMoved, used by insert(&&).
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+std::pair<Node<Key, Value> *, bool> AVLTree<Key, Value, Alloc, Ranked, Compare>::insertMoved(Key &&key, Value &&value, bool overwrite)
+{
+    return insertImpl(std::move(key), std::move(value), overwrite);
+}
 
-    // get correct parent for new node
-    while (current != nullptr)
+/**
+ * The AVL version of BinarySearchTree::insertNear, used by the hinted insert.
+ * Only the search starts near finger; rebalancing walks up as usual.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+std::pair<Node<Key, Value> *, bool> AVLTree<Key, Value, Alloc, Ranked, Compare>::insertNear(Node<Key, Value> *finger, const Key &key, const Value &value)
+{
+    return insertImpl(key, value, true, (finger != nullptr && this->root_ != nullptr) ? this->fingerStart(finger, key) : nullptr);
+}
+
+/**
+ * Does the work of every insert, copying or moving key and value into the
+ * tree depending on what K and V are. Returns the node with the key, and
+ * whether it is new. The search starts at start if it is given, as in
+ * BinarySearchTree::insertImpl.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+template <typename K, typename V>
+std::pair<Node<Key, Value> *, bool> AVLTree<Key, Value, Alloc, Ranked, Compare>::insertImpl(K &&key, V &&value, bool overwrite,
+                                                                                           Node<Key, Value> *start)
+{
+    // normal bst search, one comparison per level
+    typename BinarySearchTree<Key, Value, Alloc, Compare>::InsertPosition position = this->findInsertPosition(key, start);
+
+    // duplicate key and fix val if alr exist
+    if (position.existing != nullptr)
     {
-        parent = current;
-        if (new_item.first < current->getKey())
-        {
-            current = current->getLeft();
-        }
-        else if (new_item.first > current->getKey())
+        if (overwrite)
         {
-            current = current->getRight();
-        }
-        else
-        { // duplicate key and fix val if alr exist
-            current->setValue(new_item.second);
-            return;
+            position.existing->setValue(std::forward<V>(value));
         }
+        return std::make_pair(position.existing, false);
     }
 
-    // make new node
-    AVLNode<Key, Value> *newNode = new AVLNode<Key, Value>(new_item.first, new_item.second, parent);
+    // make new node, through buildNode so derived trees can pick the node type
+    Node<Key, Value> *newNode = this->buildNode(std::forward<K>(key), std::forward<V>(value), 0, 1);
+    AVLTree<Key, Value, Alloc, Ranked, Compare>::linkNew(newNode, position);
+    return std::make_pair(newNode, true);
+}
+
+/**
+ * Hangs a new node where findInsertPosition said it goes, then walks up
+ * fixing balances (and sizes, for Ranked trees) until one rotation or an
+ * unchanged height ends it.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::linkNew(Node<Key, Value> *node,
+                                                          const typename BinarySearchTree<Key, Value, Alloc, Compare>::InsertPosition &position)
+{
+    AVLNode<Key, Value> *newNode = static_cast<AVLNode<Key, Value> *>(node);
+    AVLNode<Key, Value> *parent = static_cast<AVLNode<Key, Value> *>(position.parent);
+    newNode->setParent(parent);
 
     // make new node child of parent
     if (parent == nullptr)
     {
         this->root_ = newNode; // if tree was empty new node is root (no parent)
     }
-    else if (new_item.first < parent->getKey())
+    else if (position.isLeft)
     {
         parent->setLeft(newNode);
     }
@@ -190,11 +442,14 @@ void AVLTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
     {
         parent->setRight(newNode);
     }
+    adjustSizesToRoot(parent, 1);
 
     // update balance of tree
     // start with parent of new node
+    TREE_STATS_DO(std::uint64_t retraced = 0;)
     for (AVLNode<Key, Value> *node = parent; node != nullptr; node = node->getParent())
     {
+        TREE_STATS_DO(++retraced;)
         // update balance
         if (node->getLeft() == newNode)
         {
@@ -218,171 +473,848 @@ void AVLTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
 
         newNode = node; // move to parent
     }
+    TREE_STATS_DO(this->stats_.insertRetrace.record(retraced);)
 }
 
-// helper
-template <class Key, class Value>
-void AVLTree<Key, Value>::insertFix(AVLNode<Key, Value> *p, AVLNode<Key, Value> *n)
+#ifdef TREE_STATS
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+thread_local RotationCounts *AVLTree<Key, Value, Alloc, Ranked, Compare>::taskRotations_ = nullptr;
+
+/**
+ * The counts rebalance() adds its rotations to: the tree's own, unless
+ * this thread is running a task of a parallel set operation.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+RotationCounts &AVLTree<Key, Value, Alloc, Ranked, Compare>::rebalanceCounts()
 {
-    // Precondition: p and n are balanced {-1,0,+1}
-    if (p == nullptr || p->getParent() == nullptr)
-        return; // if p is null or p's parent is null return
+    return taskRotations_ != nullptr ? *taskRotations_ : this->stats_.rebalance;
+}
+#endif
 
-    AVLNode<Key, Value> *g = p->getParent(); // g is parent of p
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::rebalance(AVLNode<Key, Value> *node)
+{
+    // Check the balance of the node
+    if (node->getBalance() == 2)
+    {
+        AVLNode<Key, Value> *c = node->getRight(); // taller child
+        if (c->getBalance() >= 0)
+        {
+            // Right-Right case
+            TREE_STATS_DO(++rebalanceCounts().single;)
+            rotateLeft(node);
+            node->setBalance(c->getBalance() == 0 ? 1 : 0);
+            c->setBalance(c->getBalance() == 0 ? -1 : 0);
+        }
+        else
+        {
+            // Right-Left case
+            TREE_STATS_DO(++rebalanceCounts().doubled;)
+            AVLNode<Key, Value> *g = c->getLeft();
+            rotateRight(c);
+            rotateLeft(node);
+            updateBalancesAfterDoubleRotation(node, c, g);
+        }
+    }
+    else if (node->getBalance() == -2)
+    {
+        AVLNode<Key, Value> *c = node->getLeft(); // taller child
+        if (c->getBalance() <= 0)
+        {
+            // Left-Left case
+            TREE_STATS_DO(++rebalanceCounts().single;)
+            rotateRight(node);
+            node->setBalance(c->getBalance() == 0 ? -1 : 0);
+            c->setBalance(c->getBalance() == 0 ? 1 : 0);
+        }
+        else
+        {
+            // Left-Right case
+            TREE_STATS_DO(++rebalanceCounts().doubled;)
+            AVLNode<Key, Value> *g = c->getRight();
+            rotateLeft(c);
+            rotateRight(node);
+            updateBalancesAfterDoubleRotation(node, c, g);
+        }
+    }
+}
+
+/**
+ * Inserts every item in [first, last), in any order, as if by insert(): a
+ * key already in the tree gets the new value, and the last value given for
+ * a key wins. The batch is sorted once and merged in with split and join
+ * (see unionSorted), so m items cost O(m log(n/m + 1)) rather than m
+ * separate descents and rebalances.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+template <typename InputIt>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::insertBatch(InputIt first, InputIt last)
+{
+    std::vector<std::pair<Key, Value> > items(first, last);
+    this->sortUnique(items);
+    mergeSorted(items);
+}
+
+/**
+ * Moves every item with a key not less than key into right, whose old
+ * contents are cleared first, and keeps the rest. O(log n): the nodes are
+ * relinked, never copied, and right's allocator takes a share of this
+ * tree's memory so it can own them (see NodePool::adopt).
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::split(const Key &key, AVLTree &right)
+{
+    if (&right == this)
+    {
+        return;
+    }
+    right.clear();
+    right.alloc_.adopt(this->alloc_);
 
-    if (p == g->getLeft())
-    {                         // assume p is left child of g
-        g->updateBalance(-1); // update balance of g
-        if (g->getBalance() == 0)
-            return; // case 1
-        if (g->getBalance() == -1)
+    AVLNode<Key, Value> *root = static_cast<AVLNode<Key, Value> *>(this->root_);
+    AVLNode<Key, Value> *less, *found, *rest;
+    int lessHeight, restHeight;
+    splitSubtree(root, heightOf(root), key, less, lessHeight, found, rest, restHeight);
+    if (found != nullptr)
+    {
+        // key itself goes right, as the smallest item there
+        rest = joinSubtrees(nullptr, 0, found, rest, restHeight, restHeight);
+    }
+    this->root_ = less;
+    right.root_ = rest;
+}
+
+/**
+ * Moves every item of right into this tree, leaving right empty. Every key
+ * in right must be greater than every key here, or std::invalid_argument
+ * is thrown and neither tree changes. O(log n), as for split().
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::join(AVLTree &right)
+{
+    if (&right == this || right.root_ == nullptr)
+    {
+        return;
+    }
+    if (this->root_ != nullptr)
+    {
+        Node<Key, Value> *largest = this->root_;
+        while (largest->getRight() != nullptr)
         {
-            insertFix(g, p); // case 2: recurse
-            return;
+            largest = largest->getRight();
         }
-        if (g->getBalance() == -2)
-        { // case 3: g is now unbalanced
-            // check whether it's zig-zig or zig-zag
-            if (p->getBalance() == -1)
-            {
-                // zig-zig case
-                rotateRight(g);
-                p->setBalance(0);
-                g->setBalance(0);
-            }
-            else
-            {
-                // zig-zag case
-                AVLNode<Key, Value> *c = p->getRight();
-                rotateLeft(p);
-                rotateRight(g);
-                // update balances based on c's balance
-                if (c->getBalance() == -1)
-                {
-                    g->setBalance(1);
-                }
-                else
-                {
-                    g->setBalance(0);
-                }
-                if (c->getBalance() == 1)
-                {
-                    p->setBalance(-1);
-                }
-                else
-                {
-                    p->setBalance(0);
-                }
-                c->setBalance(0);
-            }
+        if (!this->comp_(largest->getKey(), right.getSmallestNode()->getKey()))
+        {
+            throw std::invalid_argument("join: keys of the right tree must all be greater");
         }
     }
+    this->alloc_.adopt(right.alloc_);
+
+    AVLNode<Key, Value> *left = static_cast<AVLNode<Key, Value> *>(this->root_);
+    AVLNode<Key, Value> *other = static_cast<AVLNode<Key, Value> *>(right.root_);
+    int height;
+    this->root_ = joinSubtrees(left, heightOf(left), other, heightOf(other), height);
+    right.root_ = nullptr;
+}
+
+/**
+ * Adds every item of other to this tree, leaving other empty. Where both
+ * have a key, other's value wins, as if its items were inserted here.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::unionWith(AVLTree &other)
+{
+    if (&other == this)
+    {
+        return;
+    }
+    this->alloc_.adopt(other.alloc_);
+    AVLNode<Key, Value> *a = static_cast<AVLNode<Key, Value> *>(this->root_);
+    AVLNode<Key, Value> *b = static_cast<AVLNode<Key, Value> *>(other.root_);
+    int height;
+    this->root_ = unionSubtrees(a, heightOf(a), b, heightOf(b), height);
+    other.root_ = nullptr;
+}
+
+/**
+ * unionWith, with the work spread over pool's threads. The recursion forks
+ * at every level until the pieces are a few thousand nodes, so the work
+ * divides evenly however the keys are spread, and the joins and splits on
+ * the way are O(log n) each.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::unionWith(AVLTree &other, TaskPool &pool)
+{
+    if (&other == this)
+    {
+        return;
+    }
+    this->alloc_.adopt(other.alloc_);
+    AVLNode<Key, Value> *a = static_cast<AVLNode<Key, Value> *>(this->root_);
+    AVLNode<Key, Value> *b = static_cast<AVLNode<Key, Value> *>(other.root_);
+    // with root_ cleared, rotations on the threads never write to it
+    this->root_ = nullptr;
+    other.root_ = nullptr;
+
+    int height;
+    std::vector<AVLNode<Key, Value> *> duplicates;
+    this->root_ = parallelUnion(a, heightOf(a), b, heightOf(b), height, pool, duplicates);
+    for (std::size_t i = 0; i < duplicates.size(); ++i)
+    {
+        this->destroyNode(duplicates[i]);
+    }
+}
+
+/**
+ * Removes every item whose key is not also in other, and empties other.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::intersectWith(AVLTree &other)
+{
+    if (&other == this)
+    {
+        return;
+    }
+    this->alloc_.adopt(other.alloc_);
+    AVLNode<Key, Value> *a = static_cast<AVLNode<Key, Value> *>(this->root_);
+    AVLNode<Key, Value> *b = static_cast<AVLNode<Key, Value> *>(other.root_);
+    int height;
+    this->root_ = intersectSubtrees(a, heightOf(a), b, heightOf(b), height);
+    other.root_ = nullptr;
+}
+
+/**
+ * intersectWith, with the work spread over pool's threads as for unionWith.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::intersectWith(AVLTree &other, TaskPool &pool)
+{
+    if (&other == this)
+    {
+        return;
+    }
+    this->alloc_.adopt(other.alloc_);
+    AVLNode<Key, Value> *a = static_cast<AVLNode<Key, Value> *>(this->root_);
+    AVLNode<Key, Value> *b = static_cast<AVLNode<Key, Value> *>(other.root_);
+    this->root_ = nullptr;
+    other.root_ = nullptr;
+
+    int height;
+    std::vector<AVLNode<Key, Value> *> discarded;
+    this->root_ = parallelIntersect(a, heightOf(a), b, heightOf(b), height, pool, discarded);
+    destroyDiscarded(discarded);
+}
+
+/**
+ * Removes every item whose key is also in other, and empties other.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::differenceWith(AVLTree &other)
+{
+    if (&other == this)
+    {
+        this->clear();
+        return;
+    }
+    this->alloc_.adopt(other.alloc_);
+    AVLNode<Key, Value> *a = static_cast<AVLNode<Key, Value> *>(this->root_);
+    AVLNode<Key, Value> *b = static_cast<AVLNode<Key, Value> *>(other.root_);
+    int height;
+    this->root_ = differenceSubtrees(a, heightOf(a), b, heightOf(b), height);
+    other.root_ = nullptr;
+}
+
+/**
+ * differenceWith, with the work spread over pool's threads as for unionWith.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::differenceWith(AVLTree &other, TaskPool &pool)
+{
+    if (&other == this)
+    {
+        this->clear();
+        return;
+    }
+    this->alloc_.adopt(other.alloc_);
+    AVLNode<Key, Value> *a = static_cast<AVLNode<Key, Value> *>(this->root_);
+    AVLNode<Key, Value> *b = static_cast<AVLNode<Key, Value> *>(other.root_);
+    this->root_ = nullptr;
+    other.root_ = nullptr;
+
+    int height;
+    std::vector<AVLNode<Key, Value> *> discarded;
+    this->root_ = parallelDifference(a, heightOf(a), b, heightOf(b), height, pool, discarded);
+    destroyDiscarded(discarded);
+}
+
+/**
+ * The union of two parentless subtrees, with b's value kept for keys in
+ * both. a's root splits b, the halves are merged recursively, and a's root
+ * joins the results; the two recursive calls touch disjoint nodes.
+ * b's nodes for keys in both are destroyed, or collected in duplicates if
+ * it is given, so that nothing here touches the allocator.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLNode<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::unionSubtrees(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight,
+                                                                                int &height, std::vector<AVLNode<Key, Value> *> *duplicates)
+{
+    if (a == nullptr || b == nullptr)
+    {
+        height = (a == nullptr) ? bHeight : aHeight;
+        return (a == nullptr) ? b : a;
+    }
+
+    AVLNode<Key, Value> *aLeft, *aRight;
+    int aLeftHeight, aRightHeight;
+    detachChildren(a, aHeight, aLeft, aLeftHeight, aRight, aRightHeight);
+
+    AVLNode<Key, Value> *bLeft, *found, *bRight;
+    int bLeftHeight, bRightHeight;
+    splitSubtree(b, bHeight, a->getKey(), bLeft, bLeftHeight, found, bRight, bRightHeight);
+    if (found != nullptr)
+    {
+        a->setValue(std::move(found->getValue()));
+        if (duplicates != nullptr)
+            duplicates->push_back(found);
+        else
+            this->destroyNode(found);
+    }
+
+    AVLNode<Key, Value> *left = unionSubtrees(aLeft, aLeftHeight, bLeft, bLeftHeight, aLeftHeight, duplicates);
+    AVLNode<Key, Value> *right = unionSubtrees(aRight, aRightHeight, bRight, bRightHeight, aRightHeight, duplicates);
+    return joinSubtrees(left, aLeftHeight, a, right, aRightHeight, height);
+}
+
+/**
+ * unionSubtrees with the left half forked onto pool while this thread does
+ * the right, down to PARALLEL_MIN_HEIGHT. The tasks share no nodes, and
+ * leave the allocator alone: b's duplicate nodes are collected to be
+ * destroyed afterwards, by one thread.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLNode<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::parallelUnion(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight,
+                                                                                int &height, TaskPool &pool,
+                                                                                std::vector<AVLNode<Key, Value> *> &duplicates)
+{
+    if (a == nullptr || b == nullptr || aHeight < PARALLEL_MIN_HEIGHT)
+    {
+        return unionSubtrees(a, aHeight, b, bHeight, height, &duplicates);
+    }
+
+    AVLNode<Key, Value> *aLeft, *aRight;
+    int aLeftHeight, aRightHeight;
+    detachChildren(a, aHeight, aLeft, aLeftHeight, aRight, aRightHeight);
+
+    AVLNode<Key, Value> *bLeft, *found, *bRight;
+    int bLeftHeight, bRightHeight;
+    splitSubtree(b, bHeight, a->getKey(), bLeft, bLeftHeight, found, bRight, bRightHeight);
+    if (found != nullptr)
+    {
+        a->setValue(std::move(found->getValue()));
+        duplicates.push_back(found);
+    }
+
+    AVLNode<Key, Value> *left;
+    std::vector<AVLNode<Key, Value> *> leftDuplicates;
+    TREE_STATS_DO(RotationCounts leftRotations;)
+    TaskPool::Group group(pool);
+    group.run([&]()
+              {
+                  TREE_STATS_DO(TaskRotations counting(leftRotations);)
+                  left = parallelUnion(aLeft, aLeftHeight, bLeft, bLeftHeight, aLeftHeight, pool, leftDuplicates); });
+    AVLNode<Key, Value> *right = parallelUnion(aRight, aRightHeight, bRight, bRightHeight, aRightHeight, pool, duplicates);
+    group.wait();
+    TREE_STATS_DO(rebalanceCounts().add(leftRotations);)
+
+    duplicates.insert(duplicates.end(), leftDuplicates.begin(), leftDuplicates.end());
+    return joinSubtrees(left, aLeftHeight, a, right, aRightHeight, height);
+}
+
+/**
+ * The items of a whose keys are also in b, by the same recursion as
+ * unionSubtrees. Every node of b, and every node of a left out, is
+ * destroyed, or collected in discarded if it is given.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLNode<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::intersectSubtrees(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight,
+                                                                                    int &height, std::vector<AVLNode<Key, Value> *> *discarded)
+{
+    if (a == nullptr || b == nullptr)
+    {
+        discard(a, discarded);
+        discard(b, discarded);
+        height = 0;
+        return nullptr;
+    }
+
+    AVLNode<Key, Value> *aLeft, *aRight;
+    int aLeftHeight, aRightHeight;
+    detachChildren(a, aHeight, aLeft, aLeftHeight, aRight, aRightHeight);
+
+    AVLNode<Key, Value> *bLeft, *found, *bRight;
+    int bLeftHeight, bRightHeight;
+    splitSubtree(b, bHeight, a->getKey(), bLeft, bLeftHeight, found, bRight, bRightHeight);
+
+    AVLNode<Key, Value> *left = intersectSubtrees(aLeft, aLeftHeight, bLeft, bLeftHeight, aLeftHeight, discarded);
+    AVLNode<Key, Value> *right = intersectSubtrees(aRight, aRightHeight, bRight, bRightHeight, aRightHeight, discarded);
+    if (found != nullptr)
+    {
+        discard(found, discarded);
+        return joinSubtrees(left, aLeftHeight, a, right, aRightHeight, height);
+    }
+    a->setLeft(nullptr);
+    a->setRight(nullptr);
+    discard(a, discarded);
+    return joinSubtrees(left, aLeftHeight, right, aRightHeight, height);
+}
+
+/**
+ * intersectSubtrees with the left half forked onto pool, as in
+ * parallelUnion. The dropped nodes are all collected in discarded.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLNode<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::parallelIntersect(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight,
+                                                                                    int &height, TaskPool &pool,
+                                                                                    std::vector<AVLNode<Key, Value> *> &discarded)
+{
+    if (a == nullptr || b == nullptr || aHeight < PARALLEL_MIN_HEIGHT)
+    {
+        return intersectSubtrees(a, aHeight, b, bHeight, height, &discarded);
+    }
+
+    AVLNode<Key, Value> *aLeft, *aRight;
+    int aLeftHeight, aRightHeight;
+    detachChildren(a, aHeight, aLeft, aLeftHeight, aRight, aRightHeight);
+
+    AVLNode<Key, Value> *bLeft, *found, *bRight;
+    int bLeftHeight, bRightHeight;
+    splitSubtree(b, bHeight, a->getKey(), bLeft, bLeftHeight, found, bRight, bRightHeight);
+
+    AVLNode<Key, Value> *left;
+    std::vector<AVLNode<Key, Value> *> leftDiscarded;
+    TREE_STATS_DO(RotationCounts leftRotations;)
+    TaskPool::Group group(pool);
+    group.run([&]()
+              {
+                  TREE_STATS_DO(TaskRotations counting(leftRotations);)
+                  left = parallelIntersect(aLeft, aLeftHeight, bLeft, bLeftHeight, aLeftHeight, pool, leftDiscarded); });
+    AVLNode<Key, Value> *right = parallelIntersect(aRight, aRightHeight, bRight, bRightHeight, aRightHeight, pool, discarded);
+    group.wait();
+    TREE_STATS_DO(rebalanceCounts().add(leftRotations);)
+
+    discarded.insert(discarded.end(), leftDiscarded.begin(), leftDiscarded.end());
+    if (found != nullptr)
+    {
+        discarded.push_back(found);
+        return joinSubtrees(left, aLeftHeight, a, right, aRightHeight, height);
+    }
+    a->setLeft(nullptr);
+    a->setRight(nullptr);
+    discarded.push_back(a);
+    return joinSubtrees(left, aLeftHeight, right, aRightHeight, height);
+}
+
+/**
+ * The items of a whose keys are not in b. Here b's root splits a, and
+ * every node of b is destroyed along with the nodes of a it matches, or
+ * collected in discarded if it is given.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLNode<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::differenceSubtrees(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight,
+                                                                                     int &height, std::vector<AVLNode<Key, Value> *> *discarded)
+{
+    if (a == nullptr || b == nullptr)
+    {
+        discard(b, discarded);
+        height = aHeight;
+        return a;
+    }
+
+    AVLNode<Key, Value> *bLeft, *bRight;
+    int bLeftHeight, bRightHeight;
+    detachChildren(b, bHeight, bLeft, bLeftHeight, bRight, bRightHeight);
+
+    AVLNode<Key, Value> *aLeft, *found, *aRight;
+    int aLeftHeight, aRightHeight;
+    splitSubtree(a, aHeight, b->getKey(), aLeft, aLeftHeight, found, aRight, aRightHeight);
+    b->setLeft(nullptr);
+    b->setRight(nullptr);
+    discard(b, discarded);
+    discard(found, discarded);
+
+    AVLNode<Key, Value> *left = differenceSubtrees(aLeft, aLeftHeight, bLeft, bLeftHeight, aLeftHeight, discarded);
+    AVLNode<Key, Value> *right = differenceSubtrees(aRight, aRightHeight, bRight, bRightHeight, aRightHeight, discarded);
+    return joinSubtrees(left, aLeftHeight, right, aRightHeight, height);
+}
+
+/**
+ * differenceSubtrees with the left half forked onto pool, as in
+ * parallelUnion. Here b's height decides when to stop forking, since b's
+ * root is what splits the work.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLNode<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::parallelDifference(AVLNode<Key, Value> *a, int aHeight, AVLNode<Key, Value> *b, int bHeight,
+                                                                                     int &height, TaskPool &pool,
+                                                                                     std::vector<AVLNode<Key, Value> *> &discarded)
+{
+    if (a == nullptr || b == nullptr || bHeight < PARALLEL_MIN_HEIGHT)
+    {
+        return differenceSubtrees(a, aHeight, b, bHeight, height, &discarded);
+    }
+
+    AVLNode<Key, Value> *bLeft, *bRight;
+    int bLeftHeight, bRightHeight;
+    detachChildren(b, bHeight, bLeft, bLeftHeight, bRight, bRightHeight);
+
+    AVLNode<Key, Value> *aLeft, *found, *aRight;
+    int aLeftHeight, aRightHeight;
+    splitSubtree(a, aHeight, b->getKey(), aLeft, aLeftHeight, found, aRight, aRightHeight);
+    b->setLeft(nullptr);
+    b->setRight(nullptr);
+    discarded.push_back(b);
+    if (found != nullptr)
+    {
+        discarded.push_back(found);
+    }
+
+    AVLNode<Key, Value> *left;
+    std::vector<AVLNode<Key, Value> *> leftDiscarded;
+    TREE_STATS_DO(RotationCounts leftRotations;)
+    TaskPool::Group group(pool);
+    group.run([&]()
+              {
+                  TREE_STATS_DO(TaskRotations counting(leftRotations);)
+                  left = parallelDifference(aLeft, aLeftHeight, bLeft, bLeftHeight, aLeftHeight, pool, leftDiscarded); });
+    AVLNode<Key, Value> *right = parallelDifference(aRight, aRightHeight, bRight, bRightHeight, aRightHeight, pool, discarded);
+    group.wait();
+    TREE_STATS_DO(rebalanceCounts().add(leftRotations);)
+
+    discarded.insert(discarded.end(), leftDiscarded.begin(), leftDiscarded.end());
+    return joinSubtrees(left, aLeftHeight, right, aRightHeight, height);
+}
+
+/**
+ * Destroys the parentless subtree at root, or, if discarded is given, adds
+ * it there for destroyDiscarded. NULL is ignored.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::discard(AVLNode<Key, Value> *root, std::vector<AVLNode<Key, Value> *> *discarded)
+{
+    if (root == nullptr)
+    {
+        return;
+    }
+    if (discarded != nullptr)
+        discarded->push_back(root);
     else
+        this->deleteSubtree(root);
+}
+
+/**
+ * Destroys the subtrees the parallel set operations collected, on one
+ * thread, since the allocator is not shared safely.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::destroyDiscarded(std::vector<AVLNode<Key, Value> *> &discarded)
+{
+    for (std::size_t i = 0; i < discarded.size(); ++i)
     {
-        g->updateBalance(1); // Update balance of g
-        if (g->getBalance() == 0)
-            return; // case 1: height of subtree remains unchanged
-        if (g->getBalance() == 1)
+        this->deleteSubtree(discarded[i]);
+    }
+    discarded.clear();
+}
+
+/**
+ * Merges items, sorted with unique keys, into the tree. Virtual so that
+ * derived trees which cannot relink nodes freely can do it another way.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::mergeSorted(std::vector<std::pair<Key, Value> > &items)
+{
+    if (items.empty())
+    {
+        return;
+    }
+    AVLNode<Key, Value> *root = static_cast<AVLNode<Key, Value> *>(this->root_);
+    int height;
+    this->root_ = unionSorted(root, heightOf(root), items.begin(), items.end(), height);
+}
+
+/**
+ * Merges the sorted items in [first, last) into the subtree at node, whose
+ * height is given, and returns the new subtree with its height.
+ *
+ * The middle item splits the subtree into the keys below and above it, the
+ * two halves of the batch are merged into those recursively, and the
+ * results are joined back with the middle item between them. Subtrees no
+ * item falls into are never visited, which is what makes small batches
+ * cheap on big trees.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLNode<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::unionSorted(AVLNode<Key, Value> *node, int height, BatchIt first, BatchIt last,
+                                                                              int &resultHeight)
+{
+    if (first == last)
+    {
+        resultHeight = height;
+        return node;
+    }
+    if (node == nullptr)
+    {
+        // nothing to merge with: build the items straight into a balanced subtree
+        std::size_t n = last - first;
+        resultHeight = 0;
+        for (std::size_t m = n; m != 0; m >>= 1)
         {
-            insertFix(g, p); // case 2: continue up the tree
-            return;
-        }
-        if (g->getBalance() == 2)
-        { // Case 3: g is now unbalanced
-            // check whether it's zig-zig or zig-zag
-            if (p->getBalance() == 1)
-            {
-                // zig-zig case
-                rotateLeft(g);
-                p->setBalance(0);
-                g->setBalance(0);
-            }
-            else
-            {
-                // zig-zag case
-                AVLNode<Key, Value> *c = p->getLeft();
-                rotateRight(p);
-                rotateLeft(g);
-                // update balances based on c's balance
-                if (c->getBalance() == 1)
-                {
-                    g->setBalance(-1);
-                }
-                else
-                {
-                    g->setBalance(0);
-                }
-                if (c->getBalance() == -1)
-                {
-                    p->setBalance(1);
-                }
-                else
-                {
-                    p->setBalance(0);
-                }
-                c->setBalance(0);
-            }
+            ++resultHeight;
         }
+        return static_cast<AVLNode<Key, Value> *>(this->buildSubtree(first, n));
+    }
+
+    BatchIt mid = first + (last - first) / 2;
+    AVLNode<Key, Value> *left, *found, *right;
+    int leftHeight, rightHeight;
+    splitSubtree(node, height, mid->first, left, leftHeight, found, right, rightHeight);
+
+    AVLNode<Key, Value> *middle = found;
+    if (middle != nullptr)
+    {
+        middle->setValue(std::move(mid->second));
     }
+    else
+    {
+        middle = static_cast<AVLNode<Key, Value> *>(this->buildNode(std::move(mid->first), std::move(mid->second), 0, 1));
+    }
+
+    left = unionSorted(left, leftHeight, first, mid, leftHeight);
+    right = unionSorted(right, rightHeight, mid + 1, last, rightHeight);
+    return joinSubtrees(left, leftHeight, middle, right, rightHeight, resultHeight);
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::rebalance(AVLNode<Key, Value> *node)
+/**
+ * Splits the subtree at node, of the given height, into the nodes with keys
+ * less than key and those with keys greater than key, each a valid AVL
+ * subtree with its height. The node with key itself, if any, comes back
+ * unlinked in found. O(height).
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::splitSubtree(AVLNode<Key, Value> *node, int height, const Key &key,
+                                                               AVLNode<Key, Value> *&left, int &leftHeight, AVLNode<Key, Value> *&found,
+                                                               AVLNode<Key, Value> *&right, int &rightHeight)
 {
-    // Check the balance of the node
-    if (node->getBalance() < -1 || node->getBalance() > 1)
+    if (node == nullptr)
+    {
+        left = right = found = nullptr;
+        leftHeight = rightHeight = 0;
+        return;
+    }
+
+    AVLNode<Key, Value> *l, *r;
+    int lh, rh;
+    detachChildren(node, height, l, lh, r, rh);
+
+    if (this->comp_(key, node->getKey()))
+    {
+        // everything right of node stays on the right, with node between
+        AVLNode<Key, Value> *midRight;
+        int midRightHeight;
+        splitSubtree(l, lh, key, left, leftHeight, found, midRight, midRightHeight);
+        right = joinSubtrees(midRight, midRightHeight, node, r, rh, rightHeight);
+    }
+    else if (this->comp_(node->getKey(), key))
+    {
+        AVLNode<Key, Value> *midLeft;
+        int midLeftHeight;
+        splitSubtree(r, rh, key, midLeft, midLeftHeight, found, right, rightHeight);
+        left = joinSubtrees(l, lh, node, midLeft, midLeftHeight, leftHeight);
+    }
+    else
+    {
+        node->setLeft(nullptr);
+        node->setRight(nullptr);
+        found = node;
+        left = l;
+        leftHeight = lh;
+        right = r;
+        rightHeight = rh;
+    }
+}
+
+/**
+ * Joins two parentless subtrees, every key of left below middle's and every
+ * key of right above it, into one with middle between them. Returns the new
+ * subtree and its height. O(|leftHeight - rightHeight| + 1).
+ *
+ * If the heights are close, middle simply becomes the root. Otherwise middle
+ * goes down the inner spine of the taller subtree to the first node no more
+ * than one taller than the other subtree, takes that node's place with it
+ * and the other subtree as children, and the balances are fixed on the way
+ * back up as after an insert. Unlike an insert, a rotation may leave the
+ * subtree one taller (when the heavy child was balanced), so the fix-up
+ * only stops once some subtree keeps its height.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLNode<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::joinSubtrees(AVLNode<Key, Value> *left, int leftHeight, AVLNode<Key, Value> *middle,
+                                                                               AVLNode<Key, Value> *right, int rightHeight, int &height)
+{
+    if (leftHeight <= rightHeight + 1 && rightHeight <= leftHeight + 1)
     {
-        // Determine which child is taller
-        AVLNode<Key, Value> *tallerChild = (node->getBalance() > 0) ? node->getRight() : node->getLeft();
+        middle->setParent(nullptr);
+        middle->setLeft(left);
+        middle->setRight(right);
+        if (left != nullptr)
+            left->setParent(middle);
+        if (right != nullptr)
+            right->setParent(middle);
+        middle->setBalance(rightHeight - leftHeight);
+        updateSize(middle);
+        height = std::max(leftHeight, rightHeight) + 1;
+        return middle;
+    }
 
-        if (tallerChild != nullptr)
+    // walk down the inner spine of the taller side
+    bool leftTaller = leftHeight > rightHeight;
+    AVLNode<Key, Value> *top = leftTaller ? left : right;
+    AVLNode<Key, Value> *shorter = leftTaller ? right : left;
+    int shorterHeight = leftTaller ? rightHeight : leftHeight;
+    int side = leftTaller ? 1 : -1; // balance change when the inner side grows
+    AVLNode<Key, Value> *parent = nullptr;
+    AVLNode<Key, Value> *current = top;
+    int currentHeight = leftTaller ? leftHeight : rightHeight;
+    while (currentHeight > shorterHeight + 1)
+    {
+        parent = current;
+        if (leftTaller)
         {
-            // Perform rotations
-            if (node->getBalance() > 0)
-            {
-                // Check if double rotation is needed (Right-Left case)
-                if (tallerChild->getBalance() < 0)
-                {
-                    rotateRight(tallerChild);
-                }
-                // Perform left rotation
-                rotateLeft(node);
-            }
-            else
-            {
-                // Check if double rotation is needed (Left-Right case)
-                if (tallerChild->getBalance() > 0)
-                {
-                    rotateLeft(tallerChild);
-                }
-                // Perform right rotation
-                rotateRight(node);
-            }
+            currentHeight -= (current->getBalance() < 0) ? 2 : 1;
+            current = current->getRight();
+        }
+        else
+        {
+            currentHeight -= (current->getBalance() > 0) ? 2 : 1;
+            current = current->getLeft();
         }
+    }
+
+    // middle takes current's place, one taller than current was
+    middle->setParent(parent);
+    middle->setLeft(leftTaller ? current : shorter);
+    middle->setRight(leftTaller ? shorter : current);
+    if (current != nullptr)
+        current->setParent(middle);
+    if (shorter != nullptr)
+        shorter->setParent(middle);
+    middle->setBalance(leftTaller ? shorterHeight - currentHeight : currentHeight - shorterHeight);
+    if (leftTaller)
+        parent->setRight(middle);
+    else
+        parent->setLeft(middle);
 
-        // Update balance factors
-        if (node->getBalance() == -2 || node->getBalance() == 2)
+    // sizes first, bottom up, so the rotations below start from correct ones
+    updateSize(middle);
+    for (AVLNode<Key, Value> *node = parent; node != nullptr; node = node->getParent())
+    {
+        updateSize(node);
+    }
+
+    bool grew = true;
+    AVLNode<Key, Value> *node = parent;
+    while (node != nullptr)
+    {
+        node->updateBalance(side);
+        if (node->getBalance() == 0)
         {
-            node->setBalance(0);
-            if (tallerChild != nullptr)
+            grew = false;
+            break;
+        }
+        if (node->getBalance() == 2 || node->getBalance() == -2)
+        {
+            rebalance(node);
+            node = node->getParent(); // the subtree's new root
+            if (node->getBalance() == 0)
             {
-                tallerChild->setBalance(0);
-                AVLNode<Key, Value> *newChild = (node->getBalance() > 0) ? node->getRight() : node->getLeft();
-                if (newChild != nullptr)
-                {
-                    newChild->setBalance(0);
-                }
+                grew = false;
+                break;
             }
         }
+        node = node->getParent();
+    }
+
+    // a rotation at the top replaces it
+    while (top->getParent() != nullptr)
+    {
+        top = top->getParent();
+    }
+    height = (leftTaller ? leftHeight : rightHeight) + (grew ? 1 : 0);
+    return top;
+}
+
+/**
+ * Joins two parentless subtrees, every key of left below every key of
+ * right, with no node to put between them: right's smallest node is split
+ * off to serve as the middle. O(log n).
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+AVLNode<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::joinSubtrees(AVLNode<Key, Value> *left, int leftHeight,
+                                                                               AVLNode<Key, Value> *right, int rightHeight, int &height)
+{
+    if (left == nullptr || right == nullptr)
+    {
+        height = (left == nullptr) ? rightHeight : leftHeight;
+        return (left == nullptr) ? right : left;
     }
+    AVLNode<Key, Value> *smallest = right;
+    while (smallest->getLeft() != nullptr)
+    {
+        smallest = smallest->getLeft();
+    }
+    AVLNode<Key, Value> *none, *found;
+    int noneHeight;
+    splitSubtree(right, rightHeight, smallest->getKey(), none, noneHeight, found, right, rightHeight);
+    return joinSubtrees(left, leftHeight, found, right, rightHeight, height);
+}
+
+/**
+ * Unlinks both children of node, whose height is given, as parentless
+ * subtrees with their heights. node keeps its own links until it is joined.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::detachChildren(AVLNode<Key, Value> *node, int height,
+                                                                 AVLNode<Key, Value> *&left, int &leftHeight,
+                                                                 AVLNode<Key, Value> *&right, int &rightHeight)
+{
+    // a child is one shorter than node, or two on node's shorter side
+    left = node->getLeft();
+    right = node->getRight();
+    leftHeight = height - (node->getBalance() > 0 ? 2 : 1);
+    rightHeight = height - (node->getBalance() < 0 ? 2 : 1);
+    if (left != nullptr)
+        left->setParent(nullptr);
+    if (right != nullptr)
+        right->setParent(nullptr);
+}
+
+/**
+ * Returns the height of the subtree at node, counting nodes, by walking
+ * down its taller side. O(log n).
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+int AVLTree<Key, Value, Alloc, Ranked, Compare>::heightOf(AVLNode<Key, Value> *node)
+{
+    int height = 0;
+    for (; node != nullptr; node = (node->getBalance() < 0) ? node->getLeft() : node->getRight())
+    {
+        ++height;
+    }
+    return height;
 }
 
 /*
  * Recall: The writeup specifies that if a node has 2 children you
  * should swap with the predecessor and then remove.
  */
-template <class Key, class Value>
-void AVLTree<Key, Value>::remove(const Key &key)
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::remove(const Key &key)
 {
     // TODO
     AVLNode<Key, Value> *n = static_cast<AVLNode<Key, Value> *>(this->internalFind(key));
@@ -396,12 +1328,14 @@ void AVLTree<Key, Value>::remove(const Key &key)
     if (n->getLeft() != nullptr && n->getRight() != nullptr)
     {
         AVLNode<Key, Value> *pred = static_cast<AVLNode<Key, Value> *>(this->predecessor(n));
-        nodeSwap(n, pred);
-        n = pred; // max 1 child now
+        TREE_STATS_DO(++this->stats_.nodeSwaps;)
+        nodeSwap(n, pred); // n now sits where pred was, max 1 child now
     }
 
     AVLNode<Key, Value> *p = n->getParent();
     AVLNode<Key, Value> *child = (n->getLeft() != nullptr) ? n->getLeft() : n->getRight();
+    // removing a left child makes p right heavier, and vice versa
+    int diff = (p != nullptr && n == p->getLeft()) ? 1 : -1;
 
     // replace n with child
     if (p == nullptr)
@@ -421,23 +1355,26 @@ void AVLTree<Key, Value>::remove(const Key &key)
     {
         child->setParent(p);
     }
+    adjustSizesToRoot(p, -1);
 
-    delete n; // delete node
+    this->destroyNode(n); // delete node
 
     // balance tree from parent of deleted node
+    TREE_STATS_DO(std::uint64_t fixCallsBefore = this->stats_.removeFixCalls;)
     if (p != nullptr)
     {
-        int diff = (child == p->getRight()) ? -1 : 1;
         removeFix(p, diff);
     }
+    TREE_STATS_DO(this->stats_.removeFixDepth.record(this->stats_.removeFixCalls - fixCallsBefore);)
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value> *n, int diff)
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::removeFix(AVLNode<Key, Value> *n, int diff)
 {
     // if reach root stop
     if (n == nullptr)
         return;
+    TREE_STATS_DO(++this->stats_.removeFixCalls;)
 
     // compute the next recursive call's arguments
     AVLNode<Key, Value> *p = n->getParent();
@@ -456,6 +1393,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value> *n, int diff)
             if (c->getBalance() == -1)
             {
                 // Left-Left case
+                TREE_STATS_DO(++this->stats_.removeFix.single;)
                 rotateRight(n);
                 n->setBalance(0);
                 c->setBalance(0);
@@ -463,6 +1401,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value> *n, int diff)
             else if (c->getBalance() == 0)
             {
                 // Left-Left case with c balanced
+                TREE_STATS_DO(++this->stats_.removeFix.single;)
                 rotateRight(n);
                 n->setBalance(-1);
                 c->setBalance(1);
@@ -472,6 +1411,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value> *n, int diff)
             {
                 // Left-Right case
                 AVLNode<Key, Value> *g = c->getRight();
+                TREE_STATS_DO(++this->stats_.removeFix.doubled;)
                 rotateLeft(c);
                 rotateRight(n);
                 updateBalancesAfterDoubleRotation(n, c, g);
@@ -483,6 +1423,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value> *n, int diff)
             if (c->getBalance() == 1)
             {
                 // Right-Right case
+                TREE_STATS_DO(++this->stats_.removeFix.single;)
                 rotateLeft(n);
                 n->setBalance(0);
                 c->setBalance(0);
@@ -490,6 +1431,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value> *n, int diff)
             else if (c->getBalance() == 0)
             {
                 // Right-Right case with c balanced
+                TREE_STATS_DO(++this->stats_.removeFix.single;)
                 rotateLeft(n);
                 n->setBalance(1);
                 c->setBalance(-1);
@@ -499,6 +1441,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value> *n, int diff)
             {
                 // eight-Left case
                 AVLNode<Key, Value> *g = c->getLeft();
+                TREE_STATS_DO(++this->stats_.removeFix.doubled;)
                 rotateRight(c);
                 rotateLeft(n);
                 updateBalancesAfterDoubleRotation(n, c, g);
@@ -516,18 +1459,23 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value> *n, int diff)
     }
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::updateBalancesAfterDoubleRotation(AVLNode<Key, Value> *n, AVLNode<Key, Value> *c, AVLNode<Key, Value> *g)
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::updateBalancesAfterDoubleRotation(AVLNode<Key, Value> *n, AVLNode<Key, Value> *c, AVLNode<Key, Value> *g)
 {
+    // g is the new subtree root, n and c are its children. Whichever of
+    // n/c picked up g's shorter subtree ends up one level short.
+    bool cIsLeft = (g->getLeft() == c);
     if (g->getBalance() == -1)
     {
-        n->setBalance(0);
-        c->setBalance(1);
+        // g's left subtree was taller, so the node on g's right is short
+        n->setBalance(cIsLeft ? 1 : 0);
+        c->setBalance(cIsLeft ? 0 : 1);
     }
     else if (g->getBalance() == 1)
     {
-        n->setBalance(-1);
-        c->setBalance(0);
+        // g's right subtree was taller, so the node on g's left is short
+        n->setBalance(cIsLeft ? 0 : -1);
+        c->setBalance(cIsLeft ? -1 : 0);
     }
     else
     {
@@ -537,8 +1485,8 @@ void AVLTree<Key, Value>::updateBalancesAfterDoubleRotation(AVLNode<Key, Value>
     g->setBalance(0);
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value> *node)
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::rotateLeft(AVLNode<Key, Value> *node)
 {
     AVLNode<Key, Value> *rightChild = node->getRight(); // The right child of the node
 
@@ -552,8 +1500,9 @@ void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value> *node)
     // fix parents
     rightChild->setParent(node->getParent());
     if (node->getParent() == nullptr)
-    { // node is root
-        this->root_ = rightChild;
+    { // node is root, of the tree or of a detached subtree being joined
+        if (this->root_ == node)
+            this->root_ = rightChild;
     }
     else if (node == node->getParent()->getLeft())
     { // node is a left child
@@ -567,10 +1516,14 @@ void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value> *node)
     // node is left child of rightChild
     rightChild->setLeft(node);
     node->setParent(rightChild);
+
+    // node is now below rightChild, so it goes first
+    updateSize(node);
+    updateSize(rightChild);
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value> *node)
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::rotateRight(AVLNode<Key, Value> *node)
 {
     AVLNode<Key, Value> *leftChild = node->getLeft(); // The left child of the node
 
@@ -584,8 +1537,9 @@ void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value> *node)
     // fic parents
     leftChild->setParent(node->getParent());
     if (node->getParent() == nullptr)
-    { // node is root
-        this->root_ = leftChild;
+    { // node is root, of the tree or of a detached subtree being joined
+        if (this->root_ == node)
+            this->root_ = leftChild;
     }
     else if (node == node->getParent()->getRight())
     { // node is a right child
@@ -599,15 +1553,195 @@ void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value> *node)
     //  node is right child of leftChild
     leftChild->setRight(node);
     node->setParent(leftChild);
+
+    // node is now below leftChild, so it goes first
+    updateSize(node);
+    updateSize(leftChild);
 }
  
-template <class Key, class Value>
-void AVLTree<Key, Value>::nodeSwap(AVLNode<Key, Value> *n1, AVLNode<Key, Value> *n2)
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::nodeSwap(AVLNode<Key, Value> *n1, AVLNode<Key, Value> *n2)
 {
-    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
+    BinarySearchTree<Key, Value, Alloc, Compare>::nodeSwap(n1, n2);
     int8_t tempB = n1->getBalance();
     n1->setBalance(n2->getBalance());
     n2->setBalance(tempB);
+    if (Ranked)
+    {
+        // sizes belong to positions in the tree, so they swap too
+        RankedAVLNode<Key, Value> *r1 = static_cast<RankedAVLNode<Key, Value> *>(n1);
+        RankedAVLNode<Key, Value> *r2 = static_cast<RankedAVLNode<Key, Value> *>(n2);
+        std::size_t tempS = r1->getSize();
+        r1->setSize(r2->getSize());
+        r2->setSize(tempS);
+    }
+}
+
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::destroyNode(Node<Key, Value> *node)
+{
+    NodeType *n = static_cast<NodeType *>(node);
+    n->~NodeType();
+    this->alloc_.deallocate(n);
+}
+
+/**
+ * Creates the AVLNodes for BinarySearchTree::buildFromSorted, which already
+ * knows each node's balance from the shape it builds.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+Node<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::buildNode(const Key &key, const Value &value, int balance, std::size_t size)
+{
+    NodeType *n = this->template createNode<NodeType>(key, value, nullptr);
+    n->setBalance(balance);
+    if (Ranked)
+    {
+        static_cast<RankedAVLNode<Key, Value> *>(static_cast<AVLNode<Key, Value> *>(n))->setSize(size);
+    }
+    return n;
+}
+
+/**
+ * As above, but moves the key and value into the new node.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+Node<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::buildNode(Key &&key, Value &&value, int balance, std::size_t size)
+{
+    NodeType *n = this->template createNode<NodeType>(std::move(key), std::move(value), nullptr);
+    n->setBalance(balance);
+    if (Ranked)
+    {
+        static_cast<RankedAVLNode<Key, Value> *>(static_cast<AVLNode<Key, Value> *>(n))->setSize(size);
+    }
+    return n;
+}
+
+/**
+ * As above, but the item is built in place by maker.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+Node<Key, Value> *AVLTree<Key, Value, Alloc, Ranked, Compare>::buildNode(const ItemMaker<Key, Value> &maker, int balance, std::size_t size)
+{
+    NodeType *n = this->template createNode<NodeType>(maker, nullptr);
+    n->setBalance(balance);
+    if (Ranked)
+    {
+        static_cast<RankedAVLNode<Key, Value> *>(static_cast<AVLNode<Key, Value> *>(n))->setSize(size);
+    }
+    return n;
+}
+
+/**
+ * Return true iff every node's stored balance matches the real heights of
+ * its subtrees and is within -1..1. One O(n) pass that stops at the first
+ * bad node.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+bool AVLTree<Key, Value, Alloc, Ranked, Compare>::verifyBalances() const
+{
+    return this->checkHeights(this->root_, [](const Node<Key, Value> *node, int leftHeight, int rightHeight)
+                              {
+                                  int balance = static_cast<const AVLNode<Key, Value> *>(node)->getBalance();
+                                  return balance == rightHeight - leftHeight && balance >= -1 && balance <= 1;
+                              });
+}
+
+/**
+ * Returns an iterator to the k-th smallest item (counting from 0),
+ * or the end iterator if the tree has k or fewer items. O(log n).
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+typename AVLTree<Key, Value, Alloc, Ranked, Compare>::iterator
+AVLTree<Key, Value, Alloc, Ranked, Compare>::select(std::size_t k) const
+{
+    static_assert(Ranked, "select() needs an AVLTree with Ranked set");
+    AVLNode<Key, Value> *current = static_cast<AVLNode<Key, Value> *>(this->root_);
+    while (current != nullptr)
+    {
+        std::size_t leftSize = sizeOf(current->getLeft());
+        if (k < leftSize)
+        {
+            current = current->getLeft();
+        }
+        else if (k == leftSize)
+        {
+            break;
+        }
+        else
+        {
+            k -= leftSize + 1;
+            current = current->getRight();
+        }
+    }
+    return this->makeIterator(current);
+}
+
+/**
+ * Returns the number of keys in the tree that are less than key, which is
+ * also the position select() would give key if it were present. O(log n).
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+std::size_t AVLTree<Key, Value, Alloc, Ranked, Compare>::rank(const Key &key) const
+{
+    static_assert(Ranked, "rank() needs an AVLTree with Ranked set");
+    std::size_t result = 0;
+    AVLNode<Key, Value> *current = static_cast<AVLNode<Key, Value> *>(this->root_);
+    while (current != nullptr)
+    {
+        if (this->comp_(current->getKey(), key))
+        {
+            // everything on the left, and current itself, is smaller
+            result += sizeOf(current->getLeft()) + 1;
+            current = current->getRight();
+        }
+        else
+        {
+            current = current->getLeft();
+        }
+    }
+    return result;
+}
+
+/**
+ * Returns the size of a node's subtree, or 0 for NULL. Ranked trees only.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+std::size_t AVLTree<Key, Value, Alloc, Ranked, Compare>::sizeOf(AVLNode<Key, Value> *node)
+{
+    if (!Ranked || node == nullptr)
+    {
+        return 0;
+    }
+    return static_cast<RankedAVLNode<Key, Value> *>(node)->getSize();
+}
+
+/**
+ * Recomputes a node's subtree size from its children, after they change.
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::updateSize(AVLNode<Key, Value> *node)
+{
+    if (Ranked)
+    {
+        static_cast<RankedAVLNode<Key, Value> *>(node)->setSize(sizeOf(node->getLeft()) + sizeOf(node->getRight()) + 1);
+    }
+}
+
+/**
+ * Adds diff to the subtree size of node and of every ancestor of node,
+ * after a node is linked in below it (+1) or unlinked (-1).
+ */
+template <class Key, class Value, class Alloc, bool Ranked, class Compare>
+void AVLTree<Key, Value, Alloc, Ranked, Compare>::adjustSizesToRoot(AVLNode<Key, Value> *node, int diff)
+{
+    if (Ranked)
+    {
+        for (; node != nullptr; node = node->getParent())
+        {
+            RankedAVLNode<Key, Value> *r = static_cast<RankedAVLNode<Key, Value> *>(node);
+            r->setSize(r->getSize() + diff);
+        }
+    }
 }
 
-#endif
\ No newline at end of file
+#endif
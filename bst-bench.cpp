@@ -0,0 +1,456 @@
+// Benchmarks BinarySearchTree, AVLTree and BTree against std::map.
+//
+// Usage: ./bst-bench [--latency] [max_size]
+//
+// Runs insert, find, remove, iterate and clear over sequential, random and
+// Zipfian key streams, for sizes 1K, 10K, ... up to max_size (default 1M,
+// at most 100M), and prints one CSV row per measurement:
+//
+//   container,distribution,size,operation,ns_per_op
+//
+// With --latency it instead times every single insert, remove and find of
+// a mixed workload on a tree holding size keys, and prints percentiles of
+// each operation's latency, for the tail that averages hide:
+//
+//   container,distribution,size,workload,operation,count,p50_ns,p99_ns,p999_ns,max_ns
+//
+// Each latency includes one clock read; the "clock" rows measure that
+// overhead on its own.
+//
+// The unbalanced BinarySearchTree degenerates into a list on sequential
+// keys, so that combination is measured only once per size, and skipped
+// above SEQUENTIAL_BST_LIMIT.
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include "bst.h"
+#include "avlbst.h"
+#include "btree.h"
+
+using namespace std;
+
+typedef uint64_t Key;
+typedef uint64_t Val;
+
+static const size_t MIN_SIZE = 1000;
+static const size_t MAX_SIZE = 100000000;
+static const size_t SEQUENTIAL_BST_LIMIT = 10000;
+// small sizes are repeated until about this many operations have been timed
+static const size_t OPS_PER_MEASUREMENT = 1000000;
+
+// operations timed per latency run; fewer for the degenerate BST, whose
+// operations cost O(n) each
+static const size_t LATENCY_OPS = 1000000;
+static const size_t LATENCY_OPS_SEQUENTIAL_BST = 100000;
+
+// keeps the compiler from optimizing the measured work away
+static uint64_t sink = 0;
+
+/**
+ * A histogram of latencies in the style of HdrHistogram: values below
+ * 2^PRECISION_BITS ns get a bucket each, and above that every power of two
+ * is split into 2^(PRECISION_BITS - 1) buckets, so any value is recorded to
+ * within 1/128 of itself whatever its magnitude, in a few KB. The max is
+ * kept exactly.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() : counts_(bucketOf(UINT64_MAX) + 1, 0), count_(0), max_(0)
+    {
+    }
+
+    void record(uint64_t ns)
+    {
+        ++counts_[bucketOf(ns)];
+        ++count_;
+        max_ = max(max_, ns);
+    }
+
+    uint64_t count() const
+    {
+        return count_;
+    }
+
+    uint64_t maxValue() const
+    {
+        return max_;
+    }
+
+    // the value a fraction p of the recorded values are at or below, rounded
+    // up to the top of its bucket
+    uint64_t percentile(double p) const
+    {
+        uint64_t wanted = static_cast<uint64_t>(ceil(p * count_));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < counts_.size(); b++)
+        {
+            seen += counts_[b];
+            if (seen > 0 && seen >= wanted)
+                return min(highestIn(b), max_);
+        }
+        return max_;
+    }
+
+private:
+    static const int PRECISION_BITS = 7;
+    static const uint64_t SUB_BUCKETS = uint64_t(1) << PRECISION_BITS;
+
+    static int bitLength(uint64_t v)
+    {
+        return v == 0 ? 0 : 64 - __builtin_clzll(v);
+    }
+
+    static size_t bucketOf(uint64_t v)
+    {
+        int shift = bitLength(v) - PRECISION_BITS;
+        if (shift <= 0)
+            return static_cast<size_t>(v);
+        // v >> shift keeps the top PRECISION_BITS bits, the top one set
+        return static_cast<size_t>(SUB_BUCKETS + (shift - 1) * (SUB_BUCKETS / 2) + ((v >> shift) - SUB_BUCKETS / 2));
+    }
+
+    static uint64_t highestIn(size_t bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+            return bucket;
+        uint64_t shift = (bucket - SUB_BUCKETS) / (SUB_BUCKETS / 2) + 1;
+        uint64_t top = (bucket - SUB_BUCKETS) % (SUB_BUCKETS / 2) + SUB_BUCKETS / 2;
+        return ((top + 1) << shift) - 1;
+    }
+
+    vector<uint64_t> counts_;
+    uint64_t count_;
+    uint64_t max_;
+};
+
+/**
+ * Zipfian ranks in [0, n), skewed so that rank 0 is the most popular,
+ * using the method from the YCSB benchmark (Gray et al.). theta = 0.99.
+ */
+class ZipfGenerator
+{
+public:
+    ZipfGenerator(size_t n, uint64_t seed) : n_(n), rng_(seed), uniform_(0.0, 1.0)
+    {
+        const double theta = 0.99;
+        double zeta2 = 1.0 + pow(0.5, theta);
+        zetan_ = 0.0;
+        for (size_t i = 1; i <= n; i++)
+        {
+            zetan_ += 1.0 / pow(static_cast<double>(i), theta);
+        }
+        alpha_ = 1.0 / (1.0 - theta);
+        eta_ = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan_);
+        half_ = 1.0 + pow(0.5, theta);
+    }
+
+    size_t next()
+    {
+        double u = uniform_(rng_);
+        double uz = u * zetan_;
+        if (uz < 1.0)
+            return 0;
+        if (uz < half_)
+            return 1;
+        size_t rank = static_cast<size_t>(n_ * pow(eta_ * u - eta_ + 1.0, alpha_));
+        return min(rank, n_ - 1);
+    }
+
+private:
+    size_t n_;
+    mt19937_64 rng_;
+    uniform_real_distribution<double> uniform_;
+    double zetan_;
+    double alpha_;
+    double eta_;
+    double half_;
+};
+
+// scatters ranks over the key space so that popular keys are not also adjacent
+static Key scramble(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/**
+ * Makes n keys in the given distribution, used both to fill the container
+ * and as the order of lookups and removals.
+ */
+static vector<Key> makeKeys(const string &distribution, size_t n, uint64_t seed)
+{
+    vector<Key> keys(n);
+    if (distribution == "sequential")
+    {
+        for (size_t i = 0; i < n; i++)
+            keys[i] = i;
+    }
+    else if (distribution == "random")
+    {
+        for (size_t i = 0; i < n; i++)
+            keys[i] = scramble(i);
+        shuffle(keys.begin(), keys.end(), mt19937_64(seed));
+    }
+    else
+    {
+        ZipfGenerator zipf(n, seed);
+        for (size_t i = 0; i < n; i++)
+            keys[i] = scramble(zipf.next());
+    }
+    return keys;
+}
+
+// the containers behind one small interface
+
+template <typename Tree>
+void put(Tree &tree, Key k, Val v)
+{
+    tree.insert(make_pair(k, v));
+}
+void put(map<Key, Val> &tree, Key k, Val v)
+{
+    tree[k] = v;
+}
+
+template <typename Tree>
+bool has(const Tree &tree, Key k)
+{
+    return tree.find(k) != tree.end();
+}
+
+template <typename Tree>
+void erase(Tree &tree, Key k)
+{
+    tree.remove(k);
+}
+void erase(map<Key, Val> &tree, Key k)
+{
+    tree.erase(k);
+}
+
+/**
+ * Times every operation on one container, distribution and size, and
+ * prints a CSV row for each. Small sizes are repeated, up to maxReps times.
+ */
+template <typename Tree>
+void run(const string &container, const string &distribution, size_t n, size_t maxReps)
+{
+    vector<Key> keys = makeKeys(distribution, n, n);
+    vector<Key> lookups = makeKeys(distribution, n, n + 1);
+    size_t reps = min(maxReps, max<size_t>(1, OPS_PER_MEASUREMENT / n));
+
+    double insertNs = 0, findNs = 0, iterateNs = 0, removeNs = 0, clearNs = 0;
+    typedef chrono::steady_clock Clock;
+    for (size_t r = 0; r < reps; r++)
+    {
+        Tree *tree = new Tree;
+
+        Clock::time_point t0 = Clock::now();
+        for (size_t i = 0; i < n; i++)
+            put(*tree, keys[i], i);
+        Clock::time_point t1 = Clock::now();
+        for (size_t i = 0; i < n; i++)
+            sink += has(*tree, lookups[i]);
+        Clock::time_point t2 = Clock::now();
+        for (typename Tree::iterator it = tree->begin(); it != tree->end(); ++it)
+            sink += it->second;
+        Clock::time_point t3 = Clock::now();
+        // remove the first half of the keys, then clear whatever is left
+        // (clear is reported per key left, counting duplicate keys too)
+        for (size_t i = 0; i < n / 2; i++)
+            erase(*tree, keys[i]);
+        Clock::time_point t4 = Clock::now();
+        tree->clear();
+        Clock::time_point t5 = Clock::now();
+        delete tree;
+
+        insertNs += chrono::duration<double, nano>(t1 - t0).count();
+        findNs += chrono::duration<double, nano>(t2 - t1).count();
+        iterateNs += chrono::duration<double, nano>(t3 - t2).count();
+        removeNs += chrono::duration<double, nano>(t4 - t3).count();
+        clearNs += chrono::duration<double, nano>(t5 - t4).count();
+    }
+
+    double ops = static_cast<double>(n) * reps;
+    double halfOps = static_cast<double>(n - n / 2) * reps;
+    cout << container << "," << distribution << "," << n << ",insert," << insertNs / ops << "\n";
+    cout << container << "," << distribution << "," << n << ",find," << findNs / ops << "\n";
+    cout << container << "," << distribution << "," << n << ",iterate," << iterateNs / ops << "\n";
+    cout << container << "," << distribution << "," << n << ",remove," << removeNs / (ops - halfOps) << "\n";
+    cout << container << "," << distribution << "," << n << ",clear," << clearNs / halfOps << "\n";
+    cout.flush();
+}
+
+static void printLatency(const string &container, const string &distribution, size_t n, const string &workload,
+                         const string &operation, const LatencyHistogram &h)
+{
+    cout << container << "," << distribution << "," << n << "," << workload << "," << operation << ","
+         << h.count() << "," << h.percentile(0.5) << "," << h.percentile(0.99) << ","
+         << h.percentile(0.999) << "," << h.maxValue() << "\n";
+}
+
+/**
+ * Fills a container with n keys, then runs a mix of finds, inserts and
+ * removes on it, timing each one: findPercent of the operations look up a
+ * key of the distribution, and the rest alternate between inserting a new
+ * key and removing the oldest one, so the size stays about n.
+ */
+template <typename Tree>
+void runLatency(const string &container, const string &distribution, size_t n, size_t ops,
+                const string &workload, int findPercent)
+{
+    vector<Key> keys = makeKeys(distribution, n + ops, n);
+    vector<Key> lookups = makeKeys(distribution, n, n + 1);
+    mt19937_64 rng(n + 2);
+    typedef chrono::steady_clock Clock;
+
+    Tree *tree = new Tree;
+    for (size_t i = 0; i < n; i++)
+        put(*tree, keys[i], i);
+
+    LatencyHistogram findNs, insertNs, removeNs;
+    size_t inserted = n;
+    size_t removed = 0;
+    for (size_t i = 0; i < ops; i++)
+    {
+        bool find = static_cast<int>(rng() % 100) < findPercent;
+        Clock::time_point t0 = Clock::now();
+        if (find)
+            sink += has(*tree, lookups[i % n]);
+        else if (i % 2 == 0)
+            put(*tree, keys[inserted], i);
+        else
+            erase(*tree, keys[removed]);
+        Clock::time_point t1 = Clock::now();
+
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count();
+        if (find)
+        {
+            findNs.record(ns);
+        }
+        else if (i % 2 == 0)
+        {
+            insertNs.record(ns);
+            inserted++;
+        }
+        else
+        {
+            removeNs.record(ns);
+            removed++;
+        }
+    }
+    delete tree;
+
+    printLatency(container, distribution, n, workload, "find", findNs);
+    printLatency(container, distribution, n, workload, "insert", insertNs);
+    printLatency(container, distribution, n, workload, "remove", removeNs);
+    cout.flush();
+}
+
+/**
+ * The latency of back-to-back clock reads, which every measurement includes.
+ */
+static void runClockLatency()
+{
+    typedef chrono::steady_clock Clock;
+    LatencyHistogram h;
+    for (size_t i = 0; i < LATENCY_OPS; i++)
+    {
+        Clock::time_point t0 = Clock::now();
+        Clock::time_point t1 = Clock::now();
+        h.record(chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count());
+    }
+    printLatency("clock", "none", 0, "none", "none", h);
+}
+
+/**
+ * The --latency mode: every container, distribution and size, under a
+ * read-heavy and a write-heavy mix.
+ */
+static void runLatencies(size_t maxSize)
+{
+    const char *distributions[] = {"sequential", "random", "zipfian"};
+    const char *workloads[] = {"read90", "write50"};
+    const int findPercents[] = {90, 50};
+    cout << "container,distribution,size,workload,operation,count,p50_ns,p99_ns,p999_ns,max_ns\n";
+    runClockLatency();
+    for (size_t n = MIN_SIZE; n <= maxSize; n *= 10)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            string distribution = distributions[d];
+            bool sequential = (distribution == "sequential");
+            for (int w = 0; w < 2; w++)
+            {
+                if (!sequential || n <= SEQUENTIAL_BST_LIMIT)
+                {
+                    runLatency<BinarySearchTree<Key, Val> >("BinarySearchTree", distribution, n,
+                                                            sequential ? LATENCY_OPS_SEQUENTIAL_BST : LATENCY_OPS,
+                                                            workloads[w], findPercents[w]);
+                }
+                runLatency<AVLTree<Key, Val> >("AVLTree", distribution, n, LATENCY_OPS, workloads[w], findPercents[w]);
+                runLatency<BTree<Key, Val> >("BTree", distribution, n, LATENCY_OPS, workloads[w], findPercents[w]);
+                runLatency<map<Key, Val> >("std::map", distribution, n, LATENCY_OPS, workloads[w], findPercents[w]);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t maxSize = 1000000;
+    bool latency = false;
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "--latency") == 0)
+    {
+        latency = true;
+        arg++;
+    }
+    if (arg < argc)
+    {
+        maxSize = strtoull(argv[arg], NULL, 10);
+    }
+    if (maxSize < MIN_SIZE || maxSize > MAX_SIZE)
+    {
+        cerr << "max_size must be between " << MIN_SIZE << " and " << MAX_SIZE << endl;
+        return 1;
+    }
+    if (latency)
+    {
+        runLatencies(maxSize);
+        cerr << "checksum " << sink << endl;
+        return 0;
+    }
+
+    const char *distributions[] = {"sequential", "random", "zipfian"};
+    cout << "container,distribution,size,operation,ns_per_op\n";
+    for (size_t n = MIN_SIZE; n <= maxSize; n *= 10)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            string distribution = distributions[d];
+            bool sequential = (distribution == "sequential");
+            if (!sequential || n <= SEQUENTIAL_BST_LIMIT)
+            {
+                run<BinarySearchTree<Key, Val> >("BinarySearchTree", distribution, n, sequential ? 1 : OPS_PER_MEASUREMENT);
+            }
+            run<AVLTree<Key, Val> >("AVLTree", distribution, n, OPS_PER_MEASUREMENT);
+            run<BTree<Key, Val> >("BTree", distribution, n, OPS_PER_MEASUREMENT);
+            run<map<Key, Val> >("std::map", distribution, n, OPS_PER_MEASUREMENT);
+        }
+    }
+    cerr << "checksum " << sink << endl;
+    return 0;
+}
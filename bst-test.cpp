@@ -1,60 +1,2014 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <stdexcept>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include "bst.h"
 #include "avlbst.h"
+#include "btree.h"
+#include "concurrent_avlbst.h"
+#include "snapshot_avlbst.h"
+#include "sharded_avlbst.h"
 
 using namespace std;
 
-int main(int argc, char *argv[])
+/*
+  A small self-checking test driver: every CHECK that fails is reported
+  with its line, and main() returns non-zero if any did.
+*/
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond)                                                                  \
+    do                                                                               \
+    {                                                                                \
+        ++checks;                                                                    \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            ++failures;                                                              \
+            cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond << endl; \
+        }                                                                            \
+    } while (0)
+
+/**
+ * True if tree holds exactly the items of expected, in order.
+ */
+template <typename Tree, typename Key, typename Value, typename Less>
+bool sameItems(const Tree &tree, const map<Key, Value, Less> &expected)
 {
-    // Binary Search Tree tests
-    BinarySearchTree<char, int> bt;
-    bt.insert(std::make_pair('a', 1));
-    cout << "print called: " << endl;
-    bt.print();
-    bt.insert(std::make_pair('b', 2));
-    cout << "print called: " << endl;
-    bt.print();
+    typename Tree::iterator it = tree.begin();
+    for (typename map<Key, Value, Less>::const_iterator e = expected.begin(); e != expected.end(); ++e, ++it)
+    {
+        if (it == tree.end() || it->first != e->first || !(it->second == e->second))
+            return false;
+    }
+    return it == tree.end();
+}
 
-    cout << "Binary Search Tree contents:" << endl;
-    for (BinarySearchTree<char, int>::iterator it = bt.begin(); it != bt.end(); ++it)
+/**
+ * True if tree holds exactly the items of expected, walking both back
+ * from the end.
+ */
+template <typename Tree, typename Key, typename Value, typename Less>
+bool sameItemsBackwards(const Tree &tree, const map<Key, Value, Less> &expected)
+{
+    typename Tree::reverse_iterator back = tree.rbegin();
+    for (typename map<Key, Value, Less>::const_reverse_iterator e = expected.rbegin(); e != expected.rend(); ++e, ++back)
     {
-        cout << it->first << " " << it->second << endl;
+        if (back == tree.rend() || back->first != e->first || !(back->second == e->second))
+            return false;
     }
-    if (bt.find('b') != bt.end())
+    return back == tree.rend();
+}
+
+/**
+ * Random inserts, overwrites and removes on tree, checked against a std::map.
+ */
+template <typename Tree>
+void randomOps(Tree &tree, unsigned seed, int ops, int keyRange)
+{
+    mt19937 rng(seed);
+    map<int, int> expected;
+    for (int i = 0; i < ops; ++i)
     {
-        cout << "Found b" << endl;
+        int key = static_cast<int>(rng() % keyRange);
+        if (rng() % 3 != 0)
+        {
+            tree.insert(make_pair(key, i));
+            expected[key] = i;
+        }
+        else
+        {
+            tree.remove(key);
+            expected.erase(key);
+        }
     }
-    else
+    CHECK(sameItems(tree, expected));
+    for (int key = 0; key < keyRange; ++key)
     {
-        cout << "Did not find b" << endl;
+        CHECK((tree.find(key) != tree.end()) == (expected.count(key) == 1));
     }
-    cout << "Erasing b" << endl;
-    bt.remove('b');
+}
 
-    cout << "print called: " << endl;
-    bt.print();
+/**
+ * The original walkthrough of the BST and AVL interfaces.
+ */
+static void testBasics()
+{
+    // Binary Search Tree tests
+    BinarySearchTree<char, int> bt;
+    bt.insert(std::make_pair('a', 1));
+    bt.insert(std::make_pair('b', 2));
+    CHECK(bt.begin()->first == 'a');
+    CHECK(bt.find('b') != bt.end() && bt.find('b')->second == 2);
+    bt.remove('b');
+    CHECK(bt.find('b') == bt.end());
 
     // AVL Tree Tests
     AVLTree<char, int> at;
     at.insert(std::make_pair('a', 1));
     at.insert(std::make_pair('b', 2));
+    CHECK(at.find('b') != at.end() && at.find('b')->second == 2);
+    at.remove('b');
+    CHECK(at.find('b') == at.end() && at.find('a') != at.end());
+}
 
-    cout << "\nAVLTree contents:" << endl;
-    for (AVLTree<char, int>::iterator it = at.begin(); it != at.end(); ++it)
+/**
+ * NodePool hands freed slots back out, honors alignment, and trees on
+ * every allocator agree with std::map.
+ */
+static void testNodePool()
+{
+    NodePool pool;
+    void *a = pool.allocate(24, 8);
+    void *b = pool.allocate(24, 8);
+    CHECK(a != b);
+    pool.deallocate(a);
+    CHECK(pool.allocate(24, 8) == a);
+
+    NodePool aligned;
+    for (int i = 0; i < 1000; ++i)
     {
-        cout << it->first << " " << it->second << endl;
+        CHECK(reinterpret_cast<std::uintptr_t>(aligned.allocate(40, 64)) % 64 == 0);
     }
-    if (at.find('b') != at.end())
+
+    // after adopt, the nodes of a released pool stay usable
+    NodePool owner;
+    NodePool donor;
+    int *moved = static_cast<int *>(donor.allocate(sizeof(int), alignof(int)));
+    *moved = 42;
+    owner.adopt(donor);
+    donor.release();
+    CHECK(*moved == 42);
+    owner.deallocate(moved);
+
+    for (unsigned seed = 1; seed <= 5; ++seed)
     {
-        cout << "Found b" << endl;
+        AVLTree<int, int, NodePool> pooled;
+        randomOps(pooled, seed, 5000, 700);
+        CHECK(pooled.verifyBalances());
+        pooled.clear();
+        CHECK(pooled.empty());
+        randomOps(pooled, seed + 100, 2000, 300);
+
+        AVLTree<int, int, HeapAllocator> heap;
+        randomOps(heap, seed, 5000, 700);
+        BinarySearchTree<int, int, RetainingNodePool> retaining;
+        randomOps(retaining, seed, 5000, 700);
     }
-    else
+
+    // keys with destructors are destroyed, not just dropped with the pool
+    AVLTree<string, string> strings;
+    for (int i = 0; i < 500; ++i)
     {
-        cout << "Did not find b" << endl;
+        strings.insert(make_pair(to_string(i), string(100, 'x')));
     }
-    cout << "Erasing b" << endl;
-    at.remove('b');
+    strings.clear();
+    CHECK(strings.empty());
+}
+
+/**
+ * buildFromSorted gives a balanced tree with every item, for every size
+ * up to a few hundred, and the tree stays valid under later updates.
+ */
+static void testBuildFromSorted()
+{
+    for (int n = 0; n < 300; ++n)
+    {
+        map<int, string> expected;
+        for (int i = 0; i < n; ++i)
+        {
+            expected[i * 3] = to_string(i);
+        }
+        BinarySearchTree<int, string> plain;
+        plain.buildFromSorted(expected.begin(), expected.end());
+        CHECK(plain.isBalanced());
+        CHECK(sameItems(plain, expected));
+
+        AVLTree<int, string> avl;
+        avl.insert(make_pair(-1, string("replaced")));
+        avl.buildFromSorted(expected.begin(), expected.end());
+        CHECK(avl.verifyBalances());
+        CHECK(sameItems(avl, expected));
+        for (int i = 0; i < n; i += 2)
+        {
+            avl.remove(i * 3);
+            expected.erase(i * 3);
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            avl.insert(make_pair(i * 3 + 1, string("x")));
+            expected[i * 3 + 1] = "x";
+        }
+        CHECK(avl.verifyBalances());
+        CHECK(sameItems(avl, expected));
+    }
+
+    // unsorted input with duplicates: the last value for a key wins
+    vector<pair<int, int> > items;
+    map<int, int> expected;
+    mt19937 rng(3);
+    for (int i = 0; i < 5000; ++i)
+    {
+        int key = static_cast<int>(rng() % 2000);
+        items.push_back(make_pair(key, i));
+        expected[key] = i;
+    }
+    AVLTree<int, int> avl;
+    avl.buildFromUnsorted(items.begin(), items.end());
+    CHECK(avl.verifyBalances());
+    CHECK(sameItems(avl, expected));
+}
+
+/**
+ * lower_bound, upper_bound and equal_range agree with std::map for keys
+ * inside, between and outside the stored ones.
+ */
+template <typename Tree>
+void checkBounds(const Tree &tree, const map<int, int> &expected, int keyRange)
+{
+    for (int key = -5; key < keyRange + 5; ++key)
+    {
+        map<int, int>::const_iterator lower = expected.lower_bound(key);
+        map<int, int>::const_iterator upper = expected.upper_bound(key);
+        typename Tree::iterator treeLower = tree.lower_bound(key);
+        typename Tree::iterator treeUpper = tree.upper_bound(key);
+        CHECK((lower == expected.end()) == (treeLower == tree.end()));
+        CHECK(lower == expected.end() || treeLower->first == lower->first);
+        CHECK((upper == expected.end()) == (treeUpper == tree.end()));
+        CHECK(upper == expected.end() || treeUpper->first == upper->first);
+
+        pair<typename Tree::iterator, typename Tree::iterator> equal = tree.equal_range(key);
+        CHECK(static_cast<size_t>(distance(equal.first, equal.second)) == expected.count(key));
+    }
+}
+
+/**
+ * The bounds, and range() views over random intervals, on random trees.
+ */
+static void testRanges()
+{
+    mt19937 rng(3);
+    AVLTree<int, int> avl;
+    BinarySearchTree<int, int> plain;
+    map<int, int> expected;
+    for (int i = 0; i < 2000; ++i)
+    {
+        int key = static_cast<int>(rng() % 5000);
+        avl.insert(make_pair(key, i));
+        plain.insert(make_pair(key, i));
+        expected[key] = i;
+    }
+    checkBounds(avl, expected, 5000);
+    checkBounds(plain, expected, 5000);
+
+    for (int round = 0; round < 200; ++round)
+    {
+        int lo = static_cast<int>(rng() % 5000);
+        int hi = static_cast<int>(rng() % 5000);
+        vector<int> seen;
+        for (AVLTree<int, int>::iterator it = avl.range(lo, hi).begin(); it != avl.range(lo, hi).end(); ++it)
+        {
+            seen.push_back(it->first);
+        }
+        vector<int> wanted;
+        for (map<int, int>::iterator it = expected.lower_bound(lo); lo < hi && it != expected.lower_bound(hi); ++it)
+        {
+            wanted.push_back(it->first);
+        }
+        CHECK(seen == wanted);
+        CHECK(avl.range(lo, hi).empty() == wanted.empty());
+    }
+
+    AVLTree<int, int> empty;
+    CHECK(empty.lower_bound(0) == empty.end() && empty.range(0, 10).empty());
+}
+
+/**
+ * select and rank on a Ranked tree agree with positions in a std::map,
+ * through inserts, removes and a sorted build.
+ */
+static void testRankSelect()
+{
+    typedef AVLTree<int, int, NodePool, true> RankedTree;
+    mt19937 rng(5);
+    for (int round = 0; round < 10; ++round)
+    {
+        RankedTree tree;
+        map<int, int> expected;
+        if (round % 3 == 0)
+        {
+            vector<pair<int, int> > items;
+            for (int i = 0; i < round * 40; ++i)
+            {
+                items.push_back(make_pair(i * 2, i));
+                expected[i * 2] = i;
+            }
+            tree.buildFromSorted(items.begin(), items.end());
+        }
+        for (int i = 0; i < 3000; ++i)
+        {
+            int key = static_cast<int>(rng() % 800);
+            if (rng() % 3 != 0)
+            {
+                tree.insert(make_pair(key, i));
+                expected[key] = i;
+            }
+            else
+            {
+                tree.remove(key);
+                expected.erase(key);
+            }
+        }
+        size_t index = 0;
+        for (map<int, int>::iterator it = expected.begin(); it != expected.end(); ++it, ++index)
+        {
+            CHECK(tree.select(index) != tree.end() && tree.select(index)->first == it->first);
+        }
+        CHECK(tree.select(index) == tree.end());
+        for (int key = -1; key < 802; ++key)
+        {
+            CHECK(tree.rank(key) == static_cast<size_t>(distance(expected.begin(), expected.lower_bound(key))));
+        }
+    }
+}
+
+/**
+ * Exposes the protected internals the balance tests need.
+ */
+struct OpenBST : BinarySearchTree<int, int>
+{
+    // the slow definition: every node's subtrees differ in height by at most one
+    bool bruteBalanced(Node<int, int> *node) const
+    {
+        return node == nullptr ||
+               (std::abs(heightOfNode(node->getLeft()) - heightOfNode(node->getRight())) <= 1 &&
+                bruteBalanced(node->getLeft()) && bruteBalanced(node->getRight()));
+    }
+    bool bruteBalanced() const
+    {
+        return bruteBalanced(root_);
+    }
+};
+
+struct OpenAVL : AVLTree<int, int>
+{
+    void corruptRootBalance()
+    {
+        AVLNode<int, int> *root = static_cast<AVLNode<int, int> *>(root_);
+        root->setBalance(root->getBalance() == 0 ? 1 : 0);
+    }
+};
+
+/**
+ * isBalanced agrees with the quadratic definition, verifyBalances catches
+ * a wrong stored balance, and both cope with degenerate trees.
+ */
+static void testBalanceChecks()
+{
+    mt19937 rng(9);
+    int balanced = 0;
+    for (int round = 0; round < 3000; ++round)
+    {
+        OpenBST tree;
+        int n = static_cast<int>(rng() % 20);
+        for (int i = 0; i < n; ++i)
+        {
+            tree.insert(make_pair(static_cast<int>(rng() % 30), 0));
+        }
+        CHECK(tree.isBalanced() == tree.bruteBalanced());
+        balanced += tree.isBalanced() ? 1 : 0;
+    }
+    CHECK(balanced > 0 && balanced < 3000);
+
+    OpenAVL avl;
+    for (int i = 0; i < 100; ++i)
+    {
+        avl.insert(make_pair(i, i));
+    }
+    CHECK(avl.isBalanced() && avl.verifyBalances());
+    avl.corruptRootBalance();
+    CHECK(avl.isBalanced() && !avl.verifyBalances());
+
+    // a sorted BST is a 30000-deep list, which must not overflow the stack
+    BinarySearchTree<int, int> list;
+    for (int i = 0; i < 30000; ++i)
+    {
+        list.insert(make_pair(i, i));
+    }
+    CHECK(!list.isBalanced());
+    list.clear();
+    CHECK(list.empty());
+}
+
+/**
+ * Orders ints, but throws when asked to compare 13, to fail a write midway.
+ */
+struct UnluckyLess
+{
+    bool operator()(int a, int b) const
+    {
+        if (a == 13 || b == 13)
+            throw runtime_error("unlucky key");
+        return a < b;
+    }
+};
+
+/**
+ * A ConcurrentAVLTree that shows its version, to check writes leave it even.
+ */
+class VersionedTree : public ConcurrentAVLTree<int, int, UnluckyLess>
+{
+public:
+    unsigned long version() const { return version_.load(); }
+};
+
+/**
+ * ConcurrentAVLTree agrees with std::map single-threaded, a write that
+ * throws still ends, and readers running beside a writer only ever see
+ * values the writer stored.
+ */
+static void testConcurrentAVLTree()
+{
+    VersionedTree unlucky;
+    for (int key = 0; key < 10; ++key)
+    {
+        unlucky.insert(make_pair(key * 3, key));
+    }
+    bool threw = false;
+    try
+    {
+        unlucky.insert(make_pair(13, 0));
+    }
+    catch (const runtime_error &)
+    {
+        threw = true;
+    }
+    CHECK(threw && unlucky.version() % 2 == 0);
+    unlucky.insert(make_pair(14, 1));
+    int value = -1;
+    CHECK(unlucky.version() % 2 == 0 && unlucky.find(14, value) && value == 1 && unlucky.contains(27));
+
+    ConcurrentAVLTree<int, int> tree;
+    map<int, int> expected;
+    mt19937 rng(8);
+    for (int i = 0; i < 5000; ++i)
+    {
+        int key = static_cast<int>(rng() % 700);
+        if (rng() % 3 != 0)
+        {
+            tree.insert(make_pair(key, i));
+            expected[key] = i;
+        }
+        else
+        {
+            tree.remove(key);
+            expected.erase(key);
+        }
+    }
+    for (int key = 0; key < 700; ++key)
+    {
+        int value = -1;
+        bool found = tree.find(key, value);
+        CHECK(found == (expected.count(key) == 1));
+        CHECK(!found || value == expected[key]);
+    }
+    tree.clear();
+    CHECK(!tree.contains(expected.begin()->first));
+
+    // even keys below 20000 stay put; odd keys come and go, always as key * 10
+    for (int key = 0; key < 20000; key += 2)
+    {
+        tree.insert(make_pair(key, key * 10));
+    }
+    atomic<bool> stop(false);
+    atomic<int> wrong(0);
+    vector<thread> readers;
+    for (int r = 0; r < 3; ++r)
+    {
+        readers.push_back(thread([&tree, &stop, &wrong, r]()
+                                 {
+                                     mt19937 local(r);
+                                     while (!stop.load())
+                                     {
+                                         int key = static_cast<int>(local() % 40000);
+                                         int value;
+                                         bool found = tree.find(key, value);
+                                         if ((found && value != key * 10) || (key < 20000 && key % 2 == 0 && !found))
+                                             ++wrong;
+                                     } }));
+    }
+    for (int round = 0; round < 5; ++round)
+    {
+        for (int key = 1; key < 40000; key += 2)
+        {
+            tree.insert(make_pair(key, key * 10));
+        }
+        for (int key = 1; key < 40000; key += 2)
+        {
+            tree.remove(key);
+        }
+    }
+    stop.store(true);
+    for (size_t r = 0; r < readers.size(); ++r)
+    {
+        readers[r].join();
+    }
+    CHECK(wrong.load() == 0);
+}
+
+/**
+ * True if snapshot holds exactly the items of expected, in order, and
+ * finds each of them.
+ */
+template <typename Snapshot>
+bool sameSnapshot(const Snapshot &snapshot, const map<int, string> &expected)
+{
+    typename Snapshot::iterator it = snapshot.begin();
+    for (map<int, string>::const_iterator e = expected.begin(); e != expected.end(); ++e, ++it)
+    {
+        if (it == snapshot.end() || it->first != e->first || it->second != e->second)
+            return false;
+        if (snapshot.find(e->first) == snapshot.end() || snapshot.find(e->first)->second != e->second)
+            return false;
+    }
+    return it == snapshot.end() && snapshot.empty() == expected.empty();
+}
+
+/**
+ * Snapshots keep showing the tree as it was, through inserts, overwrites,
+ * removes, batches, hinted inserts and clear(), while the live tree
+ * agrees with std::map; and a snapshot can be scanned on another thread
+ * while the tree changes.
+ */
+static void testSnapshots()
+{
+    typedef SnapshotAVLTree<int, string> Tree;
+    mt19937 rng(11);
+    for (int round = 0; round < 20; ++round)
+    {
+        Tree tree;
+        map<int, string> expected;
+        vector<pair<Tree::Snapshot, map<int, string> > > snapshots;
+        for (int i = 0; i < 2000; ++i)
+        {
+            int key = static_cast<int>(rng() % 300);
+            unsigned op = rng() % 20;
+            if (op < 9)
+            {
+                tree.insert(make_pair(key, to_string(i)));
+                expected[key] = to_string(i);
+            }
+            else if (op < 16)
+            {
+                tree.remove(key);
+                expected.erase(key);
+            }
+            else if (op == 16)
+            {
+                vector<pair<int, string> > batch;
+                for (int j = 0; j < 10; ++j)
+                {
+                    batch.push_back(make_pair(static_cast<int>(rng() % 300), "b" + to_string(i)));
+                    expected[batch.back().first] = batch.back().second;
+                }
+                tree.insertBatch(batch.begin(), batch.end());
+            }
+            else if (op == 17)
+            {
+                tree.insert(tree.find(key), make_pair(key + 1, string("hint")));
+                expected[key + 1] = "hint";
+            }
+            else
+            {
+                snapshots.push_back(make_pair(tree.snapshot(), expected));
+            }
+            if (rng() % 50 == 0 && !snapshots.empty())
+            {
+                snapshots.erase(snapshots.begin() + rng() % snapshots.size());
+            }
+            if (i == 1000 && round % 3 == 0)
+            {
+                tree.clear();
+                expected.clear();
+            }
+        }
+        CHECK(tree.verifyBalances());
+        CHECK(sameItems(tree, expected));
+        for (size_t s = 0; s < snapshots.size(); ++s)
+        {
+            CHECK(sameSnapshot(snapshots[s].first, snapshots[s].second));
+        }
+    }
+
+    SnapshotAVLTree<int, int> tree;
+    for (int i = 0; i < 100000; ++i)
+    {
+        tree.insert(make_pair(i, i));
+    }
+    SnapshotAVLTree<int, int>::Snapshot snapshot = tree.snapshot();
+    long count = 0;
+    long sum = 0;
+    thread scanner([&snapshot, &count, &sum]()
+                   {
+                       for (SnapshotAVLTree<int, int>::Snapshot::iterator it = snapshot.begin(); it != snapshot.end(); ++it)
+                       {
+                           ++count;
+                           sum += it->second;
+                       } });
+    for (int i = 0; i < 100000; i += 3)
+    {
+        tree.remove(i);
+    }
+    for (int i = 0; i < 50000; ++i)
+    {
+        tree.insert(make_pair(i * 7 + 1000000, 1));
+    }
+    for (int i = 1; i < 100000; i += 3)
+    {
+        tree[i] = -i;
+    }
+    scanner.join();
+    CHECK(count == 100000 && sum == 4999950000L);
+    CHECK(tree[4] == -4 && snapshot.find(4)->second == 4);
+
+    // writing goes through operator[], which copies, never through iterators
+    static_assert(is_const<remove_reference<decltype(*tree.begin())>::type>::value &&
+                      is_const<remove_reference<decltype(*tree.find(4))>::type>::value &&
+                      is_const<remove_reference<decltype(*tree.try_emplace(5, 5).first)>::type>::value,
+                  "the live tree's iterators must be read-only");
+    SnapshotAVLTree<int, int>::Snapshot before = tree.snapshot();
+    tree[4] = 40;
+    tree[1000000] = 2;
+    CHECK(tree[4] == 40 && before.find(4)->second == -4 && before.find(1000000)->second == 1);
+    CHECK(tree.find(1000000)->second == 2 && tree.range(4, 5).begin()->second == 40);
+    bool threw = false;
+    try
+    {
+        tree[3] = 0;
+    }
+    catch (const out_of_range &)
+    {
+        threw = true;
+    }
+    CHECK(threw && before.find(3) == before.end());
+}
+
+/**
+ * A value that counts how it was made, to catch hidden temporaries.
+ */
+struct Counted
+{
+    static int made, copied, moved;
+    int value;
+    explicit Counted(int v = 0) : value(v) { ++made; }
+    Counted(const Counted &other) : value(other.value) { ++copied; }
+    Counted(Counted &&other) : value(other.value) { ++moved; }
+    Counted &operator=(const Counted &other)
+    {
+        value = other.value;
+        ++copied;
+        return *this;
+    }
+    Counted &operator=(Counted &&other)
+    {
+        value = other.value;
+        ++moved;
+        return *this;
+    }
+    bool operator==(const Counted &other) const { return value == other.value; }
+    static void reset() { made = copied = moved = 0; }
+};
+ostream &operator<<(ostream &out, const Counted &counted)
+{
+    return out << counted.value;
+}
+int Counted::made = 0;
+int Counted::copied = 0;
+int Counted::moved = 0;
+
+/**
+ * emplace and try_emplace against std::map, on any tree with int keys.
+ */
+template <typename Tree>
+void emplaceOps(Tree &tree, unsigned seed)
+{
+    mt19937 rng(seed);
+    map<int, Counted> expected;
+    for (int i = 0; i < 5000; ++i)
+    {
+        int key = static_cast<int>(rng() % 500);
+        unsigned op = rng() % 4;
+        if (op == 0)
+        {
+            bool inserted = tree.emplace(key, i).second;
+            CHECK(inserted == expected.emplace(key, Counted(i)).second);
+        }
+        else if (op == 1)
+        {
+            typename Tree::iterator it = tree.try_emplace(key, i).first;
+            CHECK(it->first == key && it->second == expected.emplace(key, Counted(i)).first->second);
+        }
+        else if (op == 2)
+        {
+            bool inserted = tree.emplace(piecewise_construct, forward_as_tuple(key), forward_as_tuple(i)).second;
+            CHECK(inserted == expected.emplace(key, Counted(i)).second);
+        }
+        else
+        {
+            tree.remove(key);
+            expected.erase(key);
+        }
+    }
+    CHECK(sameItems(tree, expected));
+}
+
+/**
+ * emplace builds the item right in its node, and try_emplace leaves its
+ * arguments alone when the key is already there.
+ */
+static void testEmplace()
+{
+    BinarySearchTree<int, Counted> bst;
+    AVLTree<int, Counted> avl;
+    AVLTree<int, Counted, NodePool, true> ranked;
+    SnapshotAVLTree<int, Counted> versioned;
+    emplaceOps(bst, 12);
+    emplaceOps(avl, 13);
+    emplaceOps(ranked, 14);
+    SnapshotAVLTree<int, Counted>::Snapshot before = versioned.snapshot();
+    emplaceOps(versioned, 15);
+    CHECK(avl.verifyBalances() && ranked.verifyBalances() && versioned.verifyBalances());
+    CHECK(before.begin() == before.end());
+
+    Counted::reset();
+    CHECK(avl.emplace(1000, 7).second);
+    CHECK(Counted::made == 1 && Counted::copied == 0 && Counted::moved == 0);
+    CHECK(!avl.emplace(1000, 8).second && avl.find(1000)->second.value == 7);
+    CHECK(avl.try_emplace(1001, 9).second);
+    CHECK(Counted::made == 3 && Counted::copied == 0 && Counted::moved == 0);
+    CHECK(!avl.try_emplace(1001, 10).second);
+    CHECK(Counted::made == 3);
+
+    AVLTree<string, string> strings;
+    string key = "key";
+    string value = "value";
+    CHECK(strings.try_emplace(move(key), move(value)).second);
+    CHECK(key.empty() && value.empty() && strings["key"] == "value");
+    key = "key";
+    value = "other";
+    CHECK(!strings.try_emplace(move(key), move(value)).second);
+    CHECK(key == "key" && value == "other" && strings["key"] == "value");
+}
+
+/**
+ * A key that counts how often one is built, so lookups can prove they
+ * compare against the probe without converting it.
+ */
+struct Ticket
+{
+    static int made;
+    int number;
+    explicit Ticket(int n) : number(n) { ++made; }
+    Ticket(const Ticket &other) : number(other.number) { ++made; }
+    bool operator!=(const Ticket &other) const { return number != other.number; }
+    bool operator<(const Ticket &other) const { return number < other.number; } // for print()
+};
+int Ticket::made = 0;
+ostream &operator<<(ostream &out, const Ticket &ticket)
+{
+    return out << ticket.number;
+}
+
+/**
+ * Orders Tickets, and Tickets against plain ints.
+ */
+struct TicketLess
+{
+    typedef void is_transparent;
+    bool operator()(const Ticket &a, const Ticket &b) const { return a.number < b.number; }
+    bool operator()(const Ticket &a, int b) const { return a.number < b; }
+    bool operator()(int a, const Ticket &b) const { return a < b.number; }
+};
+
+/**
+ * Random inserts and removes under a custom order, checked against a
+ * std::map with the same order, and lookups with it.
+ */
+template <typename Tree>
+void orderedOps(Tree &tree, unsigned seed)
+{
+    mt19937 rng(seed);
+    map<int, int, greater<int> > expected;
+    for (int i = 0; i < 5000; ++i)
+    {
+        int key = static_cast<int>(rng() % 400);
+        if (rng() % 3 != 0)
+        {
+            tree.insert(make_pair(key, i));
+            expected[key] = i;
+        }
+        else
+        {
+            tree.remove(key);
+            expected.erase(key);
+        }
+    }
+    CHECK(sameItems(tree, expected));
+    for (int key = -1; key <= 400; ++key)
+    {
+        typename Tree::iterator lower = tree.lower_bound(key);
+        map<int, int, greater<int> >::iterator expectedLower = expected.lower_bound(key);
+        CHECK(expectedLower == expected.end() ? lower == tree.end() : lower->first == expectedLower->first);
+        CHECK((tree.find(key) != tree.end()) == (expected.count(key) == 1));
+    }
+}
+
+/**
+ * Trees under a Compare other than std::less, and the heterogeneous
+ * lookups a transparent Compare enables.
+ */
+static void testCompare()
+{
+    BinarySearchTree<int, int, NodePool, greater<int> > bst;
+    AVLTree<int, int, NodePool, false, greater<int> > avl;
+    AVLTree<int, int, NodePool, true, greater<int> > ranked;
+    SnapshotAVLTree<int, int, NodePool, greater<int> > versioned;
+    orderedOps(bst, 16);
+    orderedOps(avl, 17);
+    orderedOps(ranked, 18);
+    orderedOps(versioned, 19);
+    CHECK(avl.verifyBalances() && ranked.verifyBalances() && versioned.verifyBalances());
+    if (ranked.begin() != ranked.end())
+    {
+        CHECK(ranked.select(0) == ranked.begin() && ranked.rank(ranked.begin()->first) == 0);
+    }
+
+    AVLTree<Ticket, int, NodePool, false, TicketLess> tickets;
+    map<int, int> expected;
+    mt19937 rng(20);
+    for (int i = 0; i < 2000; ++i)
+    {
+        int number = static_cast<int>(rng() % 1000) * 2;
+        tickets.insert(make_pair(Ticket(number), i));
+        expected[number] = i;
+    }
+    Ticket::made = 0;
+    for (int probe = -1; probe <= 2001; ++probe)
+    {
+        AVLTree<Ticket, int, NodePool, false, TicketLess>::iterator found = tickets.find(probe);
+        CHECK(expected.count(probe) == 1 ? found != tickets.end() && found->second == expected[probe] : found == tickets.end());
+        AVLTree<Ticket, int, NodePool, false, TicketLess>::iterator lower = tickets.lower_bound(probe);
+        map<int, int>::iterator expectedLower = expected.lower_bound(probe);
+        CHECK(expectedLower == expected.end() ? lower == tickets.end() : lower->first.number == expectedLower->first);
+        AVLTree<Ticket, int, NodePool, false, TicketLess>::iterator upper = tickets.upper_bound(probe);
+        map<int, int>::iterator expectedUpper = expected.upper_bound(probe);
+        CHECK(expectedUpper == expected.end() ? upper == tickets.end() : upper->first.number == expectedUpper->first);
+        CHECK(tickets.equal_range(probe) == make_pair(lower, upper));
+    }
+    CHECK(Ticket::made == 0);
+}
+
+/**
+ * True if frozen holds exactly the items of expected, forwards and backwards.
+ */
+template <typename Frozen>
+bool sameFrozen(const Frozen &frozen, const map<int, string> &expected)
+{
+    if (frozen.size() != expected.size() || frozen.empty() != expected.empty())
+        return false;
+    typename Frozen::iterator it = frozen.begin();
+    for (map<int, string>::const_iterator e = expected.begin(); e != expected.end(); ++e, ++it)
+    {
+        if (it == frozen.end() || it->first != e->first || it->second != e->second)
+            return false;
+    }
+    if (it != frozen.end())
+        return false;
+    typename Frozen::reverse_iterator back = frozen.rbegin();
+    for (map<int, string>::const_reverse_iterator e = expected.rbegin(); e != expected.rend(); ++e, ++back)
+    {
+        if (back == frozen.rend() || back->first != e->first)
+            return false;
+    }
+    return back == frozen.rend();
+}
+
+/**
+ * FrozenTree lookups against std::map, at every size up to a few
+ * complete Eytzinger levels and for larger random trees.
+ */
+static void testFrozenTree()
+{
+    mt19937 rng(21);
+    for (int n = 0; n < 3000; n += (n < 70 ? 1 : 97))
+    {
+        AVLTree<int, string> tree;
+        map<int, string> expected;
+        while (static_cast<int>(expected.size()) < n)
+        {
+            int key = static_cast<int>(rng() % (4 * n + 1)) * 2;
+            tree.insert(make_pair(key, to_string(key)));
+            expected[key] = to_string(key);
+        }
+        FrozenTree<int, string> frozen = tree.freeze();
+        CHECK(sameFrozen(frozen, expected));
+        for (int key = -1; key <= 8 * n + 2; ++key)
+        {
+            map<int, string>::iterator expectedLower = expected.lower_bound(key);
+            FrozenTree<int, string>::iterator lower = frozen.lower_bound(key);
+            CHECK(expectedLower == expected.end() ? lower == frozen.end() : lower->first == expectedLower->first);
+            FrozenTree<int, string>::iterator found = frozen.find(key);
+            CHECK(expected.count(key) == 1 ? found != frozen.end() && found->second == expected[key] : found == frozen.end());
+        }
+    }
+
+    map<int, string> expected;
+    expected[3] = "three";
+    expected[1] = "one";
+    FrozenTree<int, string> frozen(expected.begin(), expected.end());
+    CHECK(frozen[3] == "three" && frozen[1] == "one");
+    bool threw = false;
+    try
+    {
+        frozen[2];
+    }
+    catch (const out_of_range &)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+
+    FrozenTree<int, int, greater<int> > descending = AVLTree<int, int, NodePool, false, greater<int> >().freeze();
+    CHECK(descending.empty() && descending.find(1) == descending.end());
+    AVLTree<int, int, NodePool, false, greater<int> > reversed;
+    for (int i = 0; i < 100; ++i)
+    {
+        reversed.insert(make_pair(i, i));
+    }
+    descending = reversed.freeze();
+    CHECK(descending.begin()->first == 99 && descending.lower_bound(50)->first == 50 && descending.find(100) == descending.end());
+}
+
+/**
+ * A value that counts its live copies, to catch items a BTree leaks or
+ * destroys twice while it shifts them between nodes.
+ */
+struct Tracked
+{
+    static int live;
+    string text;
+    Tracked() { ++live; }
+    explicit Tracked(const string &t) : text(t) { ++live; }
+    Tracked(const Tracked &other) : text(other.text) { ++live; }
+    ~Tracked() { --live; }
+    Tracked &operator=(const Tracked &other)
+    {
+        text = other.text;
+        return *this;
+    }
+    bool operator==(const Tracked &other) const { return text == other.text; }
+};
+int Tracked::live = 0;
+ostream &operator<<(ostream &out, const Tracked &tracked)
+{
+    return out << tracked.text;
+}
 
+/**
+ * Grows tree to thousands of items and shrinks it to nothing, with random
+ * inserts, removes and lookups checked against a std::map on the way.
+ */
+template <typename Tree>
+void btreeOps(Tree &tree, unsigned seed, int keyRange)
+{
+    mt19937 rng(seed);
+    map<int, Tracked> expected;
+    for (int phase = 0; phase < 3; ++phase)
+    {
+        // mostly inserts, then mostly removes, then a mix
+        unsigned insertShare = phase == 0 ? 8 : (phase == 1 ? 2 : 5);
+        for (int i = 0; i < 20000; ++i)
+        {
+            int key = static_cast<int>(rng() % keyRange);
+            if (rng() % 10 < insertShare)
+            {
+                Tracked value(to_string(i));
+                tree.insert(make_pair(key, value));
+                expected[key] = value;
+            }
+            else
+            {
+                tree.remove(key);
+                expected.erase(key);
+            }
+            if (i % 1000 == 0)
+            {
+                CHECK(tree.size() == expected.size() && sameItems(tree, expected) && sameItemsBackwards(tree, expected));
+            }
+        }
+        CHECK(tree.size() == expected.size() && sameItems(tree, expected) && sameItemsBackwards(tree, expected));
+        for (int key = -1; key <= keyRange; ++key)
+        {
+            typename Tree::iterator lower = tree.lower_bound(key);
+            map<int, Tracked>::iterator expectedLower = expected.lower_bound(key);
+            CHECK(expectedLower == expected.end() ? lower == tree.end() : lower->first == expectedLower->first);
+            typename Tree::iterator upper = tree.upper_bound(key);
+            map<int, Tracked>::iterator expectedUpper = expected.upper_bound(key);
+            CHECK(expectedUpper == expected.end() ? upper == tree.end() : upper->first == expectedUpper->first);
+            CHECK((tree.find(key) != tree.end()) == (expected.count(key) == 1));
+        }
+    }
+    for (map<int, Tracked>::iterator e = expected.begin(); e != expected.end(); ++e)
+    {
+        tree.remove(e->first);
+    }
+    CHECK(tree.empty() && tree.begin() == tree.end());
+}
+
+/**
+ * BTree against std::map, for sparse and dense keys, with no item leaked
+ * or destroyed twice.
+ */
+static void testBTree()
+{
+    {
+        BTree<int, Tracked> sparse;
+        btreeOps(sparse, 22, 5000);
+        BTree<int, Tracked> dense;
+        btreeOps(dense, 23, 300);
+        sparse.insert(make_pair(1, Tracked("one")));
+        sparse.insert(make_pair(1, Tracked("uno")));
+        CHECK(sparse.size() == 1 && sparse[1].text == "uno");
+    }
+    CHECK(Tracked::live == 0);
+
+    BTree<long, long> sequential;
+    for (long i = 0; i < 100000; ++i)
+    {
+        sequential.insert(make_pair(i, -i));
+    }
+    long sum = 0;
+    for (BTree<long, long>::iterator it = sequential.begin(); it != sequential.end(); ++it)
+    {
+        sum += it->second;
+    }
+    CHECK(sum == -4999950000L && sequential.find(99999)->second == -99999);
+    for (long i = 0; i < 100000; i += 2)
+    {
+        sequential.remove(i);
+    }
+    CHECK(sequential.size() == 50000 && sequential.begin()->first == 1 && sequential.lower_bound(50000)->first == 50001);
+
+    // stepping back across leaves, from end() and from the middle
+    BTree<long, long>::iterator last = sequential.end();
+    --last;
+    BTree<long, long>::iterator middle = sequential.lower_bound(50000);
+    BTree<long, long>::iterator before = middle--;
+    CHECK(last->first == 99999 && middle->first == 49999 && before->first == 50001);
+    long expectedKey = 49999;
+    bool ordered = true;
+    for (BTree<long, long>::iterator it = middle; expectedKey > 1; expectedKey -= 2)
+    {
+        ordered = ordered && it->first == expectedKey;
+        --it;
+    }
+    CHECK(ordered && (++middle)->first == 50001 && (--sequential.rend())->first == 1);
+    CHECK(sequential.rbegin()->first == 99999 && --(++sequential.begin()) == sequential.begin());
+    sequential.clear();
+    CHECK(sequential.empty());
+}
+
+/**
+ * Every KeySearch path for one integer key type against std::upper_bound
+ * and std::lower_bound, on sorted arrays of every length a node can have,
+ * drawn from a few values around zero and the ends of the type's range.
+ */
+template <typename Key>
+void keySearchAgainstStd(unsigned seed)
+{
+    typedef KeySearch<Key, less<Key> > Search;
+    mt19937_64 rng(seed);
+    const Key edges[] = {numeric_limits<Key>::min(), static_cast<Key>(numeric_limits<Key>::min() + 1), static_cast<Key>(-1),
+                         0, 1, static_cast<Key>(numeric_limits<Key>::max() - 1), numeric_limits<Key>::max(),
+                         static_cast<Key>(Key(1) << (8 * sizeof(Key) - 2))};
+    for (size_t n = 0; n <= 40; ++n)
+    {
+        for (int round = 0; round < 20; ++round)
+        {
+            vector<Key> keys(n);
+            vector<pair<const Key, int> > items;
+            for (size_t i = 0; i < n; ++i)
+            {
+                keys[i] = (rng() % 2) ? edges[rng() % 8] : static_cast<Key>(rng());
+            }
+            sort(keys.begin(), keys.end());
+            for (size_t i = 0; i < n; ++i)
+            {
+                items.push_back(make_pair(keys[i], 0));
+            }
+            for (int probe = 0; probe < 16; ++probe)
+            {
+                Key key = (probe < 8) ? edges[probe] : (n != 0 && probe < 12) ? keys[rng() % n] : static_cast<Key>(rng());
+                size_t upper = upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+                size_t lower = lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+                CHECK(Search::countNotGreater(keys.data(), n, key, less<Key>()) == upper);
+                CHECK(key_search_detail::countNotGreaterScalar(keys.data(), n, key) == upper);
+                CHECK(Search::countLessItems(items.data(), n, key, less<Key>()) == lower);
+                CHECK(Search::countNotGreaterItems(items.data(), n, key, less<Key>()) == upper);
+#ifdef KEY_SEARCH_X86
+                // the vector paths directly, whichever one Search picked
+                const uint64_t flip = key_search_detail::SignFlip<Key>::value;
+                if (sizeof(Key) == 4)
+                {
+                    CHECK(key_search_detail::countNotGreater32(reinterpret_cast<const int32_t *>(keys.data()), n,
+                                                               static_cast<int32_t>(key), static_cast<uint32_t>(flip)) == upper);
+                }
+                else if (sizeof(Key) == 8 && key_search_detail::haveAvx2())
+                {
+                    CHECK(key_search_detail::countNotGreater64Avx2(reinterpret_cast<const int64_t *>(keys.data()), n,
+                                                                   static_cast<int64_t>(key), flip) == upper);
+                }
+#endif
+            }
+        }
+    }
+}
+
+/**
+ * The SIMD, scalar and binary node searches all agree with the standard
+ * library, for signed and unsigned keys of both widths and for keys that
+ * take the scalar and binary paths.
+ */
+static void testKeySearch()
+{
+    keySearchAgainstStd<int32_t>(24);
+    keySearchAgainstStd<uint32_t>(25);
+    keySearchAgainstStd<int64_t>(26);
+    keySearchAgainstStd<uint64_t>(27);
+    keySearchAgainstStd<int16_t>(28);
+
+    typedef KeySearch<double, less<double> > DoubleSearch;
+    const double doubles[] = {-1.5, 0.0, 0.5, 2.0, 2.0, 7.25};
+    CHECK(DoubleSearch::countNotGreater(doubles, 6, 2.0, less<double>()) == 5);
+    CHECK(DoubleSearch::countNotGreater(doubles, 6, -2.0, less<double>()) == 0);
+    typedef KeySearch<string, less<string> > StringSearch;
+    const string strings[] = {"ant", "bee", "cat", "dog"};
+    CHECK(StringSearch::countNotGreater(strings, 4, string("bz"), less<string>()) == 2);
+    CHECK(StringSearch::countNotGreater(strings, 4, string("dog"), less<string>()) == 4);
+    typedef KeySearch<int, greater<int> > DescendingSearch;
+    const int descending[] = {9, 7, 7, 3};
+    CHECK(DescendingSearch::countNotGreater(descending, 4, 7, greater<int>()) == 3);
+}
+
+/**
+ * insertBatch against std::map: batches from one item to several times the
+ * tree's size, with repeated keys in a batch, where the last value wins.
+ */
+template <typename Tree>
+void batchOps(Tree &tree, unsigned seed)
+{
+    mt19937 rng(seed);
+    map<int, int> expected;
+    for (int round = 0; round < 60; ++round)
+    {
+        size_t batchSize = (round % 4 == 0) ? 1 : rng() % (round % 3 == 0 ? 4000 : 100);
+        int keyRange = (round % 5 == 0) ? 50 : 10000;
+        vector<pair<int, int> > batch;
+        for (size_t i = 0; i < batchSize; ++i)
+        {
+            batch.push_back(make_pair(static_cast<int>(rng() % keyRange), round * 10000 + static_cast<int>(i)));
+            expected[batch.back().first] = batch.back().second;
+        }
+        tree.insertBatch(batch.begin(), batch.end());
+        for (int i = 0; i < 20; ++i)
+        {
+            int key = static_cast<int>(rng() % keyRange);
+            tree.remove(key);
+            expected.erase(key);
+        }
+        CHECK(sameItems(tree, expected));
+        CHECK(tree.verifyBalances());
+    }
+    tree.insertBatch(expected.begin(), expected.begin());
+    CHECK(sameItems(tree, expected));
+}
+
+/**
+ * Batched inserts into every kind of AVL tree, and from input that is not
+ * random access.
+ */
+static void testInsertBatch()
+{
+    AVLTree<int, int> avl;
+    AVLTree<int, int, NodePool, true> ranked;
+    SnapshotAVLTree<int, int> versioned;
+    batchOps(avl, 29);
+    batchOps(ranked, 30);
+    batchOps(versioned, 31);
+    size_t i = 0;
+    for (AVLTree<int, int, NodePool, true>::iterator it = ranked.begin(); it != ranked.end(); ++it, ++i)
+    {
+        CHECK(ranked.select(i) == it && ranked.rank(it->first) == i);
+    }
+
+    map<int, int> source;
+    for (int key = 0; key < 1000; key += 3)
+    {
+        source[key] = -key;
+    }
+    AVLTree<int, int> fromMap;
+    fromMap.insert(make_pair(3, 3));
+    fromMap.insert(make_pair(4, 4));
+    fromMap.insertBatch(source.begin(), source.end());
+    source[4] = 4;
+    CHECK(sameItems(fromMap, source) && fromMap.verifyBalances());
+}
+
+typedef AVLTree<int, Tracked, NodePool, true> SetTree;
+
+/**
+ * Fills tree and expected with count random keys below keyRange, the
+ * values tagged with tag so that the two sides of a set operation differ.
+ */
+static void fillRandom(SetTree &tree, map<int, Tracked> &expected, mt19937 &rng, int count, int keyRange, const string &tag)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        int key = static_cast<int>(rng() % keyRange);
+        tree.insert(make_pair(key, Tracked(tag + to_string(i))));
+        expected[key] = Tracked(tag + to_string(i));
+    }
+}
+
+/**
+ * True if tree matches expected and its balances and subtree sizes are right.
+ */
+static bool validSetTree(const SetTree &tree, const map<int, Tracked> &expected)
+{
+    if (!sameItems(tree, expected) || !tree.verifyBalances())
+        return false;
+    size_t i = 0;
+    for (SetTree::iterator it = tree.begin(); it != tree.end(); ++it, ++i)
+    {
+        if (i % 97 == 0 && (tree.select(i) != it || tree.rank(it->first) != i))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Union, intersection and difference against std::map, for trees of very
+ * different sizes and overlaps, on one thread or (given a pool) many.
+ */
+static void setOps(unsigned seed, TaskPool *pool)
+{
+    mt19937 rng(seed);
+    const int sizes[][2] = {{0, 100}, {100, 0}, {1, 30000}, {30000, 1}, {2000, 20000}, {20000, 20000}, {30000, 1000}};
+    for (int round = 0; round < 21; ++round)
+    {
+        int aCount = sizes[round % 7][0];
+        int bCount = sizes[round % 7][1];
+        int keyRange = (round / 7 == 0) ? 100000 : (round / 7 == 1 ? 30000 : 400000);
+        SetTree a, b;
+        map<int, Tracked> aItems, bItems;
+        fillRandom(a, aItems, rng, aCount, keyRange, "a");
+        fillRandom(b, bItems, rng, bCount, keyRange, "b");
+
+        map<int, Tracked> expected;
+        int op = round % 3;
+        if (op == 0)
+        {
+            expected = aItems;
+            for (map<int, Tracked>::iterator it = bItems.begin(); it != bItems.end(); ++it)
+                expected[it->first] = it->second;
+            pool ? a.unionWith(b, *pool) : a.unionWith(b);
+        }
+        else if (op == 1)
+        {
+            for (map<int, Tracked>::iterator it = aItems.begin(); it != aItems.end(); ++it)
+                if (bItems.count(it->first))
+                    expected.insert(*it);
+            pool ? a.intersectWith(b, *pool) : a.intersectWith(b);
+        }
+        else
+        {
+            for (map<int, Tracked>::iterator it = aItems.begin(); it != aItems.end(); ++it)
+                if (!bItems.count(it->first))
+                    expected.insert(*it);
+            pool ? a.differenceWith(b, *pool) : a.differenceWith(b);
+        }
+        CHECK(validSetTree(a, expected));
+        CHECK(b.empty());
+    }
+}
+
+/**
+ * split, join and the set operations, with no item leaked or destroyed
+ * twice by the nodes they drop.
+ */
+static void testSplitJoin()
+{
+    {
+        mt19937 rng(32);
+        for (int round = 0; round < 30; ++round)
+        {
+            SetTree tree, right;
+            map<int, Tracked> expected;
+            fillRandom(tree, expected, rng, static_cast<int>(rng() % 5000), 10000, "t");
+            right.insert(make_pair(-1, Tracked("stale")));
+
+            int key = static_cast<int>(rng() % 10001);
+            map<int, Tracked> below(expected.begin(), expected.lower_bound(key));
+            map<int, Tracked> above(expected.lower_bound(key), expected.end());
+            tree.split(key, right);
+            CHECK(validSetTree(tree, below) && validSetTree(right, above));
+
+            bool threw = false;
+            if (!below.empty() && !above.empty())
+            {
+                try
+                {
+                    right.join(tree);
+                }
+                catch (const invalid_argument &)
+                {
+                    threw = true;
+                }
+                CHECK(threw && validSetTree(tree, below) && validSetTree(right, above));
+            }
+            tree.join(right);
+            CHECK(validSetTree(tree, expected) && right.empty());
+        }
+
+        setOps(33, nullptr);
+        TaskPool pool(4);
+        setOps(34, &pool);
+    }
+    CHECK(Tracked::live == 0);
+}
+
+/**
+ * Fills two trees with the same random items.
+ */
+static void fillTwins(SetTree &one, SetTree &two, unsigned seed, int count, int keyRange)
+{
+    mt19937 rng(seed);
+    for (int i = 0; i < count; ++i)
+    {
+        pair<int, Tracked> item(static_cast<int>(rng() % keyRange), Tracked(to_string(i)));
+        one.insert(item);
+        two.insert(item);
+    }
+}
+
+/**
+ * The parallel set operations give exactly what the sequential ones do: the
+ * same items, and (in TREE_STATS builds) the same rotation counts, since
+ * the forked tasks run the same splits and joins and report their
+ * rotations back to the tree.
+ */
+static void testParallelSetOps()
+{
+    TaskPool pool(4);
+    for (int op = 0; op < 3; ++op)
+    {
+        for (int round = 0; round < 3; ++round)
+        {
+            SetTree sequential, parallel, sequentialOther, parallelOther;
+            unsigned seed = 35 + op * 3 + round;
+            fillTwins(sequential, parallel, seed, 40000, 100000 << round);
+            fillTwins(sequentialOther, parallelOther, seed + 100, 20000 << round, 100000);
+            sequential.resetStats();
+            parallel.resetStats();
+            if (op == 0)
+            {
+                sequential.unionWith(sequentialOther);
+                parallel.unionWith(parallelOther, pool);
+            }
+            else if (op == 1)
+            {
+                sequential.intersectWith(sequentialOther);
+                parallel.intersectWith(parallelOther, pool);
+            }
+            else
+            {
+                sequential.differenceWith(sequentialOther);
+                parallel.differenceWith(parallelOther, pool);
+            }
+            map<int, Tracked> expected(sequential.begin(), sequential.end());
+            CHECK(validSetTree(parallel, expected) && parallelOther.empty());
+            CHECK(parallel.stats().rebalance.single == sequential.stats().rebalance.single);
+            CHECK(parallel.stats().rebalance.doubled == sequential.stats().rebalance.doubled);
+        }
+    }
+}
+
+/**
+ * Hinted inserts and finds against std::map, with hints next to the key,
+ * anywhere in the tree, or end(). Keys arrive nearly sorted, with a few
+ * jumps back, as in a merged log stream.
+ */
+template <typename Tree>
+void hintedOps(Tree &tree, unsigned seed)
+{
+    mt19937 rng(seed);
+    map<int, int> expected;
+    typename Tree::iterator hint = tree.end();
+    int next = 0;
+    for (int i = 0; i < 6000; ++i)
+    {
+        int key = (rng() % 10 == 0) ? static_cast<int>(rng() % (next + 1)) : (next += 1 + static_cast<int>(rng() % 3));
+        unsigned kind = rng() % 8;
+        if (kind == 0)
+            hint = tree.end();
+        else if (kind == 1 && !expected.empty())
+            hint = tree.find(expected.begin()->first);
+        hint = tree.insert(hint, make_pair(key, i));
+        expected[key] = i;
+        CHECK(hint != tree.end() && hint->first == key && hint->second == i);
+        if (rng() % 20 == 0)
+        {
+            int gone = static_cast<int>(rng() % (next + 1));
+            if (gone != key)
+            {
+                tree.remove(gone);
+                expected.erase(gone);
+            }
+        }
+    }
+    CHECK(sameItems(tree, expected));
+
+    typename Tree::iterator finger = tree.begin();
+    for (int key = -1; key <= next + 1; ++key)
+    {
+        typename Tree::iterator found = tree.find(finger, key);
+        CHECK(expected.count(key) == 1 ? found != tree.end() && found->second == expected[key] : found == tree.end());
+        if (found != tree.end())
+            finger = found;
+        CHECK(tree.find(tree.end(), key) == tree.find(key));
+        CHECK(tree.find(tree.begin(), key) == tree.find(key));
+    }
+}
+
+/**
+ * Hinted insert and finger search on every tree type. In TREE_STATS builds,
+ * also that a sorted stream inserted at the previous key's position costs
+ * a few levels per insert rather than the height of the tree.
+ */
+static void testHints()
+{
+    BinarySearchTree<int, int> bst;
+    AVLTree<int, int> avl;
+    AVLTree<int, int, NodePool, true> ranked;
+    SnapshotAVLTree<int, int> versioned;
+    hintedOps(bst, 44);
+    hintedOps(avl, 45);
+    hintedOps(ranked, 46);
+    SnapshotAVLTree<int, int>::Snapshot empty = versioned.snapshot();
+    hintedOps(versioned, 47);
+    CHECK(avl.verifyBalances() && ranked.verifyBalances() && versioned.verifyBalances());
+    CHECK(empty.begin() == empty.end());
+    size_t i = 0;
+    for (AVLTree<int, int, NodePool, true>::iterator it = ranked.begin(); it != ranked.end(); ++it, ++i)
+    {
+        CHECK(ranked.rank(it->first) == i);
+    }
+
+    AVLTree<int, int> sorted;
+    AVLTree<int, int>::iterator hint = sorted.end();
+    for (int key = 0; key < 100000; ++key)
+    {
+        hint = sorted.insert(hint, make_pair(key, key));
+    }
+    CHECK(sorted.verifyBalances());
+#ifdef TREE_STATS
+    CHECK(sorted.stats().insertDepth.mean() < 4.0);
+#endif
+}
+
+/**
+ * True if calling load throws std::runtime_error.
+ */
+template <typename Load>
+bool throwsRuntimeError(Load load)
+{
+    try
+    {
+        load();
+    }
+    catch (const runtime_error &)
+    {
+        return true;
+    }
+    return false;
+}
+
+/**
+ * save() and mapFile() round trips, and mapFile's refusal of files that
+ * are missing, truncated, for other types, or carry a position past the
+ * last item.
+ */
+static void testMappedFiles()
+{
+    const string path = "bst-test.frozen";
+    mt19937 rng(48);
+    const int sizes[] = {0, 1, 2, 3, 100, 5000};
+    for (int s = 0; s < 6; ++s)
+    {
+        AVLTree<int, double> tree;
+        map<int, double> expected;
+        while (static_cast<int>(expected.size()) < sizes[s])
+        {
+            int key = static_cast<int>(rng() % 100000);
+            tree.insert(make_pair(key, key * 0.5));
+            expected[key] = key * 0.5;
+        }
+        tree.save(path);
+        FrozenTree<int, double> copy;
+        {
+            FrozenTree<int, double> mapped = FrozenTree<int, double>::mapFile(path);
+            copy = mapped;
+        }
+        // the copy keeps the mapping alive on its own
+        CHECK(copy.size() == expected.size() && sameItems(copy, expected));
+        for (int probe = 0; probe < 2000; ++probe)
+        {
+            int key = (probe % 2 == 0 && !expected.empty()) ? next(expected.begin(), rng() % expected.size())->first : static_cast<int>(rng() % 100000);
+            FrozenTree<int, double>::iterator found = copy.find(key);
+            CHECK(expected.count(key) == 1 ? found != copy.end() && found->second == expected[key] : found == copy.end());
+            map<int, double>::iterator expectedLower = expected.lower_bound(key);
+            FrozenTree<int, double>::iterator lower = copy.lower_bound(key);
+            CHECK(expectedLower == expected.end() ? lower == copy.end() : lower->first == expectedLower->first);
+        }
+    }
+
+    CHECK(throwsRuntimeError([&]()
+                             { FrozenTree<long, long>::mapFile(path); }));
+    CHECK(throwsRuntimeError([]()
+                             { FrozenTree<int, double>::mapFile("no-such-dir/tree.frozen"); }));
+
+    // flip one position past the end of the items
+    frozen_detail::FileHeader header;
+    {
+        ifstream in(path.c_str(), ios::binary);
+        in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    }
+    {
+        // an items offset so large that the end of the items wraps past
+        // 2^64 to just inside the file
+        frozen_detail::FileHeader wrapped = header;
+        uint64_t itemBytes = header.count * sizeof(pair<const int, double>);
+        wrapped.itemsOffset = 0 - itemBytes + itemBytes % frozen_detail::SECTION_ALIGN;
+        fstream file(path.c_str(), ios::binary | ios::in | ios::out);
+        file.write(reinterpret_cast<const char *>(&wrapped), sizeof(wrapped));
+    }
+    CHECK(throwsRuntimeError([&]()
+                             { FrozenTree<int, double>::mapFile(path); }));
+    {
+        fstream file(path.c_str(), ios::binary | ios::in | ios::out);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        size_t bad = static_cast<size_t>(header.count);
+        file.seekp(static_cast<streamoff>(header.positionsOffset + 7 * sizeof(size_t)));
+        file.write(reinterpret_cast<const char *>(&bad), sizeof(bad));
+    }
+    CHECK(throwsRuntimeError([&]()
+                             { FrozenTree<int, double>::mapFile(path); }));
+
+    {
+        ofstream out(path.c_str(), ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+    CHECK(throwsRuntimeError([&]()
+                             { FrozenTree<int, double>::mapFile(path); }));
+    remove(path.c_str());
+}
+
+/**
+ * serialize() tree into a string and deserialize() it into a fresh Into.
+ */
+template <typename Into, typename Tree>
+void roundTrip(const Tree &tree, Into &into)
+{
+    ostringstream out;
+    tree.serialize(out);
+    istringstream in(out.str());
+    into.deserialize(in);
+}
+
+/**
+ * True if deserializing bytes into tree throws std::runtime_error and
+ * leaves tree holding expected.
+ */
+template <typename Tree, typename Key, typename Value, typename Less>
+bool rejects(Tree &tree, const string &bytes, const map<Key, Value, Less> &expected)
+{
+    istringstream in(bytes);
+    bool threw = throwsRuntimeError([&]()
+                                    { tree.deserialize(in); });
+    return threw && sameItems(tree, expected);
+}
+
+/**
+ * Streams round trip for each key encoding (delta coded integers, and
+ * everything else through StreamCodec), at the ends of each type's range,
+ * and bad streams leave the tree as it was.
+ */
+static void testSerialize()
+{
+    mt19937_64 rng(49);
+    for (int round = 0; round < 10; ++round)
+    {
+        AVLTree<int, string> ints;
+        map<int, string> intItems;
+        BinarySearchTree<uint64_t, double> wide;
+        map<uint64_t, double> wideItems;
+        AVLTree<string, int64_t> strings;
+        map<string, int64_t> stringItems;
+        AVLTree<int, int, NodePool, false, greater<int> > descending;
+        map<int, int, greater<int> > descendingItems;
+        int count = (round == 0) ? 0 : static_cast<int>(rng() % 3000);
+        for (int i = 0; i < count; ++i)
+        {
+            int key = (i % 50 == 0) ? (i % 100 == 0 ? numeric_limits<int>::min() : numeric_limits<int>::max())
+                                    : static_cast<int>(rng() % (round % 2 ? 1000 : 4000000000u));
+            ints.insert(make_pair(key, string(static_cast<size_t>(rng() % 20), static_cast<char>('a' + i % 26))));
+            intItems[key] = ints.find(key)->second;
+            uint64_t wideKey = (i % 50 == 0) ? numeric_limits<uint64_t>::max() - i : rng();
+            wide.insert(make_pair(wideKey, static_cast<double>(rng() % 1000) / 7.0));
+            wideItems[wideKey] = wide.find(wideKey)->second;
+            string stringKey = to_string(rng() % 10000);
+            strings.insert(make_pair(stringKey, static_cast<int64_t>(rng())));
+            stringItems[stringKey] = strings.find(stringKey)->second;
+            descending.insert(make_pair(key, ~key));
+            descendingItems[key] = ~key;
+        }
+
+        AVLTree<int, string, NodePool, true> rankedInts;
+        roundTrip(ints, rankedInts);
+        CHECK(sameItems(rankedInts, intItems) && rankedInts.verifyBalances());
+        if (!intItems.empty())
+        {
+            CHECK(rankedInts.rank(intItems.rbegin()->first) == intItems.size() - 1);
+        }
+        BinarySearchTree<uint64_t, double> wideCopy;
+        roundTrip(wide, wideCopy);
+        CHECK(sameItems(wideCopy, wideItems));
+        AVLTree<string, int64_t> stringCopy;
+        roundTrip(strings, stringCopy);
+        CHECK(sameItems(stringCopy, stringItems));
+        AVLTree<int, int, NodePool, false, greater<int> > descendingCopy;
+        roundTrip(descending, descendingCopy);
+        CHECK(sameItems(descendingCopy, descendingItems) && descendingCopy.verifyBalances());
+    }
+
+    AVLTree<int, string> tree;
+    map<int, string> expected;
+    for (int i = 0; i < 100; ++i)
+    {
+        tree.insert(make_pair(i * 3, to_string(i)));
+        expected[i * 3] = to_string(i);
+    }
+    ostringstream out;
+    tree.serialize(out);
+    string bytes = out.str();
+    CHECK(rejects(tree, bytes.substr(0, bytes.size() - 1), expected));
+    CHECK(rejects(tree, bytes.substr(0, 3), expected));
+    CHECK(rejects(tree, string(), expected));
+    AVLTree<int, int> otherValues;
+    map<int, int> none;
+    CHECK(rejects(otherValues, bytes, none));
+    AVLTree<int, string, NodePool, false, greater<int> > otherOrder;
+    map<int, string, greater<int> > noneDescending;
+    CHECK(rejects(otherOrder, bytes, noneDescending));
+
+    AVLTree<string, int> strings;
+    map<string, int> noStrings;
+    ostringstream unsorted;
+    unsorted.write("BSTS", 4);
+    stream_codec_detail::writeVarint(unsorted, 1);
+    stream_codec_detail::writeVarint(unsorted, StreamCodec<string>::tag());
+    stream_codec_detail::writeVarint(unsorted, StreamCodec<int>::tag());
+    stream_codec_detail::writeVarint(unsorted, KeyStreamCodec<string, less<string> >::MODE);
+    stream_codec_detail::writeVarint(unsorted, 2);
+    StreamCodec<string>::write(unsorted, "b");
+    StreamCodec<int>::write(unsorted, 1);
+    StreamCodec<string>::write(unsorted, "a");
+    StreamCodec<int>::write(unsorted, 2);
+    CHECK(rejects(strings, unsorted.str(), noStrings));
+}
+
+/**
+ * The operation counters, on operations whose counts are known exactly.
+ * Without TREE_STATS they must all stay zero.
+ */
+static void testStats()
+{
+    AVLTree<int, int> tree;
+    vector<pair<int, int> > items;
+    for (int i = 0; i < 1023; ++i)
+    {
+        items.push_back(make_pair(i, i));
+    }
+    tree.buildFromSorted(items.begin(), items.end());
+    for (int i = 0; i < 1023; ++i)
+    {
+        tree.find(i);
+    }
+    tree.insert(make_pair(5, 5)); // overwrite, no rotation
+#ifdef TREE_STATS
+    // a perfect tree of 10 levels: every search goes all the way down
+    CHECK(tree.stats().lookupDepth.events == 1023 && tree.stats().lookupDepth.max == 10);
+    CHECK(tree.stats().lookupDepth.mean() == 10.0 && tree.stats().lookupDepth.percentile(0.99) == 10);
+    CHECK(tree.stats().insertDepth.events == 1 && tree.stats().insertDepth.sum == 10);
+    CHECK(tree.stats().insertRetrace.events == 0 && tree.stats().rebalance.single == 0);
+#else
+    CHECK(tree.stats().lookupDepth.events == 0 && tree.stats().insertDepth.events == 0);
+#endif
+
+    tree.resetStats();
+    CHECK(tree.stats().lookupDepth.events == 0 && tree.stats().nodeSwaps == 0);
+    tree.remove(511); // the root, with two children
+    tree.remove(-1);  // not there
+#ifdef TREE_STATS
+    CHECK(tree.stats().nodeSwaps == 1 && tree.stats().removeFixDepth.events == 1);
+    CHECK(tree.stats().removeFixCalls == tree.stats().removeFixDepth.sum && tree.stats().removeFixCalls >= 1);
+#endif
+
+    // the four rebalancing cases, one rotation each
+    const int orders[][3] = {{1, 2, 3}, {3, 2, 1}, {1, 3, 2}, {3, 1, 2}};
+    for (int o = 0; o < 4; ++o)
+    {
+        AVLTree<int, int> small;
+        for (int i = 0; i < 3; ++i)
+        {
+            small.insert(make_pair(orders[o][i], 0));
+        }
+#ifdef TREE_STATS
+        CHECK(small.stats().rebalance.single == (o < 2 ? 1u : 0u) && small.stats().rebalance.doubled == (o < 2 ? 0u : 1u));
+        CHECK(small.stats().insertDepth.events == 3 && small.stats().insertRetrace.sum == 3);
+#endif
+    }
+
+    // removing 1 from 2 (1, 3 (4)) leaves 2 right heavy by two: one single rotation
+    AVLTree<int, int> lopsided;
+    const int keys[] = {2, 1, 3, 4};
+    for (int i = 0; i < 4; ++i)
+    {
+        lopsided.insert(make_pair(keys[i], 0));
+    }
+    lopsided.remove(1);
+    CHECK(lopsided.verifyBalances());
+#ifdef TREE_STATS
+    CHECK(lopsided.stats().removeFix.single == 1 && lopsided.stats().removeFix.doubled == 0);
+    CHECK(lopsided.stats().nodeSwaps == 0);
+#endif
+
+    ostringstream printed;
+    lopsided.stats().print(printed);
+    CHECK(printed.str().find("removeFixCalls ") != string::npos && printed.str().find("insertFix") == string::npos);
+}
+
+/**
+ * True if sharded holds exactly the items of expected: in key order
+ * through forEach, and each found by find.
+ */
+static bool sameSharded(const ShardedAVLTree<int, int> &sharded, const map<int, int> &expected)
+{
+    vector<pair<int, int> > items;
+    sharded.forEach([&items](const pair<const int, int> &item)
+                    { items.push_back(item); });
+    if (items != vector<pair<int, int> >(expected.begin(), expected.end()) || sharded.size() != expected.size())
+        return false;
+    for (map<int, int>::const_iterator e = expected.begin(); e != expected.end(); ++e)
+    {
+        int value = -1;
+        if (!sharded.find(e->first, value) || value != e->second)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Lets a test see how many shards and layouts a ShardedAVLTree holds.
+ */
+class ShardedProbe : public ShardedAVLTree<int, int>
+{
+public:
+    explicit ShardedProbe(size_t maxShards) : ShardedAVLTree<int, int>(maxShards) {}
+    size_t shardsMade() const
+    {
+        lock_guard<mutex> guard(resplitLock_);
+        return shards_.size();
+    }
+    size_t retiredLayouts() const
+    {
+        lock_guard<mutex> guard(resplitLock_);
+        return retired_.size();
+    }
+    uint64_t epoch() const { return epochs_.current(); }
+};
+
+/**
+ * ShardedAVLTree agrees with std::map across resplits, range scans only
+ * see their range, and writers on disjoint keys, lookups and range scans
+ * run together while the shards split under them.
+ */
+static void testShardedAVLTree()
+{
+    ShardedAVLTree<int, int> sharded(8);
+    map<int, int> expected;
+    mt19937 rng(24);
+    for (int i = 0; i < 20000; ++i)
+    {
+        int key = static_cast<int>(rng() % 3000);
+        if (rng() % 4 != 0)
+        {
+            sharded.insert(make_pair(key, i));
+            expected[key] = i;
+        }
+        else
+        {
+            sharded.remove(key);
+            expected.erase(key);
+        }
+        if (i % 2500 == 0)
+            sharded.resplit();
+    }
+    CHECK(sharded.shardCount() > 1);
+    CHECK(sameSharded(sharded, expected));
+    for (int key = -1; key <= 3000; ++key)
+    {
+        CHECK(sharded.contains(key) == (expected.count(key) == 1));
+    }
+
+    // ranges across and within shards, empty and backwards ones
+    for (int i = 0; i < 200; ++i)
+    {
+        int lo = static_cast<int>(rng() % 3100) - 50;
+        int hi = lo + static_cast<int>(rng() % 1200) - 100;
+        vector<pair<int, int> > items;
+        sharded.forEach(lo, hi, [&items](const pair<const int, int> &item)
+                        { items.push_back(item); });
+        vector<pair<int, int> > wanted;
+        if (lo < hi)
+            wanted.assign(expected.lower_bound(lo), expected.lower_bound(hi));
+        CHECK(items == wanted);
+    }
+
+    sharded.clear();
+    CHECK(sharded.size() == 0 && !sharded.contains(expected.begin()->first));
+
+    // ascending keys only append to the last shard, so it is never split
+    const int checkWrites = static_cast<int>(ShardedAVLTree<int, int>::RESPLIT_CHECK_WRITES);
+    ShardedProbe churn(4);
+    uint64_t epoch = churn.epoch();
+    for (int key = 0; key < 8 * checkWrites; ++key)
+    {
+        churn.insert(make_pair(key, key));
+    }
+    CHECK(churn.shardCount() == 1 && churn.epoch() == epoch);
+    // a hot spot moving round the keys joins and splits shards over and
+    // over, reusing the joined ones and freeing the old layouts
+    for (int phase = 0; phase < 32; ++phase)
+    {
+        int base = (phase * 3 % 8) * checkWrites;
+        for (int i = 0; i < 2 * checkWrites; ++i)
+            churn.insert(make_pair(base + i * 7919 % checkWrites, base + i * 7919 % checkWrites));
+    }
+    CHECK(churn.shardCount() == 4 && churn.shardsMade() == 4);
+    CHECK(churn.epoch() > epoch + 16 && churn.retiredLayouts() <= 2);
+    expected.clear();
+    for (int key = 0; key < 8 * checkWrites; ++key)
+    {
+        expected[key] = key;
+    }
+    CHECK(sameSharded(churn, expected));
+    bool threw = false;
+    try
+    {
+        ShardedAVLTree<int, int> unsorted(vector<int>{10, 5});
+    }
+    catch (const invalid_argument &)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+    ShardedAVLTree<int, int> bounded(vector<int>{1000, 2000});
+    CHECK(bounded.shardCount() == 3);
+
+    // keys below zero stay put as key * 10; writer w owns keys w, w + 4, ...
+    for (int key = -5000; key < 0; ++key)
+    {
+        bounded.insert(make_pair(key, key * 10));
+    }
+    const int writers = 4;
+    const int keys = 30000;
+    atomic<bool> stop(false);
+    atomic<int> wrong(0);
+    vector<thread> threads;
+    for (int r = 0; r < 2; ++r)
+    {
+        threads.push_back(thread([&bounded, &stop, &wrong, r]()
+                                 {
+                                     mt19937 local(r);
+                                     while (!stop.load())
+                                     {
+                                         int key = -static_cast<int>(local() % 5000) - 1;
+                                         int value;
+                                         if (!bounded.find(key, value) || value != key * 10)
+                                             ++wrong;
+                                     } }));
+    }
+    threads.push_back(thread([&bounded, &stop, &wrong]()
+                             {
+                                 mt19937 local(7);
+                                 while (!stop.load())
+                                 {
+                                     int lo = static_cast<int>(local() % (keys + 5000)) - 5000;
+                                     int previous = lo - 1;
+                                     bounded.forEach(lo, lo + 500, [&](const pair<const int, int> &item)
+                                                     {
+                                                         if (item.first <= previous || item.first >= lo + 500 ||
+                                                             (item.first < 0 && item.second != item.first * 10))
+                                                             ++wrong;
+                                                         previous = item.first; });
+                                 } }));
+    vector<thread> writing;
+    for (int w = 0; w < writers; ++w)
+    {
+        writing.push_back(thread([&bounded, w]()
+                                 {
+                                     for (int round = 0; round < 3; ++round)
+                                     {
+                                         for (int key = w; key < keys; key += writers)
+                                             bounded.insert(make_pair(key, key + round));
+                                         for (int key = w; key < keys; key += 3 * writers)
+                                             bounded.remove(key);
+                                     } }));
+    }
+    for (size_t w = 0; w < writing.size(); ++w)
+    {
+        writing[w].join();
+    }
+    stop.store(true);
+    for (size_t t = 0; t < threads.size(); ++t)
+    {
+        threads[t].join();
+    }
+    CHECK(wrong.load() == 0);
+    CHECK(bounded.shardCount() > 3);
+    expected.clear();
+    for (int key = -5000; key < 0; ++key)
+    {
+        expected[key] = key * 10;
+    }
+    for (int key = 0; key < keys; ++key)
+    {
+        if (key % (3 * writers) >= writers)
+            expected[key] = key + 2;
+    }
+    CHECK(sameSharded(bounded, expected));
+}
+
+int main()
+{
+    testBasics();
+    testNodePool();
+    testBuildFromSorted();
+    testRanges();
+    testRankSelect();
+    testBalanceChecks();
+    testConcurrentAVLTree();
+    testSnapshots();
+    testEmplace();
+    testCompare();
+    testFrozenTree();
+    testBTree();
+    testKeySearch();
+    testInsertBatch();
+    testSplitJoin();
+    testParallelSetOps();
+    testHints();
+    testMappedFiles();
+    testSerialize();
+    testStats();
+    testShardedAVLTree();
+
+    if (failures != 0)
+    {
+        cerr << failures << " of " << checks << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All " << checks << " checks passed" << endl;
     return 0;
 }
@@ -4,21 +4,102 @@
 #include <iostream>
 #include <exception>
 #include <cstdlib>
+#include <cstddef>
 #include <utility>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <tuple>
+#include "node_pool.h"
+#include "frozen_bst.h"
+#include "stream_codec.h"
+#include "tree_stats.h"
+
+namespace bst_detail
+{
+    // the indices 0..N-1 as a type, for unpacking a std::tuple into a call
+    template <std::size_t... I>
+    struct Indices
+    {
+    };
+    template <std::size_t N, std::size_t... I>
+    struct MakeIndices : MakeIndices<N - 1, N - 1, I...>
+    {
+    };
+    template <std::size_t... I>
+    struct MakeIndices<0, I...>
+    {
+        typedef Indices<I...> type;
+    };
+}
+
+/**
+ * Makes the item of a new node, for emplace and try_emplace. A node
+ * initializes its item straight from make()'s return value, so the item
+ * is constructed once, in place, whatever the tree's node type is.
+ */
+template <typename Key, typename Value>
+class ItemMaker
+{
+public:
+    virtual std::pair<const Key, Value> make() const = 0;
+
+protected:
+    ~ItemMaker() {}
+};
+
+/**
+ * An ItemMaker that passes args on to std::pair's constructors. It only
+ * holds references, so it must not outlive the call it was made for.
+ */
+template <typename Key, typename Value, typename... Args>
+class ArgsItemMaker : public ItemMaker<Key, Value>
+{
+public:
+    explicit ArgsItemMaker(Args &&...args) : args_(std::forward<Args>(args)...) {}
+
+    virtual std::pair<const Key, Value> make() const
+    {
+        return makeFrom(typename bst_detail::MakeIndices<sizeof...(Args)>::type());
+    }
+
+private:
+    template <std::size_t... I>
+    std::pair<const Key, Value> makeFrom(bst_detail::Indices<I...>) const
+    {
+        return std::pair<const Key, Value>(std::forward<Args>(std::get<I>(args_))...);
+    }
+
+    std::tuple<Args &&...> args_;
+};
 
 /**
  * A templated class for a Node in a search tree.
- * The getters for parent/left/right are virtual so
- * that they can be overridden for future kinds of
- * search trees, such as Red Black trees, Splay trees,
- * and AVL trees.
+ * The getters for parent/left/right are deliberately not virtual, so a
+ * node carries no vtable pointer and every step of a search is a plain
+ * load. Derived nodes (e.g. AVLNode) hide them with versions that return
+ * the derived type. The low bits of the parent pointer are always zero,
+ * so derived nodes may keep a small tag there instead of a new member.
+ *
+ * The links are std::atomic and accessed with relaxed loads and stores,
+ * which compile to the same plain moves. That way ConcurrentAVLTree's
+ * lock-free readers may follow them while a writer relinks nodes.
  */
 template <typename Key, typename Value>
-class Node
+class alignas(8) Node
 {
 public:
     Node(const Key &key, const Value &value, Node<Key, Value> *parent);
-    virtual ~Node();
+    Node(Key &&key, Value &&value, Node<Key, Value> *parent);
+    Node(const ItemMaker<Key, Value> &maker, Node<Key, Value> *parent);
+    ~Node();
 
     const std::pair<const Key, Value> &getItem() const;
     std::pair<const Key, Value> &getItem();
@@ -26,22 +107,29 @@ public:
     const Value &getValue() const;
     Value &getValue();
 
-    virtual Node<Key, Value> *getParent() const;
-    virtual Node<Key, Value> *getLeft() const;
-    virtual Node<Key, Value> *getRight() const;
+    Node<Key, Value> *getParent() const;
+    Node<Key, Value> *getLeft() const;
+    Node<Key, Value> *getRight() const;
 
     void setParent(Node<Key, Value> *parent);
     void setLeft(Node<Key, Value> *left);
     void setRight(Node<Key, Value> *right);
     void setValue(const Value &value);
+    void setValue(Value &&value);
     // helper, will be used in avl
     void setKey(const Key &newKey);
 
 protected:
+    // bits of parent_ that are free for derived nodes to use as a tag
+    static const std::uintptr_t TAG_MASK = 7;
+
+    std::uintptr_t getTag() const;
+    void setTag(std::uintptr_t tag);
+
     std::pair<const Key, Value> item_;
-    Node<Key, Value> *parent_;
-    Node<Key, Value> *left_;
-    Node<Key, Value> *right_;
+    std::atomic<std::uintptr_t> parent_; // parent pointer, with the tag in its low bits
+    std::atomic<Node<Key, Value> *> left_;
+    std::atomic<Node<Key, Value> *> right_;
 };
 
 /*
@@ -54,11 +142,37 @@ protected:
  * Explicit constructor for a node.
  */
 template <typename Key, typename Value>
-Node<Key, Value>::Node(const Key &key, const Value &value, Node<Key, Value> *parent) : item_(key, value),
-                                                                                       parent_(parent),
-                                                                                       left_(NULL),
-                                                                                       right_(NULL)
+Node<Key, Value>::Node(const Key &key, const Value &value, Node<Key, Value> *parent) : item_(key, value)
+{
+    // stores rather than initializers, so a reader still holding a freed
+    // node sees an atomic write when the slot is reused
+    parent_.store(reinterpret_cast<std::uintptr_t>(parent), std::memory_order_relaxed);
+    left_.store(NULL, std::memory_order_relaxed);
+    right_.store(NULL, std::memory_order_relaxed);
+}
+
+/**
+ * A constructor that moves the key and value into the node instead of copying them.
+ */
+template <typename Key, typename Value>
+Node<Key, Value>::Node(Key &&key, Value &&value, Node<Key, Value> *parent) : item_(std::move(key), std::move(value))
+{
+    // stores rather than initializers, so a reader still holding a freed
+    // node sees an atomic write when the slot is reused
+    parent_.store(reinterpret_cast<std::uintptr_t>(parent), std::memory_order_relaxed);
+    left_.store(NULL, std::memory_order_relaxed);
+    right_.store(NULL, std::memory_order_relaxed);
+}
+
+/**
+ * A constructor that builds the item in place from maker (see emplace).
+ */
+template <typename Key, typename Value>
+Node<Key, Value>::Node(const ItemMaker<Key, Value> &maker, Node<Key, Value> *parent) : item_(maker.make())
 {
+    parent_.store(reinterpret_cast<std::uintptr_t>(parent), std::memory_order_relaxed);
+    left_.store(NULL, std::memory_order_relaxed);
+    right_.store(NULL, std::memory_order_relaxed);
 }
 
 /**
@@ -117,39 +231,59 @@ Value &Node<Key, Value>::getValue()
 }
 
 /**
- * An implementation of the virtual function for retreiving the parent.
+ * A getter for the parent, which strips the tag bits off of parent_.
  */
 template <typename Key, typename Value>
 Node<Key, Value> *Node<Key, Value>::getParent() const
 {
-    return parent_;
+    return reinterpret_cast<Node<Key, Value> *>(parent_.load(std::memory_order_relaxed) & ~TAG_MASK);
 }
 
 /**
- * An implementation of the virtual function for retreiving the left child.
+ * A getter for the left child.
  */
 template <typename Key, typename Value>
 Node<Key, Value> *Node<Key, Value>::getLeft() const
 {
-    return left_;
+    return left_.load(std::memory_order_relaxed);
 }
 
 /**
- * An implementation of the virtual function for retreiving the right child.
+ * A getter for the right child.
  */
 template <typename Key, typename Value>
 Node<Key, Value> *Node<Key, Value>::getRight() const
 {
-    return right_;
+    return right_.load(std::memory_order_relaxed);
 }
 
 /**
- * A setter for setting the parent of a node.
+ * A setter for setting the parent of a node. The tag bits are kept.
  */
 template <typename Key, typename Value>
 void Node<Key, Value>::setParent(Node<Key, Value> *parent)
 {
-    parent_ = parent;
+    std::uintptr_t tag = parent_.load(std::memory_order_relaxed) & TAG_MASK;
+    parent_.store(reinterpret_cast<std::uintptr_t>(parent) | tag, std::memory_order_relaxed);
+}
+
+/**
+ * A getter for the tag kept in the low bits of the parent pointer.
+ */
+template <typename Key, typename Value>
+std::uintptr_t Node<Key, Value>::getTag() const
+{
+    return parent_.load(std::memory_order_relaxed) & TAG_MASK;
+}
+
+/**
+ * A setter for the tag kept in the low bits of the parent pointer.
+ * The tag must fit in TAG_MASK.
+ */
+template <typename Key, typename Value>
+void Node<Key, Value>::setTag(std::uintptr_t tag)
+{
+    parent_.store((parent_.load(std::memory_order_relaxed) & ~TAG_MASK) | tag, std::memory_order_relaxed);
 }
 
 /**
@@ -158,7 +292,7 @@ void Node<Key, Value>::setParent(Node<Key, Value> *parent)
 template <typename Key, typename Value>
 void Node<Key, Value>::setLeft(Node<Key, Value> *left)
 {
-    left_ = left;
+    left_.store(left, std::memory_order_relaxed);
 }
 
 /**
@@ -167,7 +301,7 @@ void Node<Key, Value>::setLeft(Node<Key, Value> *left)
 template <typename Key, typename Value>
 void Node<Key, Value>::setRight(Node<Key, Value> *right)
 {
-    right_ = right;
+    right_.store(right, std::memory_order_relaxed);
 }
 
 /**
@@ -178,6 +312,15 @@ void Node<Key, Value>::setValue(const Value &value)
 {
     item_.second = value;
 }
+
+/**
+ * A setter that moves the new value into the node.
+ */
+template <typename Key, typename Value>
+void Node<Key, Value>::setValue(Value &&value)
+{
+    item_.second = std::move(value);
+}
 /*
   ---------------------------------------
   End implementations for the Node class.
@@ -186,19 +329,44 @@ void Node<Key, Value>::setValue(const Value &value)
 
 /**
  * A templated unbalanced binary search tree.
+ * Nodes are allocated from an Alloc (see node_pool.h), which by default
+ * carves them out of large chunks instead of calling new for every insert.
+ * Keys are ordered by Compare, a strict weak ordering like std::less. If
+ * Compare declares is_transparent (e.g. std::less<> in C++14), the lookups
+ * also accept any type it can compare with Key, such as a std::string_view
+ * for std::string keys, without building a temporary Key.
  */
-template <typename Key, typename Value>
+template <typename Key, typename Value, typename Alloc = NodePool, typename Compare = std::less<Key> >
 class BinarySearchTree
 {
 public:
     BinarySearchTree();                                                   // TODO
+    explicit BinarySearchTree(const Compare &comp);
     virtual ~BinarySearchTree();                                          // TODO
     virtual void insert(const std::pair<const Key, Value> &keyValuePair); // TODO
+    void insert(std::pair<const Key, Value> &&keyValuePair);
     virtual void remove(const Key &key);                                  // TODO
-    void clear();                                                         // TODO
+    virtual void clear();                                                 // TODO
     bool isBalanced() const;                                              // TODO
     void print() const;
     bool empty() const;
+    Compare key_comp() const;
+    // operation counters, all zero unless built with TREE_STATS (see tree_stats.h)
+    const TreeStats &stats() const;
+    void resetStats();
+
+    // replace the contents with a perfectly balanced tree in O(n)
+    template <typename ForwardIt>
+    void buildFromSorted(ForwardIt first, ForwardIt last);
+    template <typename InputIt>
+    void buildFromUnsorted(InputIt first, InputIt last);
+    // read-only copy with a cache-friendly layout, for read-mostly use
+    FrozenTree<Key, Value, Compare> freeze() const;
+    // write that copy to a file, for FrozenTree::mapFile to load without parsing
+    void save(const std::string &path) const;
+    // compact binary stream of the items in key order, e.g. for pipes and backups
+    void serialize(std::ostream &out) const;
+    void deserialize(std::istream &in);
 
     template <typename PPKey, typename PPValue>
     friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> &tree);
@@ -206,10 +374,18 @@ public:
 public:
     /**
      * An internal iterator class for traversing the contents of the BST.
+     * It is bidirectional: decrementing end() gives the largest item, so
+     * reverse scans from end() or from any find() cost O(k) for k items.
      */
     class iterator // TODO
     {
     public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key, Value> *pointer;
+        typedef std::pair<const Key, Value> &reference;
+
         iterator();
 
         std::pair<const Key, Value> &operator*() const;
@@ -219,24 +395,84 @@ public:
         bool operator!=(const iterator &rhs) const;
 
         iterator &operator++();
+        iterator operator++(int);
+        iterator &operator--();
+        iterator operator--(int);
 
     protected:
-        friend class BinarySearchTree<Key, Value>;
-        iterator(Node<Key, Value> *ptr);
+        friend class BinarySearchTree<Key, Value, Alloc, Compare>;
+        iterator(Node<Key, Value> *ptr, const BinarySearchTree<Key, Value, Alloc, Compare> *tree);
         Node<Key, Value> *current_;
+        // the tree, so that --end() can find the largest node
+        const BinarySearchTree<Key, Value, Alloc, Compare> *tree_;
+    };
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    /**
+     * A pair of iterators that can be used in a range-based for loop,
+     * covering the keys in [lo, hi).
+     */
+    class RangeView
+    {
+    public:
+        RangeView(const iterator &first, const iterator &last);
+        iterator begin() const;
+        iterator end() const;
+        bool empty() const;
+
+    private:
+        iterator first_;
+        iterator last_;
     };
 
 public:
     iterator begin() const;
     iterator end() const;
+    reverse_iterator rbegin() const;
+    reverse_iterator rend() const;
     iterator find(const Key &key) const;
+    iterator lower_bound(const Key &key) const;
+    iterator upper_bound(const Key &key) const;
+    std::pair<iterator, iterator> equal_range(const Key &key) const;
+    RangeView range(const Key &lo, const Key &hi) const;
+
+    // finger search: start from hint and climb only as far as key needs
+    iterator insert(const iterator &hint, const std::pair<const Key, Value> &keyValuePair);
+    iterator find(const iterator &hint, const Key &key) const;
     Value &operator[](const Key &key);
     Value const &operator[](const Key &key) const;
 
+    // heterogeneous lookups, only there when Compare is transparent
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K &key) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K &key) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K &key) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<iterator, iterator> equal_range(const K &key) const;
+
+    // like std::map: these never overwrite a value that is already there
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args &&...args);
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key &key, Args &&...args);
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(Key &&key, Args &&...args);
+
 protected:
     // Mandatory helper functions
-    Node<Key, Value> *internalFind(const Key &k) const;              // TODO
+    // K is Key, or anything Compare can compare with it
+    template <typename K>
+    Node<Key, Value> *internalFind(const K &k, Node<Key, Value> *start = nullptr) const; // TODO
+    template <typename K>
+    Node<Key, Value> *internalLowerBound(const K &k, Node<Key, Value> *start = nullptr) const; // first node with key >= k
+    template <typename K>
+    Node<Key, Value> *internalUpperBound(const K &k) const; // first node with key > k
+    template <typename K>
+    std::pair<iterator, iterator> internalEqualRange(const K &k) const;
     Node<Key, Value> *getSmallestNode() const;                       // TODO
+    Node<Key, Value> *getLargestNode() const;                        // where --end() lands
     static Node<Key, Value> *predecessor(Node<Key, Value> *current); // TODO
     // Note:  static means these functions don't have a "this" pointer
     //        and instead just use the input argument.
@@ -247,17 +483,69 @@ protected:
 
     // Add helper functions here
     bool isBalancedHelper(Node<Key, Value> *node) const; // helper for isbalanced
+    template <typename NodeType, typename K, typename V>
+    NodeType *createNode(K &&key, V &&value, NodeType *parent); // node from alloc_
+    template <typename NodeType>
+    NodeType *createNode(const ItemMaker<Key, Value> &maker, NodeType *parent);
+    // where a search for a key ended: at its node, or at the parent and side for a new one
+    struct InsertPosition
+    {
+        Node<Key, Value> *existing;
+        Node<Key, Value> *parent;
+        bool isLeft;
+    };
+    template <typename K>
+    InsertPosition findInsertPosition(const K &key, Node<Key, Value> *start = nullptr) const;
+    virtual void linkNew(Node<Key, Value> *node, const InsertPosition &position); // hang a new node, and rebalance
+    std::pair<Node<Key, Value> *, bool> emplaceImpl(const Key *key, const ItemMaker<Key, Value> &maker); // for emplace and try_emplace
+    virtual void prepareInsert(const Key &key); // bookkeeping before emplaceImpl links key in
+    template <typename K, typename V>
+    std::pair<Node<Key, Value> *, bool> insertImpl(K &&key, V &&value, bool overwrite,
+                                                   Node<Key, Value> *start = nullptr); // helper for insert
+    // what insert(&&) goes through, so derived trees can rebalance
+    virtual std::pair<Node<Key, Value> *, bool> insertMoved(Key &&key, Value &&value, bool overwrite);
+    // what the hinted insert goes through, for the same reason
+    virtual std::pair<Node<Key, Value> *, bool> insertNear(Node<Key, Value> *finger, const Key &key, const Value &value);
+    template <typename K>
+    Node<Key, Value> *fingerStart(Node<Key, Value> *finger, const K &key) const; // where a search near finger begins
+    virtual void destroyNode(Node<Key, Value> *node);                           // node back to alloc_
+    void deleteSubtree(Node<Key, Value> *node);                                 // helper for clear
+    template <typename ForwardIt>
+    Node<Key, Value> *buildSubtree(ForwardIt &it, std::size_t n);               // helper for buildFromSorted
+    void sortUnique(std::vector<std::pair<Key, Value> > &items) const;           // helper for buildFromUnsorted
+    virtual Node<Key, Value> *buildNode(const Key &key, const Value &value, int balance, std::size_t size);
+    virtual Node<Key, Value> *buildNode(Key &&key, Value &&value, int balance, std::size_t size);
+    virtual Node<Key, Value> *buildNode(const ItemMaker<Key, Value> &maker, int balance, std::size_t size);
+    iterator makeIterator(Node<Key, Value> *node) const;                        // for derived trees
 
 protected:
     Node<Key, Value> *root_;
+    Alloc alloc_;
+    Compare comp_;
+#ifdef TREE_STATS
+    mutable TreeStats stats_; // lookups are const, but still counted
+#endif
     static int heightOfNode(const Node<Key, Value> *node) // height of node helper
     {
         if (node == nullptr)
         {
             return -1;
         }
-        return 1 + std::max(heightOfNode(node->getLeft()), heightOfNode(node->getRight()));
+        // walk the subtree with parent pointers instead of recursing,
+        // so a degenerate tree can't overflow the stack
+        int depth = 0;
+        int maxDepth = 0;
+        for (const Node<Key, Value> *current = node; current != nullptr; current = nextPreorder(current, node, depth))
+        {
+            maxDepth = std::max(maxDepth, depth);
+        }
+        return maxDepth;
     }
+    // next node of a preorder walk of the subtree at root, tracking depth
+    static const Node<Key, Value> *nextPreorder(const Node<Key, Value> *current, const Node<Key, Value> *root, int &depth);
+    // single bottom-up pass handing check(node, leftHeight, rightHeight) every node
+    template <typename Check>
+    static bool checkHeights(const Node<Key, Value> *root, Check check);
     // You should not need other data members
 };
 
@@ -268,31 +556,35 @@ Begin implementations for the BinarySearchTree::iterator class.
 */
 
 /**
- * Explicit constructor that initializes an iterator with a given node pointer.
+ * Explicit constructor that initializes an iterator with a given node pointer
+ * (NULL for the end) of the given tree.
  */
-template <class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator(Node<Key, Value> *ptr)
+template <class Key, class Value, class Alloc, class Compare>
+BinarySearchTree<Key, Value, Alloc, Compare>::iterator::iterator(Node<Key, Value> *ptr,
+                                                                 const BinarySearchTree<Key, Value, Alloc, Compare> *tree)
 {
     // TODO
     this->current_ = ptr;
+    this->tree_ = tree;
 }
 
 /**
  * A default constructor that initializes the iterator to NULL.
  */
-template <class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator()
+template <class Key, class Value, class Alloc, class Compare>
+BinarySearchTree<Key, Value, Alloc, Compare>::iterator::iterator()
 {
     // TODO
     this->current_ = nullptr;
+    this->tree_ = nullptr;
 }
 
 /**
  * Provides access to the item.
  */
-template <class Key, class Value>
+template <class Key, class Value, class Alloc, class Compare>
 std::pair<const Key, Value> &
-BinarySearchTree<Key, Value>::iterator::operator*() const
+BinarySearchTree<Key, Value, Alloc, Compare>::iterator::operator*() const
 {
     return current_->getItem();
 }
@@ -300,9 +592,9 @@ BinarySearchTree<Key, Value>::iterator::operator*() const
 /**
  * Provides access to the address of the item.
  */
-template <class Key, class Value>
+template <class Key, class Value, class Alloc, class Compare>
 std::pair<const Key, Value> *
-BinarySearchTree<Key, Value>::iterator::operator->() const
+BinarySearchTree<Key, Value, Alloc, Compare>::iterator::operator->() const
 {
     return &(current_->getItem());
 }
@@ -311,9 +603,9 @@ BinarySearchTree<Key, Value>::iterator::operator->() const
  * Checks if 'this' iterator's internals have the same value
  * as 'rhs'
  */
-template <class Key, class Value>
-bool BinarySearchTree<Key, Value>::iterator::operator==(
-    const BinarySearchTree<Key, Value>::iterator &rhs) const
+template <class Key, class Value, class Alloc, class Compare>
+bool BinarySearchTree<Key, Value, Alloc, Compare>::iterator::operator==(
+    const BinarySearchTree<Key, Value, Alloc, Compare>::iterator &rhs) const
 {
     // TODO
     return current_ == rhs.current_;
@@ -323,9 +615,9 @@ bool BinarySearchTree<Key, Value>::iterator::operator==(
  * Checks if 'this' iterator's internals have a different value
  * as 'rhs'
  */
-template <class Key, class Value>
-bool BinarySearchTree<Key, Value>::iterator::operator!=(
-    const BinarySearchTree<Key, Value>::iterator &rhs) const
+template <class Key, class Value, class Alloc, class Compare>
+bool BinarySearchTree<Key, Value, Alloc, Compare>::iterator::operator!=(
+    const BinarySearchTree<Key, Value, Alloc, Compare>::iterator &rhs) const
 {
     // TODO
     return current_ != rhs.current_;
@@ -334,9 +626,9 @@ bool BinarySearchTree<Key, Value>::iterator::operator!=(
 /**
  * Advances the iterator's location using an in-order sequencing
  */
-template <class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator &
-BinarySearchTree<Key, Value>::iterator::operator++()
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator &
+BinarySearchTree<Key, Value, Alloc, Compare>::iterator::operator++()
 {
     // TODO
     // in order traversal: (left-root-right)
@@ -378,12 +670,94 @@ BinarySearchTree<Key, Value>::iterator::operator++()
     return *this;
 }
 
+/**
+ * Advances the iterator, returning where it was.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::iterator::operator++(int)
+{
+    iterator before(*this);
+    ++(*this);
+    return before;
+}
+
+/**
+ * Moves the iterator back to the previous item in key order. The end
+ * iterator moves to the largest item; begin() must not be decremented.
+ * O(1) amortized over a scan, O(log n) at worst on a balanced tree.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator &
+BinarySearchTree<Key, Value, Alloc, Compare>::iterator::operator--()
+{
+    if (current_ == nullptr)
+    {
+        current_ = (tree_ != nullptr) ? tree_->getLargestNode() : nullptr;
+    }
+    else
+    {
+        current_ = predecessor(current_);
+    }
+    return *this;
+}
+
+/**
+ * Moves the iterator back, returning where it was.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::iterator::operator--(int)
+{
+    iterator before(*this);
+    --(*this);
+    return before;
+}
+
 /*
 -------------------------------------------------------------
 End implementations for the BinarySearchTree::iterator class.
 -------------------------------------------------------------
 */
 
+/**
+ * Constructs a view of the items from first up to, but not including, last.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+BinarySearchTree<Key, Value, Alloc, Compare>::RangeView::RangeView(const iterator &first, const iterator &last) : first_(first),
+                                                                                                         last_(last)
+{
+}
+
+/**
+ * Returns an iterator to the first item in the view.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::RangeView::begin() const
+{
+    return first_;
+}
+
+/**
+ * Returns an iterator just past the last item in the view.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::RangeView::end() const
+{
+    return last_;
+}
+
+/**
+ * Returns true if the view has no items.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+bool BinarySearchTree<Key, Value, Alloc, Compare>::RangeView::empty() const
+{
+    return first_ == last_;
+}
+
 /*
 -----------------------------------------------------
 Begin implementations for the BinarySearchTree class.
@@ -394,16 +768,25 @@ Begin implementations for the BinarySearchTree class.
  * Default constructor for a BinarySearchTree, which sets the root to NULL.
  */
 // constructor
-template <class Key, class Value>
-BinarySearchTree<Key, Value>::BinarySearchTree()
+template <class Key, class Value, class Alloc, class Compare>
+BinarySearchTree<Key, Value, Alloc, Compare>::BinarySearchTree()
 {
     // TODO
     this->root_ = nullptr;
 }
 
+/**
+ * Constructor for an empty tree ordered by the given comparator.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+BinarySearchTree<Key, Value, Alloc, Compare>::BinarySearchTree(const Compare &comp) : root_(nullptr),
+                                                                                    comp_(comp)
+{
+}
+
 // destructor
-template <typename Key, typename Value>
-BinarySearchTree<Key, Value>::~BinarySearchTree()
+template <typename Key, typename Value, typename Alloc, typename Compare>
+BinarySearchTree<Key, Value, Alloc, Compare>::~BinarySearchTree()
 {
     // TODO
     clear();
@@ -412,14 +795,48 @@ BinarySearchTree<Key, Value>::~BinarySearchTree()
 /**
  * Returns true if tree is empty
  */
-template <class Key, class Value>
-bool BinarySearchTree<Key, Value>::empty() const
+template <class Key, class Value, class Alloc, class Compare>
+bool BinarySearchTree<Key, Value, Alloc, Compare>::empty() const
 {
     return root_ == NULL;
 }
 
-template <typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print() const
+/**
+ * Returns a copy of the comparator that orders the keys.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+Compare BinarySearchTree<Key, Value, Alloc, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+ * Returns the counters of the tree's operations since it was made or since
+ * resetStats(). They are only kept in builds that define TREE_STATS; in
+ * others this is always an empty TreeStats.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+const TreeStats &BinarySearchTree<Key, Value, Alloc, Compare>::stats() const
+{
+#ifdef TREE_STATS
+    return stats_;
+#else
+    static const TreeStats none;
+    return none;
+#endif
+}
+
+/**
+ * Sets every counter back to zero.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::resetStats()
+{
+    TREE_STATS_DO(stats_ = TreeStats();)
+}
+
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::print() const
 {
     printRoot(root_);
     std::cout << "\n";
@@ -428,52 +845,122 @@ void BinarySearchTree<Key, Value>::print() const
 /**
  * Returns an iterator to the "smallest" item in the tree
  */
-template <class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::begin() const
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::begin() const
 {
-    BinarySearchTree<Key, Value>::iterator begin(getSmallestNode());
+    BinarySearchTree<Key, Value, Alloc, Compare>::iterator begin(getSmallestNode(), this);
     return begin;
 }
 
 /**
  * Returns an iterator whose value means INVALID
  */
-template <class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::end() const
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::end() const
 {
-    BinarySearchTree<Key, Value>::iterator end(NULL);
+    BinarySearchTree<Key, Value, Alloc, Compare>::iterator end(NULL, this);
     return end;
 }
 
+/**
+ * Returns a reverse iterator to the "largest" item in the tree
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::reverse_iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::rbegin() const
+{
+    return reverse_iterator(end());
+}
+
+/**
+ * Returns a reverse iterator just before the "smallest" item in the tree
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::reverse_iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::rend() const
+{
+    return reverse_iterator(begin());
+}
+
 /**
  * Returns an iterator to the item with the given key, k
  * or the end iterator if k does not exist in the tree
  */
-template <class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::find(const Key &k) const
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::find(const Key &k) const
 {
     Node<Key, Value> *curr = internalFind(k);
-    BinarySearchTree<Key, Value>::iterator it(curr);
+    BinarySearchTree<Key, Value, Alloc, Compare>::iterator it(curr, this);
     return it;
 }
 
+/**
+ * Returns an iterator to the first item whose key is not less than k,
+ * or the end iterator if there is none. O(log n) on a balanced tree.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::lower_bound(const Key &k) const
+{
+    return iterator(internalLowerBound(k), this);
+}
+
+/**
+ * Returns an iterator to the first item whose key is greater than k,
+ * or the end iterator if there is none.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::upper_bound(const Key &k) const
+{
+    return iterator(internalUpperBound(k), this);
+}
+
+/**
+ * Returns the range of items with key k: either empty, or just that one item
+ * since keys are unique.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator,
+          typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator>
+BinarySearchTree<Key, Value, Alloc, Compare>::equal_range(const Key &k) const
+{
+    return internalEqualRange(k);
+}
+
+/**
+ * Returns a view of every item with a key in [lo, hi), for use as
+ *   for (auto &item : tree.range(lo, hi))
+ * Finding the ends is O(log n); walking the k items in between is O(k).
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::RangeView
+BinarySearchTree<Key, Value, Alloc, Compare>::range(const Key &lo, const Key &hi) const
+{
+    if (!comp_(lo, hi))
+    {
+        return RangeView(end(), end());
+    }
+    return RangeView(lower_bound(lo), lower_bound(hi));
+}
+
 /**
  * @precondition The key exists in the map
  * Returns the value associated with the key
  */
-template <class Key, class Value>
-Value &BinarySearchTree<Key, Value>::operator[](const Key &key)
+template <class Key, class Value, class Alloc, class Compare>
+Value &BinarySearchTree<Key, Value, Alloc, Compare>::operator[](const Key &key)
 {
     Node<Key, Value> *curr = internalFind(key);
     if (curr == NULL)
         throw std::out_of_range("Invalid key");
     return curr->getValue();
 }
-template <class Key, class Value>
-Value const &BinarySearchTree<Key, Value>::operator[](const Key &key) const
+template <class Key, class Value, class Alloc, class Compare>
+Value const &BinarySearchTree<Key, Value, Alloc, Compare>::operator[](const Key &key) const
 {
     Node<Key, Value> *curr = internalFind(key);
     if (curr == NULL)
@@ -481,61 +968,318 @@ Value const &BinarySearchTree<Key, Value>::operator[](const Key &key) const
     return curr->getValue();
 }
 
+/**
+ * find() that starts the search from hint instead of the root, climbing
+ * only as far up as key needs (see fingerStart). Fast for lookups close
+ * to the previous one; an end() hint searches from the root.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::find(const iterator &hint, const Key &key) const
+{
+    if (hint.current_ == nullptr)
+    {
+        return find(key);
+    }
+    return iterator(internalFind(key, fingerStart(hint.current_, key)), this);
+}
+
+/**
+ * find() for a key of another type, e.g. a std::string_view into a tree of
+ * std::strings. Only available when Compare is transparent.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::find(const K &k) const
+{
+    return iterator(internalFind(k), this);
+}
+
+/**
+ * lower_bound() for a key of another type, as for find() above.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::lower_bound(const K &k) const
+{
+    return iterator(internalLowerBound(k), this);
+}
+
+/**
+ * upper_bound() for a key of another type, as for find() above.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::upper_bound(const K &k) const
+{
+    return iterator(internalUpperBound(k), this);
+}
+
+/**
+ * equal_range() for a key of another type, as for find() above.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K, typename C, typename>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator,
+          typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator>
+BinarySearchTree<Key, Value, Alloc, Compare>::equal_range(const K &k) const
+{
+    return internalEqualRange(k);
+}
+
 /**
  * An insert method to insert into a Binary Search Tree.
  * The tree will not remain balanced when inserting.
  * Recall: If key is already in the tree, you should
  * overwrite the current value with the updated value.
  */
-template <class Key, class Value>
-void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
+template <class Key, class Value, class Alloc, class Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::insert(const std::pair<const Key, Value> &keyValuePair)
 {
     //^takes in pair object named keyValuePair
-    // if tree empty make new node and make a root and finish
-    if (!root_)
+    insertImpl(keyValuePair.first, keyValuePair.second, true);
+}
+
+/**
+ * Inserts like insert(const&), but the search for the key's place starts
+ * from hint instead of the root (see fingerStart), which is faster when
+ * hint is at or near that place, as when inserting a nearly sorted stream
+ * and passing back the iterator of the previous insert. An end() hint
+ * inserts as usual. Returns an iterator to the key.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::insert(const iterator &hint, const std::pair<const Key, Value> &keyValuePair)
+{
+    return iterator(insertNear(hint.current_, keyValuePair.first, keyValuePair.second).first, this);
+}
+
+/**
+ * Inserts like insert(const&), but moves the value into the tree (into the
+ * new node, or over the old value) rather than copying it. The key is
+ * const in the pair, so it is still copied.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::insert(std::pair<const Key, Value> &&keyValuePair)
+{
+    insertMoved(Key(keyValuePair.first), std::move(keyValuePair.second), true);
+}
+
+/**
+ * Builds an item from args, as std::pair<Key, Value>'s constructors would,
+ * right in a new node, and links the node in if its key is not already
+ * there (destroying it otherwise). Returns the item with that key, and
+ * whether it was inserted.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Alloc, Compare>::emplace(Args &&...args)
+{
+    ArgsItemMaker<Key, Value, Args...> maker(std::forward<Args>(args)...);
+    std::pair<Node<Key, Value> *, bool> result = emplaceImpl(nullptr, maker);
+    return std::make_pair(iterator(result.first, this), result.second);
+}
+
+/**
+ * Inserts a value made from args under key, unless key is already present,
+ * in which case args are left untouched. One descent finds either the key
+ * or the place for it. Returns the item with key, and whether it was inserted.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Alloc, Compare>::try_emplace(const Key &key, Args &&...args)
+{
+    std::tuple<const Key &> keyArgs(key);
+    std::tuple<Args &&...> valueArgs(std::forward<Args>(args)...);
+    // the tuples are passed on as rvalues, since a tuple of && can't be copied
+    ArgsItemMaker<Key, Value, const std::piecewise_construct_t &, std::tuple<const Key &>, std::tuple<Args &&...> >
+        maker(std::piecewise_construct, std::move(keyArgs), std::move(valueArgs));
+    std::pair<Node<Key, Value> *, bool> result = emplaceImpl(&key, maker);
+    return std::make_pair(iterator(result.first, this), result.second);
+}
+
+/**
+ * As above, but moves the key into the tree as well.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Alloc, Compare>::try_emplace(Key &&key, Args &&...args)
+{
+    std::tuple<Key &&> keyArgs(std::move(key));
+    std::tuple<Args &&...> valueArgs(std::forward<Args>(args)...);
+    // the tuples are passed on as rvalues, since a tuple of && can't be copied
+    ArgsItemMaker<Key, Value, const std::piecewise_construct_t &, std::tuple<Key &&>, std::tuple<Args &&...> >
+        maker(std::piecewise_construct, std::move(keyArgs), std::move(valueArgs));
+    std::pair<Node<Key, Value> *, bool> result = emplaceImpl(&key, maker);
+    return std::make_pair(iterator(result.first, this), result.second);
+}
+
+/**
+ * Does the work of emplace and try_emplace. With a key, searches for it
+ * first and only builds a node (from maker) if it is missing; without one,
+ * builds the node first and searches for its key, destroying it if that
+ * key is already present. Either way there is one descent, and the item
+ * is constructed at most once.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+std::pair<Node<Key, Value> *, bool> BinarySearchTree<Key, Value, Alloc, Compare>::emplaceImpl(const Key *key, const ItemMaker<Key, Value> &maker)
+{
+    Node<Key, Value> *built = nullptr;
+    if (key == nullptr)
     {
-        root_ = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, nullptr);
-        return;
+        built = buildNode(maker, 0, 1);
+        key = &built->getKey();
     }
+    prepareInsert(*key);
+    InsertPosition position = findInsertPosition(*key);
+    if (position.existing != nullptr)
+    {
+        if (built != nullptr)
+        {
+            destroyNode(built);
+        }
+        return std::make_pair(position.existing, false);
+    }
+    if (built == nullptr)
+    {
+        // may move from *key, which is not needed after the search
+        built = buildNode(maker, 0, 1);
+    }
+    linkNew(built, position);
+    return std::make_pair(built, true);
+}
+
+/**
+ * Does nothing here. Derived trees that must do something to the tree
+ * before key is linked in (see SnapshotAVLTree) override it.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::prepareInsert(const Key & /*key*/)
+{
+}
+
+/**
+ * Inserts a moved key and value. Virtual so that derived trees can do
+ * their own bookkeeping; see insertImpl for the rest.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+std::pair<Node<Key, Value> *, bool> BinarySearchTree<Key, Value, Alloc, Compare>::insertMoved(Key &&key, Value &&value, bool overwrite)
+{
+    return insertImpl(std::move(key), std::move(value), overwrite);
+}
+
+/**
+ * Inserts a copy of the key and value, searching from near finger (a node
+ * of this tree) instead of from the root. Virtual so that derived trees
+ * can do their own bookkeeping, as for insertMoved.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+std::pair<Node<Key, Value> *, bool> BinarySearchTree<Key, Value, Alloc, Compare>::insertNear(Node<Key, Value> *finger, const Key &key, const Value &value)
+{
+    return insertImpl(key, value, true, (finger != nullptr && root_ != nullptr) ? fingerStart(finger, key) : nullptr);
+}
 
+/**
+ * Does the work of every insert. K and V are either const references, to
+ * copy from, or rvalue references, to move from. If the key is already in
+ * the tree its value is replaced when overwrite is set. Returns the node
+ * with the key, and whether it is new.
+ *
+ * The search starts at start, or at the root if that is NULL; start must
+ * be a node whose subtree holds key's place (see fingerStart).
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K, typename V>
+std::pair<Node<Key, Value> *, bool> BinarySearchTree<Key, Value, Alloc, Compare>::insertImpl(K &&key, V &&value, bool overwrite,
+                                                                                            Node<Key, Value> *start)
+{
     // TODO
-    Node<Key, Value> *current = root_;  // tracks curr node, start from root
-    Node<Key, Value> *parent = nullptr; // keeps track of par node
+    InsertPosition position = findInsertPosition(key, start);
+
+    // if key alr exists, update val and return
+    if (position.existing != nullptr)
+    {
+        if (overwrite)
+        {
+            position.existing->setValue(std::forward<V>(value));
+        }
+        return std::make_pair(position.existing, false); // exit funct
+    }
+
+    // insert new node as child of parent node
+    Node<Key, Value> *newNode = createNode(std::forward<K>(key), std::forward<V>(value), position.parent);
+    BinarySearchTree<Key, Value, Alloc, Compare>::linkNew(newNode, position);
+    return std::make_pair(newNode, true);
+}
+
+/**
+ * Searches for key the way every insert does, from start (see insertImpl)
+ * or the root, with one comparison per level. Returns the node with key
+ * if there is one, and otherwise the parent a new node for key would hang
+ * from (NULL for an empty tree) and on which side.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::InsertPosition
+BinarySearchTree<Key, Value, Alloc, Compare>::findInsertPosition(const K &key, Node<Key, Value> *start) const
+{
+    Node<Key, Value> *current = start ? start : root_; // tracks curr node, start from root
+    Node<Key, Value> *notGreater = nullptr;            // last node whose key is <= key
+    InsertPosition position = {nullptr, nullptr, false};
+    TREE_STATS_DO(std::uint64_t depth = 0;)
 
     // go thru tree to find correct posit for new node
     while (current != nullptr)
     {
-        parent = current; // track parent node
-        // first = key                          // track parent
-        if (keyValuePair.first < current->getKey()) // if key is less, go left
+        TREE_STATS_DO(++depth;)
+        position.parent = current; // track parent node
+        position.isLeft = comp_(key, current->getKey());
+        if (position.isLeft) // if key is less, go left
         {
             current = current->getLeft();
         }
-        // first = key
-        else if (keyValuePair.first > current->getKey()) // if key is greater than go right
+        else // otherwise go right
         {
+            notGreater = current;
             current = current->getRight();
         }
-        else // if key alr exists update val
-        {
-            // update val and return
-            //  second = value
-            current->setValue(keyValuePair.second);
-            return; // exit funct
-        }
     }
+    TREE_STATS_DO(stats_.insertDepth.record(depth);)
 
-    // insert new node as child of parent node
-    if (keyValuePair.first < parent->getKey())
+    // if key alr exists, it is the last node we went right from
+    if (notGreater != nullptr && !comp_(notGreater->getKey(), key))
+    {
+        position.existing = notGreater;
+    }
+    return position;
+}
+
+/**
+ * Hangs a new node where findInsertPosition said it goes. Virtual so that
+ * derived trees can rebalance afterwards.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::linkNew(Node<Key, Value> *node, const InsertPosition &position)
+{
+    node->setParent(position.parent);
+    if (position.parent == nullptr)
+    {
+        root_ = node; // tree was empty
+    }
+    else if (position.isLeft)
     {
-        parent->setLeft(new Node<Key, Value>(keyValuePair.first, keyValuePair.second, parent));
+        position.parent->setLeft(node);
     }
     else
     {
-        parent->setRight(new Node<Key, Value>(keyValuePair.first, keyValuePair.second, parent));
+        position.parent->setRight(node);
     }
-
-    // first = key, second = value
 }
 
 /**
@@ -543,8 +1287,8 @@ void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &key
  * Recall: The writeup specifies that if a node has 2 children you
  * should swap with the predecessor and then remove.
  */
-template <typename Key, typename Value>
-void BinarySearchTree<Key, Value>::remove(const Key &key)
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::remove(const Key &key)
 {
     // TODO
     // plan:
@@ -606,12 +1350,12 @@ void BinarySearchTree<Key, Value>::remove(const Key &key)
         }
     }
     // delete current node
-    delete nodeToRemove;
+    destroyNode(nodeToRemove);
 }
 
-template <class Key, class Value>
+template <class Key, class Value, class Alloc, class Compare>
 Node<Key, Value> *
-BinarySearchTree<Key, Value>::predecessor(Node<Key, Value> *current)
+BinarySearchTree<Key, Value, Alloc, Compare>::predecessor(Node<Key, Value> *current)
 {
     if (current == nullptr)
         return nullptr;
@@ -643,32 +1387,323 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value> *current)
  */
 
 // helper function for clear
-template <typename Key, typename Value>
-void deleteSubtree(Node<Key, Value> *node)
+// Rotates each left child up until the node has none, then frees it and
+// moves right, so it takes O(n) time and O(1) memory for any tree shape.
+// Parent pointers are left stale since every node is freed.
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::deleteSubtree(Node<Key, Value> *node)
 {
-    if (node != nullptr)
+    while (node != nullptr)
     {
-        deleteSubtree(node->getLeft());
-        deleteSubtree(node->getRight());
-        delete node;
+        Node<Key, Value> *left = node->getLeft();
+        if (left != nullptr)
+        {
+            // rotate right: left takes node's place, node becomes its right child
+            node->setLeft(left->getRight());
+            left->setRight(node);
+            node = left;
+        }
+        else
+        {
+            Node<Key, Value> *right = node->getRight();
+            destroyNode(node);
+            node = right;
+        }
     }
 }
 
 // clear function
-template <typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear()
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::clear()
 {
     // TODO
-    deleteSubtree(root_);
+    // a pooled allocator frees everything in one go, so only walk the
+    // tree when keys or values have destructors that must run
+    if (!Alloc::bulkRelease ||
+        !std::is_trivially_destructible<Key>::value ||
+        !std::is_trivially_destructible<Value>::value)
+    {
+        deleteSubtree(root_);
+    }
+    alloc_.release();
     root_ = nullptr;
 }
 
+/**
+ * Replaces the contents of the tree with the items in [first, last), which
+ * must be sorted by key with no duplicates. The result is perfectly balanced
+ * and is built in O(n) time, with no comparisons at all.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename ForwardIt>
+void BinarySearchTree<Key, Value, Alloc, Compare>::buildFromSorted(ForwardIt first, ForwardIt last)
+{
+    clear();
+    std::size_t n = std::distance(first, last);
+    root_ = buildSubtree(first, n);
+}
+
+/**
+ * Replaces the contents of the tree with the items in [first, last), in any
+ * order. The items are sorted first, so this runs in O(n log n). As with
+ * insert, the last value given for a key wins.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename InputIt>
+void BinarySearchTree<Key, Value, Alloc, Compare>::buildFromUnsorted(InputIt first, InputIt last)
+{
+    std::vector<std::pair<Key, Value> > items(first, last);
+    sortUnique(items);
+    buildFromSorted(items.begin(), items.end());
+}
+
+/**
+ * Sorts items by key and drops duplicate keys, keeping the last one given
+ * for each, as a run of inserts would. O(n log n).
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::sortUnique(std::vector<std::pair<Key, Value> > &items) const
+{
+    std::stable_sort(items.begin(), items.end(),
+                     [this](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b)
+                     { return comp_(a.first, b.first); });
+
+    // drop duplicate keys, keeping the last one seen for each
+    typename std::vector<std::pair<Key, Value> >::iterator out = items.begin();
+    for (typename std::vector<std::pair<Key, Value> >::iterator in = items.begin(); in != items.end(); ++in)
+    {
+        if (in + 1 != items.end() && !comp_(in->first, (in + 1)->first))
+            continue;
+        if (out != in)
+            *out = std::move(*in);
+        ++out;
+    }
+    items.erase(out, items.end());
+}
+
+/**
+ * Returns an immutable copy of the tree with the same find/iterator
+ * interface, laid out in arrays for lookups that miss cache far less often
+ * (see FrozenTree). O(n); the tree itself is unchanged.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+FrozenTree<Key, Value, Compare> BinarySearchTree<Key, Value, Alloc, Compare>::freeze() const
+{
+    return FrozenTree<Key, Value, Compare>(begin(), end(), comp_);
+}
+
+/**
+ * Writes the items to the file at path as a frozen tree (see FrozenTree::save).
+ * FrozenTree<Key, Value, Compare>::mapFile(path) loads it back without
+ * reinserting anything. Keys and values must be trivially copyable.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::save(const std::string &path) const
+{
+    freeze().save(path);
+}
+
+/**
+ * Writes the items to out in key order, in the binary stream format of
+ * stream_codec.h: varints, with integer keys delta encoded. Streams
+ * straight from the iterators, so it takes O(1) memory beyond the tree,
+ * and O(n) time (one pass to count the items, one to write them).
+ * Throws std::runtime_error if out fails.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::serialize(std::ostream &out) const
+{
+    std::uint64_t count = 0;
+    for (iterator it = begin(); it != end(); ++it)
+    {
+        ++count;
+    }
+
+    out.write("BSTS", 4);
+    stream_codec_detail::writeVarint(out, 1); // format version
+    stream_codec_detail::writeVarint(out, StreamCodec<Key>::tag());
+    stream_codec_detail::writeVarint(out, StreamCodec<Value>::tag());
+    stream_codec_detail::writeVarint(out, KeyStreamCodec<Key, Compare>::MODE);
+    stream_codec_detail::writeVarint(out, count);
+
+    KeyStreamCodec<Key, Compare> keys;
+    for (iterator it = begin(); it != end() && out; ++it)
+    {
+        keys.write(out, it->first);
+        StreamCodec<Value>::write(out, it->second);
+    }
+    if (!out)
+        throw std::runtime_error("BinarySearchTree::serialize: write failed");
+}
+
+/**
+ * Replaces the contents of the tree with the items of a stream written by
+ * serialize(), rebuilt in O(n) by buildFromSorted instead of n inserts.
+ * The items are decoded in full before the old contents are cleared, so
+ * if the stream is truncated, corrupt, out of order or for other key or
+ * value types, std::runtime_error is thrown and the tree is unchanged.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::deserialize(std::istream &in)
+{
+    char magic[4];
+    stream_codec_detail::readBytes(in, magic, sizeof(magic));
+    if (std::memcmp(magic, "BSTS", sizeof(magic)) != 0 ||
+        stream_codec_detail::readVarint(in) != 1 ||
+        stream_codec_detail::readVarint(in) != StreamCodec<Key>::tag() ||
+        stream_codec_detail::readVarint(in) != StreamCodec<Value>::tag() ||
+        stream_codec_detail::readVarint(in) != KeyStreamCodec<Key, Compare>::MODE)
+    {
+        throw std::runtime_error("BinarySearchTree::deserialize: not a stream of this tree type");
+    }
+    std::uint64_t count = stream_codec_detail::readVarint(in);
+
+    // reserve no more than a bad count could make us regret
+    std::vector<std::pair<Key, Value> > items;
+    items.reserve(static_cast<std::size_t>(std::min<std::uint64_t>(count, 1 << 16)));
+    KeyStreamCodec<Key, Compare> keys;
+    for (std::uint64_t i = 0; i < count; ++i)
+    {
+        std::pair<Key, Value> item;
+        keys.read(in, item.first);
+        StreamCodec<Value>::read(in, item.second);
+        if (!items.empty() && !comp_(items.back().first, item.first))
+            throw std::runtime_error("BinarySearchTree::deserialize: keys out of order");
+        items.push_back(std::move(item));
+    }
+    buildFromSorted(items.begin(), items.end());
+}
+
+/**
+ * Builds a subtree out of the next n items of it, in order, and returns its root.
+ * The left subtree gets the smaller half, so a subtree of n nodes is exactly
+ * as tall as n has bits, which is what gives AVL nodes their balance.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename ForwardIt>
+Node<Key, Value> *BinarySearchTree<Key, Value, Alloc, Compare>::buildSubtree(ForwardIt &it, std::size_t n)
+{
+    if (n == 0)
+        return nullptr;
+
+    std::size_t leftSize = (n - 1) / 2;
+    std::size_t rightSize = n - 1 - leftSize;
+
+    Node<Key, Value> *left = buildSubtree(it, leftSize);
+
+    // height of a subtree built from m items is the bit length of m
+    int balance = (rightSize > leftSize && (rightSize & (rightSize - 1)) == 0) ? 1 : 0;
+    Node<Key, Value> *node = buildNode(it->first, it->second, balance, n);
+    ++it;
+
+    Node<Key, Value> *right = buildSubtree(it, rightSize);
+
+    node->setLeft(left);
+    node->setRight(right);
+    if (left != nullptr)
+        left->setParent(node);
+    if (right != nullptr)
+        right->setParent(node);
+    return node;
+}
+
+/**
+ * Creates a parentless node for buildSubtree. The balance and subtree size
+ * are only meaningful to derived trees, which override this to make their
+ * own nodes.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+Node<Key, Value> *BinarySearchTree<Key, Value, Alloc, Compare>::buildNode(const Key &key, const Value &value, int /*balance*/, std::size_t /*size*/)
+{
+    return createNode<Node<Key, Value> >(key, value, nullptr);
+}
+
+/**
+ * As above, but moves the key and value into the node.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+Node<Key, Value> *BinarySearchTree<Key, Value, Alloc, Compare>::buildNode(Key &&key, Value &&value, int /*balance*/, std::size_t /*size*/)
+{
+    return createNode<Node<Key, Value> >(std::move(key), std::move(value), nullptr);
+}
+
+/**
+ * Creates a node whose item is built in place by maker.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+Node<Key, Value> *BinarySearchTree<Key, Value, Alloc, Compare>::buildNode(const ItemMaker<Key, Value> &maker, int /*balance*/, std::size_t /*size*/)
+{
+    return createNode<Node<Key, Value> >(maker, nullptr);
+}
+
+/**
+ * Wraps a node in an iterator. Only BinarySearchTree may construct iterators
+ * from nodes, so derived trees go through here.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, Compare>::makeIterator(Node<Key, Value> *node) const
+{
+    return iterator(node, this);
+}
+
+/**
+ * Allocates storage for a node from alloc_ and constructs it in place.
+ * Templated on the node type so derived trees can allocate their own nodes,
+ * and forwards key and value so rvalues are moved into the node.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename NodeType, typename K, typename V>
+NodeType *BinarySearchTree<Key, Value, Alloc, Compare>::createNode(K &&key, V &&value, NodeType *parent)
+{
+    void *mem = alloc_.allocate(sizeof(NodeType), alignof(NodeType));
+    try
+    {
+        return new (mem) NodeType(std::forward<K>(key), std::forward<V>(value), parent);
+    }
+    catch (...)
+    {
+        alloc_.deallocate(mem);
+        throw;
+    }
+}
+
+/**
+ * As above, but the node's item is built in place by maker.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename NodeType>
+NodeType *BinarySearchTree<Key, Value, Alloc, Compare>::createNode(const ItemMaker<Key, Value> &maker, NodeType *parent)
+{
+    void *mem = alloc_.allocate(sizeof(NodeType), alignof(NodeType));
+    try
+    {
+        return new (mem) NodeType(maker, parent);
+    }
+    catch (...)
+    {
+        alloc_.deallocate(mem);
+        throw;
+    }
+}
+
+/**
+ * Destroys a node and hands its storage back to alloc_.
+ * Virtual because nodes are not: a derived tree destroys its own node type.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::destroyNode(Node<Key, Value> *node)
+{
+    node->~Node();
+    alloc_.deallocate(node);
+}
+
 /**
  * A helper function to find the smallest node in the tree.
  */
-template <typename Key, typename Value>
+template <typename Key, typename Value, typename Alloc, typename Compare>
 Node<Key, Value> *
-BinarySearchTree<Key, Value>::getSmallestNode() const
+BinarySearchTree<Key, Value, Alloc, Compare>::getSmallestNode() const
 {
     // TODO
     Node<Key, Value> *current = root_;
@@ -679,61 +1714,281 @@ BinarySearchTree<Key, Value>::getSmallestNode() const
     return current;
 }
 
+/**
+ * Returns the node with the largest key, or NULL if the tree is empty.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+Node<Key, Value> *
+BinarySearchTree<Key, Value, Alloc, Compare>::getLargestNode() const
+{
+    Node<Key, Value> *current = root_;
+    while (current && current->getRight() != nullptr)
+    {
+        current = current->getRight();
+    }
+    return current;
+}
+
 /**
  * Helper function to find a node with given key, k and
  * return a pointer to it or NULL if no item with that key
- * exists
+ * exists. Finds the lower bound, which takes one comparison per
+ * level, and then checks it against k once. A non-NULL start
+ * must be a node whose subtree holds k's place (see fingerStart).
  */
-template <typename Key, typename Value>
-Node<Key, Value> *BinarySearchTree<Key, Value>::internalFind(const Key &key) const
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+Node<Key, Value> *BinarySearchTree<Key, Value, Alloc, Compare>::internalFind(const K &key, Node<Key, Value> *start) const
 {
     // TODO
-    Node<Key, Value> *current = root_;
+    Node<Key, Value> *candidate = internalLowerBound(key, start);
+    if (candidate != nullptr && !comp_(key, candidate->getKey()))
+    {
+        return candidate;
+    }
+    return nullptr;
+}
+
+/**
+ * Helper function to find the first node whose key is not less than k,
+ * or NULL if every key is less than k. Given a start node, only start's
+ * subtree is searched, which is enough for internalFind.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+Node<Key, Value> *BinarySearchTree<Key, Value, Alloc, Compare>::internalLowerBound(const K &key, Node<Key, Value> *start) const
+{
+    Node<Key, Value> *current = start ? start : root_;
+    Node<Key, Value> *best = nullptr;
+    TREE_STATS_DO(std::uint64_t depth = 0;)
     while (current != nullptr)
     {
-        if (key < current->getKey())
+        TREE_STATS_DO(++depth;)
+        if (comp_(current->getKey(), key))
         {
+            current = current->getRight();
+        }
+        else
+        {
+            // candidate, but there may be a smaller one on the left
+            best = current;
             current = current->getLeft();
         }
-        else if (key > current->getKey())
+    }
+    TREE_STATS_DO(stats_.lookupDepth.record(depth);)
+    return best;
+}
+
+/**
+ * Helper function for finger search: returns the lowest node that is finger
+ * or an ancestor of it and whose subtree is sure to hold key's place, so a
+ * search for key can start there instead of at the root.
+ *
+ * Only the ancestors on key's side of finger bound its subtree towards key,
+ * so the climb compares key with those alone, and stops at the first one
+ * that lies beyond key. For a key d places from finger that is usually
+ * O(log d) levels up, and the descent back down is as short. A key that
+ * falls past every ancestor (e.g. a new largest key, with finger on the
+ * largest) starts at the highest node it can, with no comparison spent.
+ * At worst, when key and finger straddle a node near the root, the climb
+ * and descent each cost the height of the tree.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+Node<Key, Value> *BinarySearchTree<Key, Value, Alloc, Compare>::fingerStart(Node<Key, Value> *finger, const K &key) const
+{
+    bool left = comp_(key, finger->getKey());
+    if (!left && !comp_(finger->getKey(), key))
+    {
+        return finger; // key is finger's own
+    }
+    Node<Key, Value> *start = finger;
+    Node<Key, Value> *current = finger;
+    for (Node<Key, Value> *parent = current->getParent(); parent != nullptr; current = parent, parent = parent->getParent())
+    {
+        // coming up from the side away from key, parent bounds nothing new
+        if (current == (left ? parent->getLeft() : parent->getRight()))
         {
-            current = current->getRight();
+            continue;
+        }
+        // parent lies beyond key: key's place is inside start's subtree
+        if (left ? comp_(parent->getKey(), key) : comp_(key, parent->getKey()))
+        {
+            return start;
+        }
+        start = parent;
+    }
+    return start;
+}
+
+/**
+ * Helper function to find the first node whose key is greater than k,
+ * or NULL if no key is greater than k.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+Node<Key, Value> *BinarySearchTree<Key, Value, Alloc, Compare>::internalUpperBound(const K &key) const
+{
+    Node<Key, Value> *current = root_;
+    Node<Key, Value> *best = nullptr;
+    TREE_STATS_DO(std::uint64_t depth = 0;)
+    while (current != nullptr)
+    {
+        TREE_STATS_DO(++depth;)
+        if (comp_(key, current->getKey()))
+        {
+            best = current;
+            current = current->getLeft();
         }
         else
         {
-            return current;
+            current = current->getRight();
         }
     }
-    return nullptr;
+    TREE_STATS_DO(stats_.lookupDepth.record(depth);)
+    return best;
+}
+
+/**
+ * Helper for both equal_range()s: the range of items with key k, which is
+ * either empty or just that one item since keys are unique.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator,
+          typename BinarySearchTree<Key, Value, Alloc, Compare>::iterator>
+BinarySearchTree<Key, Value, Alloc, Compare>::internalEqualRange(const K &k) const
+{
+    Node<Key, Value> *first = internalLowerBound(k);
+    if (first == nullptr || comp_(k, first->getKey()))
+    {
+        return std::make_pair(iterator(first, this), iterator(first, this));
+    }
+    iterator last(first, this);
+    ++last;
+    return std::make_pair(iterator(first, this), last);
 }
 
 /**
  * Return true iff the BST is balanced.
  */
-template <typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalanced() const
+template <typename Key, typename Value, typename Alloc, typename Compare>
+bool BinarySearchTree<Key, Value, Alloc, Compare>::isBalanced() const
 {
     // TODO
     return isBalancedHelper(root_);
 }
 
 // helper for balanced
-template <typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalancedHelper(Node<Key, Value> *node) const
+template <typename Key, typename Value, typename Alloc, typename Compare>
+bool BinarySearchTree<Key, Value, Alloc, Compare>::isBalancedHelper(Node<Key, Value> *node) const
 {
-    if (node == nullptr)
+    return checkHeights(node, [](const Node<Key, Value> *, int leftHeight, int rightHeight)
+                        { return std::abs(leftHeight - rightHeight) <= 1; });
+}
+
+/**
+ * Visits the subtree at root in postorder, computing every node's height
+ * from its children's as it goes, and calls check(node, leftHeight,
+ * rightHeight) on each node. Stops and returns false as soon as check does.
+ * O(n) time. The walk uses parent pointers, but unlike deleteSubtree it
+ * is not O(1) memory: the heights of finished left subtrees wait on a heap
+ * stack for their right siblings, so it holds up to one int per level,
+ * O(n) ints on a degenerate tree. That stays on the heap, so it can't
+ * overflow the call stack. Getting to O(1) would mean parking heights in
+ * the nodes or threading them Morris-style, and checks run on const trees
+ * whose nodes snapshots and concurrent readers may share, so they must
+ * not write to them even for a moment.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename Check>
+bool BinarySearchTree<Key, Value, Alloc, Compare>::checkHeights(const Node<Key, Value> *root, Check check)
+{
+    if (root == nullptr)
         return true;
 
-    int leftHeight = heightOfNode(node->getLeft());
-    int rightHeight = heightOfNode(node->getRight());
+    std::vector<int> heights; // heights of finished subtrees waiting on their parent
+    const Node<Key, Value> *current = root;
+    bool descending = true;
+    while (true)
+    {
+        if (descending)
+        {
+            // go down to the first node in postorder
+            while (current->getLeft() != nullptr || current->getRight() != nullptr)
+            {
+                current = (current->getLeft() != nullptr) ? current->getLeft() : current->getRight();
+            }
+        }
+
+        // children are finished, so their heights are on top of the stack
+        int rightHeight = -1;
+        int leftHeight = -1;
+        if (current->getRight() != nullptr)
+        {
+            rightHeight = heights.back();
+            heights.pop_back();
+        }
+        if (current->getLeft() != nullptr)
+        {
+            leftHeight = heights.back();
+            heights.pop_back();
+        }
+        if (!check(current, leftHeight, rightHeight))
+            return false;
+        heights.push_back(1 + std::max(leftHeight, rightHeight));
 
-    if (std::abs(leftHeight - rightHeight) > 1)
-        return false;
-    return isBalancedHelper(node->getLeft()) && isBalancedHelper(node->getRight());
+        if (current == root)
+            return true;
+
+        const Node<Key, Value> *parent = current->getParent();
+        if (current == parent->getLeft() && parent->getRight() != nullptr)
+        {
+            current = parent->getRight();
+            descending = true;
+        }
+        else
+        {
+            current = parent;
+            descending = false;
+        }
+    }
 }
 
-template <typename Key, typename Value>
-void BinarySearchTree<Key, Value>::nodeSwap(Node<Key, Value> *n1, Node<Key, Value> *n2)
+/**
+ * Returns the node after current in a preorder walk of the subtree rooted at
+ * root, or NULL once the walk is done. Uses parent pointers rather than a
+ * stack, and keeps depth (relative to root) up to date for the caller.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+const Node<Key, Value> *BinarySearchTree<Key, Value, Alloc, Compare>::nextPreorder(const Node<Key, Value> *current, const Node<Key, Value> *root, int &depth)
+{
+    if (current->getLeft() != nullptr)
+    {
+        ++depth;
+        return current->getLeft();
+    }
+    if (current->getRight() != nullptr)
+    {
+        ++depth;
+        return current->getRight();
+    }
+    // climb until we come up out of a left subtree whose sibling is unvisited
+    while (current != root)
+    {
+        const Node<Key, Value> *parent = current->getParent();
+        if (current == parent->getLeft() && parent->getRight() != nullptr)
+        {
+            return parent->getRight();
+        }
+        current = parent;
+        --depth;
+    }
+    return nullptr;
+}
+
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, Compare>::nodeSwap(Node<Key, Value> *n1, Node<Key, Value> *n2)
 {
     if ((n1 == n2) || (n1 == NULL) || (n2 == NULL))
     {
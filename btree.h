@@ -0,0 +1,1093 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <new>
+#include <type_traits>
+#include <cstddef>
+#include "node_pool.h"
+#include "key_search.h"
+
+/**
+ * An ordered map with many keys per node (a B+ tree), for indexes too big
+ * to fit in cache.
+ *
+ * An AVLTree lookup misses cache on nearly every one of its ~1.44 log2(n)
+ * levels. Here every node is a few cache lines holding a sorted array of
+ * keys, so a lookup touches about log_B(n) nodes for a fanout B in the tens.
+ * Inner nodes hold only keys and child pointers; the items all live in the
+ * leaves, which are chained together both ways so iteration, forwards or
+ * backwards, never climbs the tree.
+ * The search within a node is KeySearch's (see key_search.h), which scans
+ * integer keys with SIMD compares instead of binary searching them.
+ *
+ * The public interface matches AVLTree's (insert, remove, find, the bounds,
+ * iterator and operator[]), so switching an index over is a type change.
+ * Unlike AVLTree, inserting or removing moves the other items in the same
+ * leaf, so iterators and references are invalidated by any change.
+ *
+ * Nodes come from two Allocs (see node_pool.h), one per node type, which
+ * must honor cache line alignment as NodePool does.
+ */
+template <typename Key, typename Value, typename Alloc = NodePool, typename Compare = std::less<Key> >
+class BTree
+{
+public:
+    typedef std::pair<const Key, Value> Item;
+
+    BTree();
+    explicit BTree(const Compare &comp);
+    ~BTree();
+
+    void insert(const std::pair<const Key, Value> &keyValuePair);
+    void remove(const Key &key);
+    void clear();
+    bool empty() const;
+    std::size_t size() const;
+    Compare key_comp() const;
+
+protected:
+    struct Leaf;
+
+public:
+    /**
+     * An iterator over the items in key order.
+     */
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key, Value> *pointer;
+        typedef std::pair<const Key, Value> &reference;
+
+        iterator();
+
+        std::pair<const Key, Value> &operator*() const;
+        std::pair<const Key, Value> *operator->() const;
+
+        bool operator==(const iterator &rhs) const;
+        bool operator!=(const iterator &rhs) const;
+
+        iterator &operator++();
+        iterator operator++(int);
+        iterator &operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class BTree<Key, Value, Alloc, Compare>;
+        iterator(Leaf *leaf, std::size_t index, const BTree<Key, Value, Alloc, Compare> *tree);
+        Leaf *leaf_;
+        std::size_t index_;
+        // the tree, so that --end() can find the last leaf
+        const BTree<Key, Value, Alloc, Compare> *tree_;
+    };
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    iterator begin() const;
+    iterator end() const;
+    reverse_iterator rbegin() const;
+    reverse_iterator rend() const;
+    iterator find(const Key &key) const;
+    iterator lower_bound(const Key &key) const;
+    iterator upper_bound(const Key &key) const;
+    Value &operator[](const Key &key);
+    Value const &operator[](const Key &key) const;
+
+    // heterogeneous lookups, only there when Compare is transparent
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K &key) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K &key) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K &key) const;
+
+protected:
+    // every node is this big, give or take rounding to whole items
+    static const std::size_t NODE_BYTES = 256;
+    static const std::size_t CACHE_LINE = 64;
+    static const std::size_t HEADER_BYTES = 2 * sizeof(void *);
+    static const std::size_t LEAF_HEADER_BYTES = 3 * sizeof(void *);
+
+    // item slots per leaf and key slots per inner node, at least 4 so splits make sense
+    static const std::size_t LEAF_SLOTS =
+        (NODE_BYTES - LEAF_HEADER_BYTES) / sizeof(Item) < 4 ? 4 : (NODE_BYTES - LEAF_HEADER_BYTES) / sizeof(Item);
+    static const std::size_t INNER_SLOTS =
+        (NODE_BYTES - HEADER_BYTES) / (sizeof(Key) + sizeof(void *)) < 4 ? 4 : (NODE_BYTES - HEADER_BYTES) / (sizeof(Key) + sizeof(void *));
+    // fewest items or keys a node other than the root may hold
+    static const std::size_t MIN_LEAF = LEAF_SLOTS / 2;
+    static const std::size_t MIN_INNER = INNER_SLOTS / 2;
+    // a node other than the root has at least 3 children, and 3^48 > 2^64
+    static const int MAX_HEIGHT = 48;
+
+    struct NodeBase
+    {
+        std::size_t count; // items in a leaf, keys in an inner node
+    };
+
+    /**
+     * A leaf: up to LEAF_SLOTS items, sorted, and the leaves before and
+     * after it in order. Slots past count hold no object.
+     */
+    struct alignas(CACHE_LINE) Leaf : NodeBase
+    {
+        Leaf *prev;
+        Leaf *next;
+        typename std::aligned_storage<sizeof(Item), alignof(Item)>::type slots[LEAF_SLOTS];
+
+        Item *items() { return reinterpret_cast<Item *>(slots); }
+    };
+
+    /**
+     * An inner node: count sorted keys and count + 1 children. Every key in
+     * children[i] is less than keys[i], and every key in children[i + 1] is
+     * not. The children are leaves exactly at the bottom inner level.
+     */
+    struct alignas(CACHE_LINE) Inner : NodeBase
+    {
+        typename std::aligned_storage<sizeof(Key), alignof(Key)>::type slots[INNER_SLOTS];
+        NodeBase *children[INNER_SLOTS + 1];
+
+        Key *keys() { return reinterpret_cast<Key *>(slots); }
+    };
+
+    // an inner node on the way down, and which child was taken
+    struct PathEntry
+    {
+        Inner *node;
+        std::size_t index;
+    };
+
+    template <typename K>
+    Leaf *descend(const K &key, PathEntry *path) const; // leaf that would hold key
+    template <typename K>
+    iterator internalLowerBound(const K &key) const;
+    template <typename K>
+    iterator internalUpperBound(const K &key) const;
+    template <typename K>
+    iterator internalFind(const K &key) const;
+    template <typename K>
+    std::size_t leafLowerBound(Leaf *leaf, const K &key) const;
+    template <typename K>
+    std::size_t leafUpperBound(Leaf *leaf, const K &key) const;
+
+    void insertIntoParent(PathEntry *path, int level, const Key &key, NodeBase *right);
+    void fixLeafUnderflow(Leaf *leaf, PathEntry *path);
+    void fixInnerUnderflow(PathEntry *path, int level);
+    void eraseFromInner(Inner *node, std::size_t k); // drops keys[k] and children[k + 1]
+
+    Leaf *createLeaf();
+    Inner *createInner();
+    void destroyLeaf(Leaf *leaf);
+    void destroyInner(Inner *node);
+    void deleteSubtree(NodeBase *node, int level);
+    Leaf *lastLeaf() const;
+
+    // moves n objects from src to dst, which may overlap if dst < src
+    template <typename T>
+    static void relocate(T *dst, T *src, std::size_t n);
+    // moves a[from, n) up one slot, leaving a[from] empty
+    template <typename T>
+    static void shiftRight(T *a, std::size_t from, std::size_t n);
+
+    NodeBase *root_;
+    int height_; // levels, counting the leaves; 0 when empty
+    std::size_t size_;
+    Compare comp_;
+    Alloc leafAlloc_;
+    Alloc innerAlloc_;
+};
+
+/*
+--------------------------------------------------
+Begin implementations for the BTree::iterator class.
+--------------------------------------------------
+*/
+
+/**
+ * A default constructor that initializes the iterator to NULL.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+BTree<Key, Value, Alloc, Compare>::iterator::iterator() : leaf_(nullptr),
+                                                          index_(0),
+                                                          tree_(nullptr)
+{
+}
+
+/**
+ * Explicit constructor for the item at index in leaf, or the end of tree
+ * if leaf is null.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+BTree<Key, Value, Alloc, Compare>::iterator::iterator(Leaf *leaf, std::size_t index, const BTree<Key, Value, Alloc, Compare> *tree)
+    : leaf_(leaf),
+      index_(index),
+      tree_(tree)
+{
+}
+
+/**
+ * Provides access to the item.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+std::pair<const Key, Value> &BTree<Key, Value, Alloc, Compare>::iterator::operator*() const
+{
+    return leaf_->items()[index_];
+}
+
+/**
+ * Provides access to the address of the item.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+std::pair<const Key, Value> *BTree<Key, Value, Alloc, Compare>::iterator::operator->() const
+{
+    return &leaf_->items()[index_];
+}
+
+/**
+ * Checks if 'this' iterator points at the same item as 'rhs'.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+bool BTree<Key, Value, Alloc, Compare>::iterator::operator==(const iterator &rhs) const
+{
+    return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+/**
+ * Checks if 'this' iterator points at a different item than 'rhs'.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+bool BTree<Key, Value, Alloc, Compare>::iterator::operator!=(const iterator &rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+ * Advances to the next item, following the chain to the next leaf at the
+ * end of this one.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::iterator &BTree<Key, Value, Alloc, Compare>::iterator::operator++()
+{
+    if (leaf_ == nullptr)
+    {
+        return *this;
+    }
+    if (++index_ == leaf_->count)
+    {
+        leaf_ = leaf_->next;
+        index_ = 0;
+    }
+    return *this;
+}
+
+/**
+ * Advances the iterator, returning where it was.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::iterator::operator++(int)
+{
+    iterator before(*this);
+    ++(*this);
+    return before;
+}
+
+/**
+ * Moves back to the previous item, following the chain to the previous
+ * leaf at the start of this one. The end iterator moves to the largest
+ * item; begin() must not be decremented.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::iterator &BTree<Key, Value, Alloc, Compare>::iterator::operator--()
+{
+    if (leaf_ == nullptr)
+    {
+        leaf_ = (tree_ != nullptr) ? tree_->lastLeaf() : nullptr;
+        index_ = (leaf_ != nullptr) ? leaf_->count - 1 : 0;
+    }
+    else if (index_ == 0)
+    {
+        leaf_ = leaf_->prev;
+        index_ = (leaf_ != nullptr) ? leaf_->count - 1 : 0;
+    }
+    else
+    {
+        --index_;
+    }
+    return *this;
+}
+
+/**
+ * Moves the iterator back, returning where it was.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::iterator::operator--(int)
+{
+    iterator before(*this);
+    --(*this);
+    return before;
+}
+
+/*
+------------------------------------------------
+End implementations for the BTree::iterator class.
+------------------------------------------------
+*/
+
+/*
+-----------------------------------------
+Begin implementations for the BTree class.
+-----------------------------------------
+*/
+
+/**
+ * Default constructor for an empty tree.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+BTree<Key, Value, Alloc, Compare>::BTree() : root_(nullptr),
+                                             height_(0),
+                                             size_(0)
+{
+}
+
+/**
+ * Constructor for an empty tree ordered by the given comparator.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+BTree<Key, Value, Alloc, Compare>::BTree(const Compare &comp) : root_(nullptr),
+                                                                height_(0),
+                                                                size_(0),
+                                                                comp_(comp)
+{
+}
+
+/**
+ * Destructor, which frees every node.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+BTree<Key, Value, Alloc, Compare>::~BTree()
+{
+    clear();
+}
+
+/**
+ * Returns true if the tree is empty.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+bool BTree<Key, Value, Alloc, Compare>::empty() const
+{
+    return root_ == nullptr;
+}
+
+/**
+ * Returns the number of items, in O(1).
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+std::size_t BTree<Key, Value, Alloc, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+ * Returns a copy of the comparator that orders the keys.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+Compare BTree<Key, Value, Alloc, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+ * Returns an iterator to the smallest item.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::begin() const
+{
+    if (root_ == nullptr)
+    {
+        return end();
+    }
+    NodeBase *node = root_;
+    for (int level = 0; level < height_ - 1; ++level)
+    {
+        node = static_cast<Inner *>(node)->children[0];
+    }
+    return iterator(static_cast<Leaf *>(node), 0, this);
+}
+
+/**
+ * Returns an iterator whose value means INVALID.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::end() const
+{
+    return iterator(nullptr, 0, this);
+}
+
+/**
+ * Returns a reverse iterator to the largest item.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::reverse_iterator BTree<Key, Value, Alloc, Compare>::rbegin() const
+{
+    return reverse_iterator(end());
+}
+
+/**
+ * Returns the reverse iterator past the smallest item.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::reverse_iterator BTree<Key, Value, Alloc, Compare>::rend() const
+{
+    return reverse_iterator(begin());
+}
+
+/**
+ * Returns an iterator to the item with the given key, or the end iterator.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::find(const Key &key) const
+{
+    return internalFind(key);
+}
+
+/**
+ * Returns an iterator to the first item whose key is not less than key.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::lower_bound(const Key &key) const
+{
+    return internalLowerBound(key);
+}
+
+/**
+ * Returns an iterator to the first item whose key is greater than key.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::upper_bound(const Key &key) const
+{
+    return internalUpperBound(key);
+}
+
+/**
+ * find() for a key of another type. Only available when Compare is transparent.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K, typename C, typename>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::find(const K &key) const
+{
+    return internalFind(key);
+}
+
+/**
+ * lower_bound() for a key of another type, as for find() above.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K, typename C, typename>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::lower_bound(const K &key) const
+{
+    return internalLowerBound(key);
+}
+
+/**
+ * upper_bound() for a key of another type, as for find() above.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K, typename C, typename>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::upper_bound(const K &key) const
+{
+    return internalUpperBound(key);
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+Value &BTree<Key, Value, Alloc, Compare>::operator[](const Key &key)
+{
+    iterator it = internalFind(key);
+    if (it == end())
+        throw std::out_of_range("Invalid key");
+    return it->second;
+}
+template <typename Key, typename Value, typename Alloc, typename Compare>
+Value const &BTree<Key, Value, Alloc, Compare>::operator[](const Key &key) const
+{
+    iterator it = internalFind(key);
+    if (it == end())
+        throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+/**
+ * Inserts an item, or overwrites the value if the key is already present.
+ * A full leaf splits in two, which adds a key to its parent and may split
+ * it in turn, up to a new root.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::insert(const std::pair<const Key, Value> &keyValuePair)
+{
+    if (root_ == nullptr)
+    {
+        Leaf *leaf = createLeaf();
+        new (&leaf->items()[0]) Item(keyValuePair);
+        leaf->count = 1;
+        root_ = leaf;
+        height_ = 1;
+        size_ = 1;
+        return;
+    }
+
+    PathEntry path[MAX_HEIGHT];
+    Leaf *leaf = descend(keyValuePair.first, path);
+    Item *items = leaf->items();
+    std::size_t pos = leafLowerBound(leaf, keyValuePair.first);
+    if (pos < leaf->count && !comp_(keyValuePair.first, items[pos].first))
+    {
+        items[pos].second = keyValuePair.second;
+        return;
+    }
+    ++size_;
+
+    if (leaf->count < LEAF_SLOTS)
+    {
+        shiftRight(items, pos, leaf->count);
+        new (&items[pos]) Item(keyValuePair);
+        ++leaf->count;
+        return;
+    }
+
+    // split: the upper half moves to a new leaf, then the item goes in
+    // whichever half it belongs to
+    Leaf *right = createLeaf();
+    std::size_t mid = LEAF_SLOTS / 2;
+    relocate(right->items(), items + mid, LEAF_SLOTS - mid);
+    right->count = LEAF_SLOTS - mid;
+    leaf->count = mid;
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (right->next != nullptr)
+        right->next->prev = right;
+    leaf->next = right;
+
+    Leaf *target = (pos <= mid) ? leaf : right;
+    std::size_t at = (pos <= mid) ? pos : pos - mid;
+    shiftRight(target->items(), at, target->count);
+    new (&target->items()[at]) Item(keyValuePair);
+    ++target->count;
+
+    insertIntoParent(path, height_ - 2, right->items()[0].first, right);
+}
+
+/**
+ * Adds key and the new node right just after the child that split at
+ * path[level], splitting full inner nodes on the way up.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::insertIntoParent(PathEntry *path, int level, const Key &key, NodeBase *right)
+{
+    Key carry(key);
+    for (; level >= 0; --level)
+    {
+        Inner *node = path[level].node;
+        std::size_t i = path[level].index;
+
+        Inner *target = node;
+        Inner *sibling = nullptr;
+        if (node->count == INNER_SLOTS)
+        {
+            // split around the middle key, which moves up to the parent;
+            // then the new key goes in whichever half it belongs to
+            std::size_t mid = INNER_SLOTS / 2;
+            sibling = createInner();
+            relocate(sibling->keys(), node->keys() + mid + 1, INNER_SLOTS - mid - 1);
+            std::copy(node->children + mid + 1, node->children + INNER_SLOTS + 1, sibling->children);
+            sibling->count = INNER_SLOTS - mid - 1;
+            node->count = mid;
+            if (i > mid)
+            {
+                target = sibling;
+                i -= mid + 1;
+            }
+            Key up(std::move(node->keys()[mid]));
+            node->keys()[mid].~Key();
+
+            shiftRight(target->keys(), i, target->count);
+            new (&target->keys()[i]) Key(std::move(carry));
+            std::copy_backward(target->children + i + 1, target->children + target->count + 1, target->children + target->count + 2);
+            target->children[i + 1] = right;
+            ++target->count;
+
+            carry = std::move(up);
+            right = sibling;
+            continue;
+        }
+
+        shiftRight(target->keys(), i, target->count);
+        new (&target->keys()[i]) Key(std::move(carry));
+        std::copy_backward(target->children + i + 1, target->children + target->count + 1, target->children + target->count + 2);
+        target->children[i + 1] = right;
+        ++target->count;
+        return;
+    }
+
+    // the root split, so the tree grows a level
+    Inner *root = createInner();
+    new (&root->keys()[0]) Key(std::move(carry));
+    root->children[0] = root_;
+    root->children[1] = right;
+    root->count = 1;
+    root_ = root;
+    ++height_;
+}
+
+/**
+ * Removes a key if it is present. A leaf left with too few items borrows
+ * one from a sibling, or else merges with it, which removes a key from the
+ * parent and may leave it short in turn.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::remove(const Key &key)
+{
+    if (root_ == nullptr)
+    {
+        return;
+    }
+
+    PathEntry path[MAX_HEIGHT];
+    Leaf *leaf = descend(key, path);
+    Item *items = leaf->items();
+    std::size_t pos = leafLowerBound(leaf, key);
+    if (pos == leaf->count || comp_(key, items[pos].first))
+    {
+        return;
+    }
+
+    // separators above may now be smaller than any key in this leaf,
+    // which still routes searches correctly
+    items[pos].~Item();
+    relocate(items + pos, items + pos + 1, leaf->count - pos - 1);
+    --leaf->count;
+    --size_;
+
+    if (height_ == 1)
+    {
+        if (leaf->count == 0)
+        {
+            destroyLeaf(leaf);
+            root_ = nullptr;
+            height_ = 0;
+        }
+        return;
+    }
+    if (leaf->count < MIN_LEAF)
+    {
+        fixLeafUnderflow(leaf, path);
+    }
+}
+
+/**
+ * Tops up a leaf that has fallen below MIN_LEAF items, from a sibling with
+ * items to spare, or merges it with a sibling if neither has any.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::fixLeafUnderflow(Leaf *leaf, PathEntry *path)
+{
+    int level = height_ - 2;
+    Inner *parent = path[level].node;
+    std::size_t i = path[level].index;
+    Leaf *left = (i > 0) ? static_cast<Leaf *>(parent->children[i - 1]) : nullptr;
+    Leaf *right = (i < parent->count) ? static_cast<Leaf *>(parent->children[i + 1]) : nullptr;
+
+    if (left != nullptr && left->count > MIN_LEAF)
+    {
+        // borrow left's last item
+        shiftRight(leaf->items(), 0, leaf->count);
+        relocate(leaf->items(), left->items() + left->count - 1, 1);
+        --left->count;
+        ++leaf->count;
+        parent->keys()[i - 1] = leaf->items()[0].first;
+        return;
+    }
+    if (right != nullptr && right->count > MIN_LEAF)
+    {
+        // borrow right's first item
+        relocate(leaf->items() + leaf->count, right->items(), 1);
+        relocate(right->items(), right->items() + 1, right->count - 1);
+        --right->count;
+        ++leaf->count;
+        parent->keys()[i] = right->items()[0].first;
+        return;
+    }
+
+    // merge with a sibling; the two together fit in one leaf
+    if (left != nullptr)
+    {
+        relocate(left->items() + left->count, leaf->items(), leaf->count);
+        left->count += leaf->count;
+        left->next = leaf->next;
+        if (left->next != nullptr)
+            left->next->prev = left;
+        leaf->count = 0;
+        destroyLeaf(leaf);
+        eraseFromInner(parent, i - 1);
+    }
+    else
+    {
+        relocate(leaf->items() + leaf->count, right->items(), right->count);
+        leaf->count += right->count;
+        leaf->next = right->next;
+        if (leaf->next != nullptr)
+            leaf->next->prev = leaf;
+        right->count = 0;
+        destroyLeaf(right);
+        eraseFromInner(parent, i);
+    }
+    fixInnerUnderflow(path, level);
+}
+
+/**
+ * Tops up or merges the inner node at path[level] if it has fallen below
+ * MIN_INNER keys, working up the path. Keys move through the parent, since
+ * its separator is what sits between the two siblings.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::fixInnerUnderflow(PathEntry *path, int level)
+{
+    for (; level > 0; --level)
+    {
+        Inner *node = path[level].node;
+        if (node->count >= MIN_INNER)
+        {
+            return;
+        }
+        Inner *parent = path[level - 1].node;
+        std::size_t i = path[level - 1].index;
+        Inner *left = (i > 0) ? static_cast<Inner *>(parent->children[i - 1]) : nullptr;
+        Inner *right = (i < parent->count) ? static_cast<Inner *>(parent->children[i + 1]) : nullptr;
+
+        if (left != nullptr && left->count > MIN_INNER)
+        {
+            // rotate right: the separator comes down, left's last key goes up
+            shiftRight(node->keys(), 0, node->count);
+            new (&node->keys()[0]) Key(std::move(parent->keys()[i - 1]));
+            std::copy_backward(node->children, node->children + node->count + 1, node->children + node->count + 2);
+            node->children[0] = left->children[left->count];
+            parent->keys()[i - 1] = std::move(left->keys()[left->count - 1]);
+            left->keys()[left->count - 1].~Key();
+            --left->count;
+            ++node->count;
+            return;
+        }
+        if (right != nullptr && right->count > MIN_INNER)
+        {
+            // rotate left: the separator comes down, right's first key goes up
+            new (&node->keys()[node->count]) Key(std::move(parent->keys()[i]));
+            node->children[node->count + 1] = right->children[0];
+            parent->keys()[i] = std::move(right->keys()[0]);
+            right->keys()[0].~Key();
+            relocate(right->keys(), right->keys() + 1, right->count - 1);
+            std::copy(right->children + 1, right->children + right->count + 1, right->children);
+            --right->count;
+            ++node->count;
+            return;
+        }
+
+        // merge with a sibling around the separator between them
+        Inner *into = (left != nullptr) ? left : node;
+        Inner *from = (left != nullptr) ? node : right;
+        std::size_t sep = (left != nullptr) ? i - 1 : i;
+        new (&into->keys()[into->count]) Key(std::move(parent->keys()[sep]));
+        relocate(into->keys() + into->count + 1, from->keys(), from->count);
+        std::copy(from->children, from->children + from->count + 1, into->children + into->count + 1);
+        into->count += from->count + 1;
+        from->count = 0;
+        destroyInner(from);
+        eraseFromInner(parent, sep);
+    }
+
+    // the root may be down to a single child, which then takes its place
+    Inner *root = static_cast<Inner *>(root_);
+    if (root->count == 0)
+    {
+        root_ = root->children[0];
+        destroyInner(root);
+        --height_;
+    }
+}
+
+/**
+ * Removes keys[k] and children[k + 1] from an inner node.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::eraseFromInner(Inner *node, std::size_t k)
+{
+    node->keys()[k].~Key();
+    relocate(node->keys() + k, node->keys() + k + 1, node->count - k - 1);
+    std::copy(node->children + k + 2, node->children + node->count + 1, node->children + k + 1);
+    --node->count;
+}
+
+/**
+ * Removes every item.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::clear()
+{
+    // as in BinarySearchTree::clear, a pooled allocator frees everything
+    // at once, so only walk the tree if something has a destructor to run
+    if (!Alloc::bulkRelease ||
+        !std::is_trivially_destructible<Key>::value ||
+        !std::is_trivially_destructible<Value>::value)
+    {
+        if (root_ != nullptr)
+        {
+            deleteSubtree(root_, 0);
+        }
+    }
+    leafAlloc_.release();
+    innerAlloc_.release();
+    root_ = nullptr;
+    height_ = 0;
+    size_ = 0;
+}
+
+/**
+ * Frees the subtree under node, which is at the given level (the root is 0).
+ * Recurses once per level, so the stack stays as shallow as the tree.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::deleteSubtree(NodeBase *node, int level)
+{
+    if (level == height_ - 1)
+    {
+        destroyLeaf(static_cast<Leaf *>(node));
+        return;
+    }
+    Inner *inner = static_cast<Inner *>(node);
+    for (std::size_t i = 0; i <= inner->count; ++i)
+    {
+        deleteSubtree(inner->children[i], level + 1);
+    }
+    destroyInner(inner);
+}
+
+/**
+ * Returns the leaf holding the largest item, or null if the tree is empty.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::Leaf *BTree<Key, Value, Alloc, Compare>::lastLeaf() const
+{
+    if (root_ == nullptr)
+    {
+        return nullptr;
+    }
+    NodeBase *node = root_;
+    for (int level = 0; level < height_ - 1; ++level)
+    {
+        Inner *inner = static_cast<Inner *>(node);
+        node = inner->children[inner->count];
+    }
+    return static_cast<Leaf *>(node);
+}
+
+/**
+ * Walks from the root to the leaf where key is or would be, recording the
+ * inner nodes and the child taken from each in path.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+typename BTree<Key, Value, Alloc, Compare>::Leaf *BTree<Key, Value, Alloc, Compare>::descend(const K &key, PathEntry *path) const
+{
+    NodeBase *node = root_;
+    for (int level = 0; level < height_ - 1; ++level)
+    {
+        Inner *inner = static_cast<Inner *>(node);
+        // the child to take is the number of keys not greater than key
+        std::size_t i = KeySearch<Key, Compare>::countNotGreater(inner->keys(), inner->count, key, comp_);
+        if (path != nullptr)
+        {
+            path[level].node = inner;
+            path[level].index = i;
+        }
+        node = inner->children[i];
+    }
+    return static_cast<Leaf *>(node);
+}
+
+/**
+ * Returns the position of the first item in leaf whose key is not less than key.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+std::size_t BTree<Key, Value, Alloc, Compare>::leafLowerBound(Leaf *leaf, const K &key) const
+{
+    return KeySearch<Key, Compare>::countLessItems(leaf->items(), leaf->count, key, comp_);
+}
+
+/**
+ * Returns the position of the first item in leaf whose key is greater than key.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+std::size_t BTree<Key, Value, Alloc, Compare>::leafUpperBound(Leaf *leaf, const K &key) const
+{
+    return KeySearch<Key, Compare>::countNotGreaterItems(leaf->items(), leaf->count, key, comp_);
+}
+
+/**
+ * Helper for the lower_bound()s. The answer may be the first item of the
+ * next leaf, when key falls after every item of the one it leads to.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::internalLowerBound(const K &key) const
+{
+    if (root_ == nullptr)
+    {
+        return end();
+    }
+    Leaf *leaf = descend(key, nullptr);
+    std::size_t pos = leafLowerBound(leaf, key);
+    if (pos == leaf->count)
+    {
+        return iterator(leaf->next, 0, this);
+    }
+    return iterator(leaf, pos, this);
+}
+
+/**
+ * Helper for the upper_bound()s, as above.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::internalUpperBound(const K &key) const
+{
+    if (root_ == nullptr)
+    {
+        return end();
+    }
+    Leaf *leaf = descend(key, nullptr);
+    std::size_t pos = leafUpperBound(leaf, key);
+    if (pos == leaf->count)
+    {
+        return iterator(leaf->next, 0, this);
+    }
+    return iterator(leaf, pos, this);
+}
+
+/**
+ * Helper for the find()s.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename K>
+typename BTree<Key, Value, Alloc, Compare>::iterator BTree<Key, Value, Alloc, Compare>::internalFind(const K &key) const
+{
+    if (root_ == nullptr)
+    {
+        return end();
+    }
+    Leaf *leaf = descend(key, nullptr);
+    std::size_t pos = leafLowerBound(leaf, key);
+    if (pos == leaf->count || comp_(key, leaf->items()[pos].first))
+    {
+        return end();
+    }
+    return iterator(leaf, pos, this);
+}
+
+/**
+ * Allocates an empty leaf from leafAlloc_.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::Leaf *BTree<Key, Value, Alloc, Compare>::createLeaf()
+{
+    Leaf *leaf = new (leafAlloc_.allocate(sizeof(Leaf), alignof(Leaf))) Leaf;
+    leaf->count = 0;
+    leaf->prev = nullptr;
+    leaf->next = nullptr;
+    return leaf;
+}
+
+/**
+ * Allocates an empty inner node from innerAlloc_.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+typename BTree<Key, Value, Alloc, Compare>::Inner *BTree<Key, Value, Alloc, Compare>::createInner()
+{
+    Inner *node = new (innerAlloc_.allocate(sizeof(Inner), alignof(Inner))) Inner;
+    node->count = 0;
+    return node;
+}
+
+/**
+ * Destroys a leaf's items and hands it back to leafAlloc_.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::destroyLeaf(Leaf *leaf)
+{
+    for (std::size_t i = 0; i < leaf->count; ++i)
+    {
+        leaf->items()[i].~Item();
+    }
+    leaf->~Leaf();
+    leafAlloc_.deallocate(leaf);
+}
+
+/**
+ * Destroys an inner node's keys and hands it back to innerAlloc_.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+void BTree<Key, Value, Alloc, Compare>::destroyInner(Inner *node)
+{
+    for (std::size_t i = 0; i < node->count; ++i)
+    {
+        node->keys()[i].~Key();
+    }
+    node->~Inner();
+    innerAlloc_.deallocate(node);
+}
+
+/**
+ * Moves n objects from src to dst, destroying each original. Goes front to
+ * back, so the ranges may overlap as long as dst comes first.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename T>
+void BTree<Key, Value, Alloc, Compare>::relocate(T *dst, T *src, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        new (&dst[i]) T(std::move(src[i]));
+        src[i].~T();
+    }
+}
+
+/**
+ * Moves a[from, n) up one slot, back to front, so a[from] is left empty
+ * for a new object.
+ */
+template <typename Key, typename Value, typename Alloc, typename Compare>
+template <typename T>
+void BTree<Key, Value, Alloc, Compare>::shiftRight(T *a, std::size_t from, std::size_t n)
+{
+    for (std::size_t i = n; i > from; --i)
+    {
+        new (&a[i]) T(std::move(a[i - 1]));
+        a[i - 1].~T();
+    }
+}
+
+/*
+---------------------------------------
+End implementations for the BTree class.
+---------------------------------------
+*/
+
+#endif
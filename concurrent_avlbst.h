@@ -0,0 +1,376 @@
+#ifndef CONCURRENT_AVLBST_H
+#define CONCURRENT_AVLBST_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <stdexcept>
+#include <type_traits>
+#include "avlbst.h"
+
+namespace concurrent_detail
+{
+    /**
+     * A trivially copyable T kept as an array of std::atomic words, read
+     * and written whole with relaxed loads and stores. That is what makes
+     * a seqlock well defined: a reader racing with a writer may load a mix
+     * of old and new words, and throws the mix away when the version check
+     * fails, but no access is ever a data race. Relaxed word loads and
+     * stores compile to the same plain moves as copying a T.
+     */
+    template <typename T>
+    class Cell
+    {
+    public:
+        Cell() { store(T()); }
+        Cell(const T &value) { store(value); }
+        Cell(const Cell &other) { store(other.load()); }
+        Cell &operator=(const Cell &other)
+        {
+            store(other.load());
+            return *this;
+        }
+
+        T load() const
+        {
+            Word words[WORDS];
+            for (std::size_t i = 0; i < WORDS; ++i)
+            {
+                words[i] = words_[i].load(std::memory_order_relaxed);
+            }
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type bytes;
+            std::memcpy(&bytes, words, sizeof(T));
+            return *reinterpret_cast<const T *>(&bytes);
+        }
+
+        // stores rather than initializers, as in Node, since a reader may
+        // still be loading a freed cell when its slot is reused
+        void store(const T &value)
+        {
+            Word words[WORDS];
+            std::memcpy(words, &value, sizeof(T));
+            for (std::size_t i = 0; i < WORDS; ++i)
+            {
+                words_[i].store(words[i], std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        // the widest word that tiles T exactly
+        typedef typename std::conditional<
+            sizeof(T) % sizeof(std::uint64_t) == 0 && alignof(T) >= alignof(std::uint64_t), std::uint64_t,
+            typename std::conditional<
+                sizeof(T) % sizeof(std::uint32_t) == 0 && alignof(T) >= alignof(std::uint32_t), std::uint32_t,
+                typename std::conditional<sizeof(T) % sizeof(std::uint16_t) == 0 && alignof(T) >= alignof(std::uint16_t),
+                                          std::uint16_t, unsigned char>::type>::type>::type Word;
+        static const std::size_t WORDS = sizeof(T) / sizeof(Word);
+
+        std::atomic<Word> words_[WORDS];
+    };
+
+    // for print(), which shows keys and orders them in a std::map
+    template <typename T>
+    std::ostream &operator<<(std::ostream &out, const Cell<T> &cell)
+    {
+        return out << cell.load();
+    }
+    template <typename T>
+    bool operator<(const Cell<T> &a, const Cell<T> &b)
+    {
+        return a.load() < b.load();
+    }
+
+    /**
+     * Orders Cells by the Compare of the values in them.
+     */
+    template <typename T, typename Compare>
+    struct CellCompare
+    {
+        CellCompare() {}
+        explicit CellCompare(const Compare &comp) : comp(comp) {}
+        bool operator()(const Cell<T> &a, const Cell<T> &b) const { return comp(a.load(), b.load()); }
+
+        Compare comp;
+    };
+}
+
+/**
+ * An AVLTree for one writer at a time and any number of readers: a
+ * seqlock around the ordinary tree, not a tree with fine-grained locks.
+ *
+ * Writers are fully serialized by a single tree-wide mutex; they do not
+ * lock just the paths they rebalance. A writer makes the version number
+ * odd, runs the ordinary AVLTree insert/remove (rotations and all), and
+ * makes it even again, even if the insert throws. Writes therefore do not
+ * scale with threads; for writers that do, see ShardedAVLTree, which
+ * gives every key range a tree and a lock of its own.
+ *
+ * Readers are optimistic: they note an even version number, search the tree
+ * without taking any lock, and then check that the version has not moved.
+ * If a writer got in the way they simply search again. A reader never writes
+ * to shared memory, so lookups scale with the number of reader threads and
+ * writers never wait for them.
+ *
+ * The node links a reader follows (see Node) and the root it starts from
+ * are std::atomic, read with relaxed loads. Nodes come from a
+ * RetainingNodePool, so a node freed by a writer stays readable memory
+ * until the tree itself is destroyed, and a reader racing with it sees
+ * stale links rather than a crash. Keys and values are kept in Cells of
+ * atomic words, so a reader copying them while a writer changes or
+ * reuses the node gets a torn copy rather than a data race. As in any
+ * seqlock, what the reader saw is thrown away unless the version check
+ * passes. Key and Value must be trivially copyable, so that they can be
+ * copied word by word.
+ */
+template <class Key, class Value, class Compare = std::less<Key> >
+class ConcurrentAVLTree : protected AVLTree<concurrent_detail::Cell<Key>, concurrent_detail::Cell<Value>, RetainingNodePool, false,
+                                            concurrent_detail::CellCompare<Key, Compare> >
+{
+public:
+    ConcurrentAVLTree();
+    ~ConcurrentAVLTree();
+
+    // writers: one at a time, never block readers
+    void insert(const std::pair<const Key, Value> &new_item);
+    void remove(const Key &key);
+    void clear();
+
+    // readers: lock-free, results are copies
+    bool find(const Key &key, Value &value) const;
+    bool contains(const Key &key) const;
+    Value operator[](const Key &key) const;
+
+protected:
+    typedef concurrent_detail::Cell<Key> KeyCell;
+    typedef concurrent_detail::Cell<Value> ValueCell;
+    typedef AVLTree<KeyCell, ValueCell, RetainingNodePool, false, concurrent_detail::CellCompare<Key, Compare> > Base;
+
+    /**
+     * Holds the writer lock and an odd version for a scope, so the version
+     * is even again and the root published on every way out, throws
+     * included.
+     */
+    class WriteGuard
+    {
+    public:
+        explicit WriteGuard(ConcurrentAVLTree &tree);
+        ~WriteGuard();
+
+    private:
+        ConcurrentAVLTree &tree_;
+        std::lock_guard<std::mutex> lock_;
+        WriteGuard(const WriteGuard &);
+        WriteGuard &operator=(const WriteGuard &);
+    };
+
+    bool tryFind(const Key &key, Value &value) const; // one unvalidated attempt
+    void beginWrite();
+    void endWrite(); // also publishes the new root to readers
+
+    // an AVL tree of 2^64 nodes is under 93 levels tall, so a longer walk
+    // can only mean the reader wandered into nodes a writer was changing
+    static const int MAX_SEARCH_STEPS = 128;
+    // optimistic attempts before a reader gives up and takes the lock
+    static const int MAX_OPTIMISTIC_TRIES = 64;
+
+    // version_ gets a cache line to itself, since every reader polls it
+    alignas(64) std::atomic<unsigned long> version_;
+    std::atomic<const Node<KeyCell, ValueCell> *> readRoot_; // root_, as readers may load it
+    alignas(64) mutable std::mutex writeLock_;
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the ConcurrentAVLTree class.
+  -----------------------------------------------
+*/
+
+/**
+ * Default constructor for an empty tree.
+ */
+template <class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::ConcurrentAVLTree() : version_(0), readRoot_(nullptr)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "ConcurrentAVLTree needs trivially copyable keys and values");
+}
+
+/**
+ * Destructor. No other thread may be using the tree by now.
+ */
+template <class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::~ConcurrentAVLTree()
+{
+}
+
+/**
+ * Inserts or overwrites an item, while concurrent readers retry around it.
+ */
+template <class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value> &new_item)
+{
+    WriteGuard guard(*this);
+    Base::insert(std::pair<const KeyCell, ValueCell>(new_item.first, new_item.second));
+}
+
+/**
+ * Removes a key if it is present. The node goes back on the pool's free
+ * list, where a reader that still holds a pointer to it can read it safely.
+ */
+template <class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::remove(const Key &key)
+{
+    WriteGuard guard(*this);
+    Base::remove(KeyCell(key));
+}
+
+/**
+ * Removes every item. The memory is kept for reuse (see RetainingNodePool).
+ */
+template <class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::clear()
+{
+    WriteGuard guard(*this);
+    Base::clear();
+}
+
+/**
+ * Looks up key, copying its value out if it is present. Runs in parallel
+ * with other readers and with writers; only falls back to the writer lock
+ * if writers keep changing the tree under it.
+ */
+template <class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::find(const Key &key, Value &value) const
+{
+    for (int attempt = 0; attempt < MAX_OPTIMISTIC_TRIES; ++attempt)
+    {
+        unsigned long before = version_.load(std::memory_order_acquire);
+        if (before & 1)
+        {
+            // a writer is mid-update, no point looking yet
+            std::this_thread::yield();
+            continue;
+        }
+
+        Value candidate;
+        bool found = tryFind(key, candidate);
+
+        // order the tree reads above before re-reading the version
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version_.load(std::memory_order_relaxed) == before)
+        {
+            if (found)
+                value = candidate;
+            return found;
+        }
+    }
+
+    // writers are too busy for us, so get in line with them
+    std::lock_guard<std::mutex> guard(writeLock_);
+    return tryFind(key, value);
+}
+
+/**
+ * Returns true if key is in the tree.
+ */
+template <class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::contains(const Key &key) const
+{
+    Value unused;
+    return find(key, unused);
+}
+
+/**
+ * Returns a copy of the value for key. A reference would not be safe to
+ * use once a writer moves on, so unlike BinarySearchTree this returns by value.
+ */
+template <class Key, class Value, class Compare>
+Value ConcurrentAVLTree<Key, Value, Compare>::operator[](const Key &key) const
+{
+    Value value;
+    if (!find(key, value))
+        throw std::out_of_range("Invalid key");
+    return value;
+}
+
+/**
+ * Walks down from the root once, without validating anything. The answer is
+ * only meaningful if the version did not change while it ran. Like
+ * BinarySearchTree::internalFind, it makes one comparison per level.
+ */
+template <class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::tryFind(const Key &key, Value &value) const
+{
+    const Compare &comp = this->comp_.comp;
+    const Node<KeyCell, ValueCell> *current = readRoot_.load(std::memory_order_relaxed);
+    const Node<KeyCell, ValueCell> *candidate = nullptr;
+    for (int steps = 0; current != nullptr && steps < MAX_SEARCH_STEPS; ++steps)
+    {
+        if (comp(current->getKey().load(), key))
+        {
+            current = current->getRight();
+        }
+        else
+        {
+            candidate = current;
+            current = current->getLeft();
+        }
+    }
+    if (current != nullptr || candidate == nullptr || comp(key, candidate->getKey().load()))
+    {
+        return false;
+    }
+    value = candidate->getValue().load();
+    return true;
+}
+
+/**
+ * Takes the writer lock and starts a write.
+ */
+template <class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::WriteGuard::WriteGuard(ConcurrentAVLTree &tree) : tree_(tree),
+                                                                                         lock_(tree.writeLock_)
+{
+    tree_.beginWrite();
+}
+
+/**
+ * Ends the write, whether it finished or threw, then drops the lock.
+ */
+template <class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::WriteGuard::~WriteGuard()
+{
+    tree_.endWrite();
+}
+
+/**
+ * Makes the version odd, so readers that start now wait and readers already
+ * searching will see a different version when they finish.
+ */
+template <class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::beginWrite()
+{
+    version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+/**
+ * Makes the version even again, publishing the writer's changes.
+ */
+template <class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::endWrite()
+{
+    readRoot_.store(this->root_, std::memory_order_relaxed);
+    version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the ConcurrentAVLTree class.
+  -----------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,683 @@
+#ifndef FROZEN_BST_H
+#define FROZEN_BST_H
+
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FROZEN_BST_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace frozen_detail
+{
+    /**
+     * The start of a file written by FrozenTree::save(). The rest of the
+     * file is the tree's three arrays, each at the offset given here from
+     * the start of the file, so the file means the same wherever it is
+     * mapped. The sizes and byte order recorded are checked on load, since
+     * the arrays are the in-memory representation of the writing build.
+     */
+    struct FileHeader
+    {
+        char magic[8];              // "FROZENT" and a format version
+        std::uint32_t byteOrder;    // ENDIAN_MARK as the writer stored it
+        std::uint32_t itemBytes;    // sizeof(std::pair<const Key, Value>)
+        std::uint32_t keyBytes;     // sizeof(Key)
+        std::uint32_t indexBytes;   // sizeof(std::size_t)
+        std::uint64_t count;        // number of items
+        std::uint64_t itemsOffset;  // count items, sorted
+        std::uint64_t keysOffset;   // count + 1 keys, Eytzinger order
+        std::uint64_t positionsOffset; // count + 1 sorted positions
+        std::uint64_t fileBytes;
+    };
+
+    static const char MAGIC[8] = {'F', 'R', 'O', 'Z', 'E', 'N', 'T', '1'};
+    static const std::uint32_t ENDIAN_MARK = 0x01020304;
+    // every array starts on a cache line of the file
+    static const std::uint64_t SECTION_ALIGN = 64;
+
+    inline std::uint64_t alignUp(std::uint64_t offset)
+    {
+        return (offset + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN;
+    }
+
+    // true if count elements of size bytes starting at offset lie within
+    // bytes; offsets come from the file, so nothing here may overflow
+    inline bool sectionFits(std::uint64_t offset, std::uint64_t count, std::uint64_t size, std::uint64_t bytes)
+    {
+        return offset <= bytes && count <= (bytes - offset) / size;
+    }
+
+    /**
+     * Keeps a tree's arrays alive. Frozen trees never change, so copies of
+     * one share a single Storage.
+     */
+    struct Storage
+    {
+        virtual ~Storage() {}
+    };
+
+    // arrays built in memory
+    template <typename Key, typename Value>
+    struct OwnedStorage : Storage
+    {
+        std::vector<std::pair<const Key, Value> > items;
+        std::vector<Key> keys;
+        std::vector<std::size_t> positions;
+    };
+
+    // a whole file, mapped read-only (or read into memory without mmap)
+    struct FileStorage : Storage
+    {
+        FileStorage() : data(NULL), bytes(0) {}
+        ~FileStorage()
+        {
+#ifdef FROZEN_BST_MMAP
+            if (data != NULL)
+                munmap(const_cast<char *>(data), bytes);
+#else
+            ::operator delete(const_cast<char *>(data));
+#endif
+        }
+        const char *data;
+        std::size_t bytes;
+
+    private:
+        FileStorage(const FileStorage &);
+        FileStorage &operator=(const FileStorage &);
+    };
+}
+
+/**
+ * An immutable, read-only copy of a search tree, laid out for fast lookups.
+ *
+ * The items are kept in one sorted array, which is what iteration walks.
+ * For searching, the keys are copied into a second array in Eytzinger
+ * (breadth-first) order: the root is at index 1 and the children of index k
+ * are at 2k and 2k + 1, so the top levels of the tree share a few cache
+ * lines and no pointers are chased at all. The search loop is branch-free
+ * (the comparison result becomes part of the next index) and prefetches the
+ * keys a few levels below the current one while it works.
+ *
+ * Build one with BinarySearchTree::freeze(), or from a sorted range of
+ * items with unique keys.
+ *
+ * Both arrays index each other by position, never by pointer, so save()
+ * can write them to a file as they are and mapFile() can serve lookups
+ * and iteration straight out of a read-only mapping of it: loading costs
+ * one sequential pass over the positions (to check they are in range)
+ * plus the page faults of the keys and items actually touched, with no
+ * parsing and no allocation. This needs trivially copyable keys and values, and
+ * the file is only readable by builds with the same type sizes and byte
+ * order, which mapFile() checks.
+ */
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class FrozenTree
+{
+public:
+    FrozenTree();
+    template <typename InputIt>
+    FrozenTree(InputIt first, InputIt last, const Compare &comp = Compare());
+
+    void save(const std::string &path) const;
+    static FrozenTree mapFile(const std::string &path, const Compare &comp = Compare());
+
+    /**
+     * An iterator over the items in key order.
+     */
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::pair<const Key, Value> *pointer;
+        typedef const std::pair<const Key, Value> &reference;
+
+        iterator();
+
+        const std::pair<const Key, Value> &operator*() const;
+        const std::pair<const Key, Value> *operator->() const;
+
+        bool operator==(const iterator &rhs) const;
+        bool operator!=(const iterator &rhs) const;
+
+        iterator &operator++();
+        iterator operator++(int);
+        iterator &operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class FrozenTree<Key, Value, Compare>;
+        iterator(const std::pair<const Key, Value> *ptr);
+        const std::pair<const Key, Value> *current_;
+    };
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    iterator begin() const;
+    iterator end() const;
+    reverse_iterator rbegin() const;
+    reverse_iterator rend() const;
+    iterator find(const Key &key) const;
+    iterator lower_bound(const Key &key) const;
+    const Value &operator[](const Key &key) const;
+    std::size_t size() const;
+    bool empty() const;
+
+    // heterogeneous lookups, only there when Compare is transparent
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K &key) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K &key) const;
+
+protected:
+    template <typename K>
+    std::size_t lowerBoundIndex(const K &key) const; // sorted position of the first key >= key
+    template <typename K>
+    std::size_t findIndex(const K &key) const; // sorted position of key, or size()
+    static void layout(frozen_detail::OwnedStorage<Key, Value> &storage, std::size_t k, std::size_t &next); // helper for the constructor
+
+    // bytes fetched ahead of the search, covering the subtrees a few levels down
+    static const std::size_t PREFETCH_BYTES = 64;
+
+    typedef std::pair<const Key, Value> Item;
+
+    // the arrays, in memory or in a mapped file
+    std::shared_ptr<const frozen_detail::Storage> storage_;
+    const Item *items_;               // sorted by key
+    const Key *keys_;                 // Eytzinger order, from index 1
+    const std::size_t *positions_;    // keys_[k] is items_[positions_[k]]
+    std::size_t size_;
+    Compare comp_;
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the FrozenTree::iterator class.
+  -----------------------------------------------
+*/
+
+/**
+ * A default constructor that initializes the iterator to NULL.
+ */
+template <typename Key, typename Value, typename Compare>
+FrozenTree<Key, Value, Compare>::iterator::iterator() : current_(NULL)
+{
+}
+
+/**
+ * Explicit constructor that points the iterator at an item.
+ */
+template <typename Key, typename Value, typename Compare>
+FrozenTree<Key, Value, Compare>::iterator::iterator(const std::pair<const Key, Value> *ptr) : current_(ptr)
+{
+}
+
+/**
+ * Provides access to the item.
+ */
+template <typename Key, typename Value, typename Compare>
+const std::pair<const Key, Value> &FrozenTree<Key, Value, Compare>::iterator::operator*() const
+{
+    return *current_;
+}
+
+/**
+ * Provides access to the address of the item.
+ */
+template <typename Key, typename Value, typename Compare>
+const std::pair<const Key, Value> *FrozenTree<Key, Value, Compare>::iterator::operator->() const
+{
+    return current_;
+}
+
+/**
+ * Checks if 'this' iterator points at the same item as 'rhs'.
+ */
+template <typename Key, typename Value, typename Compare>
+bool FrozenTree<Key, Value, Compare>::iterator::operator==(const iterator &rhs) const
+{
+    return current_ == rhs.current_;
+}
+
+/**
+ * Checks if 'this' iterator points at a different item than 'rhs'.
+ */
+template <typename Key, typename Value, typename Compare>
+bool FrozenTree<Key, Value, Compare>::iterator::operator!=(const iterator &rhs) const
+{
+    return current_ != rhs.current_;
+}
+
+/**
+ * Advances to the next item. The items are stored in order, so this is one increment.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::iterator &FrozenTree<Key, Value, Compare>::iterator::operator++()
+{
+    ++current_;
+    return *this;
+}
+
+/**
+ * Advances the iterator, returning where it was.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::iterator::operator++(int)
+{
+    iterator before(*this);
+    ++current_;
+    return before;
+}
+
+/**
+ * Moves back to the previous item; end() moves to the largest.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::iterator &FrozenTree<Key, Value, Compare>::iterator::operator--()
+{
+    --current_;
+    return *this;
+}
+
+/**
+ * Moves the iterator back, returning where it was.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::iterator::operator--(int)
+{
+    iterator before(*this);
+    --current_;
+    return before;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the FrozenTree::iterator class.
+  -----------------------------------------------
+*/
+
+/*
+  -----------------------------------------------
+  Begin implementations for the FrozenTree class.
+  -----------------------------------------------
+*/
+
+/**
+ * Default constructor for an empty tree.
+ */
+template <typename Key, typename Value, typename Compare>
+FrozenTree<Key, Value, Compare>::FrozenTree() : items_(NULL), keys_(NULL), positions_(NULL), size_(0)
+{
+}
+
+/**
+ * Copies the items in [first, last), which must be sorted by comp with no
+ * duplicate keys, and lays out the search array. O(n).
+ */
+template <typename Key, typename Value, typename Compare>
+template <typename InputIt>
+FrozenTree<Key, Value, Compare>::FrozenTree(InputIt first, InputIt last, const Compare &comp)
+    : items_(NULL), keys_(NULL), positions_(NULL), size_(0), comp_(comp)
+{
+    std::shared_ptr<frozen_detail::OwnedStorage<Key, Value> > storage =
+        std::make_shared<frozen_detail::OwnedStorage<Key, Value> >();
+    for (; first != last; ++first)
+    {
+        storage->items.push_back(*first);
+    }
+
+    if (storage->items.empty())
+        return;
+
+    // slot 0 is never searched; it keeps the index arithmetic 1-based
+    storage->keys.assign(storage->items.size() + 1, storage->items[0].first);
+    storage->positions.assign(storage->items.size() + 1, 0);
+    std::size_t next = 0;
+    layout(*storage, 1, next);
+
+    items_ = storage->items.data();
+    keys_ = storage->keys.data();
+    positions_ = storage->positions.data();
+    size_ = storage->items.size();
+    storage_ = storage;
+}
+
+/**
+ * Fills the subtree of the search array rooted at index k, taking items in
+ * order starting at items[next]: an in-order walk of the implicit tree.
+ * The recursion is only as deep as the tree, about log2(n) levels.
+ */
+template <typename Key, typename Value, typename Compare>
+void FrozenTree<Key, Value, Compare>::layout(frozen_detail::OwnedStorage<Key, Value> &storage, std::size_t k, std::size_t &next)
+{
+    if (k >= storage.keys.size())
+        return;
+    layout(storage, 2 * k, next);
+    storage.keys[k] = storage.items[next].first;
+    storage.positions[k] = next;
+    ++next;
+    layout(storage, 2 * k + 1, next);
+}
+
+/**
+ * Writes the tree to the file at path, replacing it, in the format that
+ * mapFile() reads back (see frozen_detail::FileHeader). O(n).
+ * Throws std::runtime_error if the file can't be written.
+ */
+template <typename Key, typename Value, typename Compare>
+void FrozenTree<Key, Value, Compare>::save(const std::string &path) const
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "only trees of trivially copyable keys and values can be saved");
+    // the items are written and read as they are, pair and all
+    static_assert(std::is_trivially_copyable<Item>::value,
+                  "std::pair<const Key, Value> must be trivially copyable too");
+
+    frozen_detail::FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, frozen_detail::MAGIC, sizeof(header.magic));
+    header.byteOrder = frozen_detail::ENDIAN_MARK;
+    header.itemBytes = sizeof(Item);
+    header.keyBytes = sizeof(Key);
+    header.indexBytes = sizeof(std::size_t);
+    header.count = size_;
+    std::uint64_t slots = (size_ == 0) ? 0 : size_ + 1;
+    header.itemsOffset = frozen_detail::alignUp(sizeof(header));
+    header.keysOffset = frozen_detail::alignUp(header.itemsOffset + size_ * sizeof(Item));
+    header.positionsOffset = frozen_detail::alignUp(header.keysOffset + slots * sizeof(Key));
+    header.fileBytes = header.positionsOffset + slots * sizeof(std::size_t);
+
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    const char padding[frozen_detail::SECTION_ALIGN] = {0};
+    std::uint64_t written = 0;
+    // each section is padded out to its offset, then written as it is in memory
+    const void *sections[] = {&header, items_, keys_, positions_};
+    std::uint64_t offsets[] = {0, header.itemsOffset, header.keysOffset, header.positionsOffset};
+    std::uint64_t lengths[] = {sizeof(header), size_ * sizeof(Item), slots * sizeof(Key), slots * sizeof(std::size_t)};
+    for (int i = 0; i < 4 && out; ++i)
+    {
+        out.write(padding, static_cast<std::streamsize>(offsets[i] - written));
+        if (lengths[i] != 0)
+            out.write(static_cast<const char *>(sections[i]), static_cast<std::streamsize>(lengths[i]));
+        written = offsets[i] + lengths[i];
+    }
+    out.close();
+    if (!out)
+        throw std::runtime_error("FrozenTree::save: can't write " + path);
+}
+
+/**
+ * Returns a tree that serves lookups and iteration directly from the file
+ * at path, as written by save(), mapped read-only into memory: nothing is
+ * parsed or copied, and apart from the positions, which are checked once,
+ * pages are only read in as searches touch them.
+ * The mapping lasts as long as the tree or any copy of it. The file must
+ * not be changed while mapped. Off POSIX systems the file is read into
+ * memory instead.
+ *
+ * Throws std::runtime_error if the file can't be read, wasn't written
+ * by save() for these key and value types on a compatible build, or has
+ * a position past the last item.
+ */
+template <typename Key, typename Value, typename Compare>
+FrozenTree<Key, Value, Compare> FrozenTree<Key, Value, Compare>::mapFile(const std::string &path, const Compare &comp)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "only trees of trivially copyable keys and values can be mapped");
+    // the items are written and read as they are, pair and all
+    static_assert(std::is_trivially_copyable<Item>::value,
+                  "std::pair<const Key, Value> must be trivially copyable too");
+
+    std::shared_ptr<frozen_detail::FileStorage> storage = std::make_shared<frozen_detail::FileStorage>();
+#ifdef FROZEN_BST_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("FrozenTree::mapFile: can't open " + path);
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(frozen_detail::FileHeader)))
+    {
+        ::close(fd);
+        throw std::runtime_error("FrozenTree::mapFile: " + path + " is not a FrozenTree file");
+    }
+    storage->bytes = static_cast<std::size_t>(info.st_size);
+    void *data = ::mmap(NULL, storage->bytes, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping keeps the file open
+    if (data == MAP_FAILED)
+        throw std::runtime_error("FrozenTree::mapFile: can't map " + path);
+    storage->data = static_cast<const char *>(data);
+#else
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!in)
+        throw std::runtime_error("FrozenTree::mapFile: can't open " + path);
+    storage->bytes = static_cast<std::size_t>(in.tellg());
+    char *data = static_cast<char *>(::operator new(storage->bytes));
+    storage->data = data;
+    in.seekg(0);
+    if (!in.read(data, static_cast<std::streamsize>(storage->bytes)) || storage->bytes < sizeof(frozen_detail::FileHeader))
+        throw std::runtime_error("FrozenTree::mapFile: can't read " + path);
+#endif
+
+    frozen_detail::FileHeader header;
+    std::memcpy(&header, storage->data, sizeof(header));
+    std::uint64_t slots = (header.count == 0) ? 0 : header.count + 1;
+    bool valid = std::memcmp(header.magic, frozen_detail::MAGIC, sizeof(header.magic)) == 0 &&
+                 header.byteOrder == frozen_detail::ENDIAN_MARK &&
+                 header.itemBytes == sizeof(Item) && header.keyBytes == sizeof(Key) &&
+                 header.indexBytes == sizeof(std::size_t) &&
+                 header.fileBytes == storage->bytes &&
+                 header.count <= storage->bytes / sizeof(Item) &&
+                 header.itemsOffset % frozen_detail::SECTION_ALIGN == 0 &&
+                 header.keysOffset % frozen_detail::SECTION_ALIGN == 0 &&
+                 header.positionsOffset % frozen_detail::SECTION_ALIGN == 0 &&
+                 frozen_detail::sectionFits(header.itemsOffset, header.count, sizeof(Item), storage->bytes) &&
+                 frozen_detail::sectionFits(header.keysOffset, slots, sizeof(Key), storage->bytes) &&
+                 frozen_detail::sectionFits(header.positionsOffset, slots, sizeof(std::size_t), storage->bytes);
+    if (!valid)
+        throw std::runtime_error("FrozenTree::mapFile: " + path + " is not a FrozenTree file for these types");
+
+    // a search returns positions as they are, so a bad one would index
+    // past the items; check them all, in one sequential pass
+    const std::size_t *positions = reinterpret_cast<const std::size_t *>(storage->data + header.positionsOffset);
+    for (std::uint64_t k = 1; k < slots; ++k)
+    {
+        if (positions[k] >= header.count)
+            throw std::runtime_error("FrozenTree::mapFile: " + path + " is corrupt");
+    }
+
+    FrozenTree tree;
+    tree.comp_ = comp;
+    tree.size_ = static_cast<std::size_t>(header.count);
+    if (tree.size_ != 0)
+    {
+        tree.items_ = reinterpret_cast<const Item *>(storage->data + header.itemsOffset);
+        tree.keys_ = reinterpret_cast<const Key *>(storage->data + header.keysOffset);
+        tree.positions_ = reinterpret_cast<const std::size_t *>(storage->data + header.positionsOffset);
+    }
+    tree.storage_ = storage;
+    return tree;
+}
+
+/**
+ * Returns an iterator to the smallest item.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::begin() const
+{
+    return iterator(items_);
+}
+
+/**
+ * Returns an iterator just past the largest item.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::end() const
+{
+    return iterator(items_ + size_);
+}
+
+/**
+ * Returns a reverse iterator to the largest item.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::reverse_iterator FrozenTree<Key, Value, Compare>::rbegin() const
+{
+    return reverse_iterator(end());
+}
+
+/**
+ * Returns a reverse iterator just before the smallest item.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::reverse_iterator FrozenTree<Key, Value, Compare>::rend() const
+{
+    return reverse_iterator(begin());
+}
+
+/**
+ * Returns an iterator to the item with the given key, or the end iterator.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::find(const Key &key) const
+{
+    return iterator(items_ + findIndex(key));
+}
+
+/**
+ * Returns an iterator to the first item whose key is not less than key.
+ */
+template <typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::lower_bound(const Key &key) const
+{
+    return iterator(items_ + lowerBoundIndex(key));
+}
+
+/**
+ * find() for a key of another type. Only available when Compare is transparent.
+ */
+template <typename Key, typename Value, typename Compare>
+template <typename K, typename C, typename>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::find(const K &key) const
+{
+    return iterator(items_ + findIndex(key));
+}
+
+/**
+ * lower_bound() for a key of another type, as for find() above.
+ */
+template <typename Key, typename Value, typename Compare>
+template <typename K, typename C, typename>
+typename FrozenTree<Key, Value, Compare>::iterator FrozenTree<Key, Value, Compare>::lower_bound(const K &key) const
+{
+    return iterator(items_ + lowerBoundIndex(key));
+}
+
+/**
+ * @precondition The key exists in the tree
+ * Returns the value associated with the key
+ */
+template <typename Key, typename Value, typename Compare>
+const Value &FrozenTree<Key, Value, Compare>::operator[](const Key &key) const
+{
+    std::size_t i = findIndex(key);
+    if (i == size_)
+        throw std::out_of_range("Invalid key");
+    return items_[i].second;
+}
+
+/**
+ * Returns the number of items.
+ */
+template <typename Key, typename Value, typename Compare>
+std::size_t FrozenTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+ * Returns true if there are no items.
+ */
+template <typename Key, typename Value, typename Compare>
+bool FrozenTree<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+/**
+ * Returns the sorted position of the item with key, or size() if none.
+ */
+template <typename Key, typename Value, typename Compare>
+template <typename K>
+std::size_t FrozenTree<Key, Value, Compare>::findIndex(const K &key) const
+{
+    std::size_t i = lowerBoundIndex(key);
+    if (i != size_ && comp_(key, items_[i].first))
+        return size_;
+    return i;
+}
+
+/**
+ * Returns the sorted position of the first item whose key is not less than
+ * key, or size() if there is none.
+ *
+ * Every step goes to child 2k + (keys_[k] < key) without branching, so the
+ * loop always runs the full height of the tree. When it falls off the
+ * bottom, the bits of k record the path: each 1 is a step right, and the
+ * answer is the last node we stepped left from, found by dropping the
+ * trailing 1s and then one more bit.
+ *
+ * KeySearch (see key_search.h) has nothing to work on here: it counts
+ * through sorted runs of adjacent keys, and the keys one search compares
+ * are one per level, ever further apart.
+ */
+template <typename Key, typename Value, typename Compare>
+template <typename K>
+std::size_t FrozenTree<Key, Value, Compare>::lowerBoundIndex(const K &key) const
+{
+    const std::size_t n = (size_ == 0) ? 0 : size_ + 1;
+    const Key *keys = keys_;
+    // descendants four levels down are 16 slots apart, so one line of keys
+    // from 16k covers as many of them as fit
+    const std::size_t ahead = (sizeof(Key) <= PREFETCH_BYTES) ? 16 : 0;
+
+    std::size_t k = 1;
+    while (k < n)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        if (ahead != 0 && ahead * k < n)
+            __builtin_prefetch(keys + ahead * k);
+#endif
+        k = 2 * k + static_cast<std::size_t>(comp_(keys[k], key));
+    }
+
+#if defined(__GNUC__) || defined(__clang__)
+    k >>= __builtin_ctzll(~static_cast<unsigned long long>(k)) + 1;
+#else
+    while (k & 1)
+        k >>= 1;
+    k >>= 1;
+#endif
+    return (k == 0) ? size_ : positions_[k];
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the FrozenTree class.
+  -----------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef KEY_SEARCH_H
+#define KEY_SEARCH_H
+
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define KEY_SEARCH_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ * Searches the small sorted key arrays inside the nodes of packed layouts
+ * such as BTree. countNotGreater(keys, n, key, comp) returns how many of
+ * keys[0, n) are not greater than key, which is where std::upper_bound
+ * would stop. countLessItems() and countNotGreaterItems() do the same for
+ * an array of key/value pairs, giving the lower and upper bound positions.
+ *
+ * Which search runs is picked at compile time from Key and Compare:
+ *  - 32- and 64-bit integers ordered by std::less compare a whole block of
+ *    keys per instruction, with SSE2 (4 x 32-bit) or AVX2 (4 x 64-bit).
+ *    AVX2 is used if the build targets it, or else if the CPU turns out to
+ *    have it at run time; otherwise 64-bit keys use the scalar loop below.
+ *  - Other arithmetic keys, and the keys inside item arrays (too spread
+ *    out for a vector load), count with a branch-free scalar loop.
+ *  - Everything else (strings, custom comparators) binary searches.
+ * Off x86-64, or with other compilers, the integer keys use the scalar loop.
+ */
+namespace key_search_detail
+{
+    // 0 for signed keys; for unsigned ones, flipping the sign bit of both
+    // sides turns unsigned order into the signed order the CPU compares in
+    template <typename Key>
+    struct SignFlip
+    {
+        static const std::uint64_t value = std::is_signed<Key>::value ? 0 : (std::uint64_t(1) << (8 * sizeof(Key) - 1));
+    };
+
+    /**
+     * Counts keys[i] <= key without branching; the loop is short enough
+     * that this beats a binary search's mispredicted branches.
+     */
+    template <typename Key>
+    inline std::size_t countNotGreaterScalar(const Key *keys, std::size_t n, Key key)
+    {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            count += static_cast<std::size_t>(!(key < keys[i]));
+        }
+        return count;
+    }
+
+    /**
+     * Scalar counts over the keys of an array of pairs, for lower_bound
+     * (Less = true) or upper_bound positions. Branch-free, as above.
+     */
+    template <bool Less, typename Item, typename K, typename Compare>
+    inline std::size_t countItemsScalar(const Item *items, std::size_t n, const K &key, const Compare &comp)
+    {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            count += static_cast<std::size_t>(Less ? comp(items[i].first, key) : !comp(key, items[i].first));
+        }
+        return count;
+    }
+
+    /**
+     * The same counts by binary search, for keys that are costly to compare.
+     */
+    template <bool Less, typename Item, typename K, typename Compare>
+    inline std::size_t countItemsBinary(const Item *items, std::size_t n, const K &key, const Compare &comp)
+    {
+        std::size_t lo = 0;
+        std::size_t hi = n;
+        while (lo < hi)
+        {
+            std::size_t mid = (lo + hi) / 2;
+            if (Less ? comp(items[mid].first, key) : !comp(key, items[mid].first))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+#ifdef KEY_SEARCH_X86
+    /**
+     * SSE2 count for 32-bit keys, four at a time. SSE2 is part of x86-64,
+     * so this needs no run-time check.
+     */
+    inline std::size_t countNotGreater32(const std::int32_t *keys, std::size_t n, std::int32_t key, std::uint32_t flip)
+    {
+        const __m128i vflip = _mm_set1_epi32(static_cast<std::int32_t>(flip));
+        const __m128i vkey = _mm_set1_epi32(static_cast<std::int32_t>(static_cast<std::uint32_t>(key) ^ flip));
+        std::size_t count = 0;
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i block = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i)), vflip);
+            __m128i greater = _mm_cmpgt_epi32(block, vkey);
+            count += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(greater)));
+        }
+        for (; i < n; ++i)
+        {
+            count += static_cast<std::size_t>(static_cast<std::int32_t>(static_cast<std::uint32_t>(keys[i]) ^ flip) <=
+                                              static_cast<std::int32_t>(static_cast<std::uint32_t>(key) ^ flip));
+        }
+        return count;
+    }
+
+    /**
+     * AVX2 count for 64-bit keys, four at a time. Compiled for AVX2 even
+     * when the rest of the build is not, so it must only be called once the
+     * CPU is known to support it.
+     */
+    __attribute__((target("avx2"))) inline std::size_t countNotGreater64Avx2(const std::int64_t *keys, std::size_t n, std::int64_t key, std::uint64_t flip)
+    {
+        const __m256i vflip = _mm256_set1_epi64x(static_cast<std::int64_t>(flip));
+        const __m256i vkey = _mm256_set1_epi64x(static_cast<std::int64_t>(static_cast<std::uint64_t>(key) ^ flip));
+        std::size_t count = 0;
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i block = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), vflip);
+            __m256i greater = _mm256_cmpgt_epi64(block, vkey);
+            count += 4 - __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(greater)));
+        }
+        for (; i < n; ++i)
+        {
+            count += static_cast<std::size_t>(static_cast<std::int64_t>(static_cast<std::uint64_t>(keys[i]) ^ flip) <=
+                                              static_cast<std::int64_t>(static_cast<std::uint64_t>(key) ^ flip));
+        }
+        return count;
+    }
+
+    /**
+     * True if the AVX2 path may be used. Checked once per process.
+     */
+    inline bool haveAvx2()
+    {
+#ifdef __AVX2__
+        return true;
+#else
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+#endif
+    }
+#endif
+}
+
+/**
+ * The general search: a binary search, for any key type and comparator.
+ */
+template <typename Key, typename Compare,
+          int Kind = (std::is_integral<Key>::value && (sizeof(Key) == 4 || sizeof(Key) == 8) &&
+                      std::is_same<Compare, std::less<Key> >::value)
+                         ? 2
+                     : (std::is_arithmetic<Key>::value && std::is_same<Compare, std::less<Key> >::value) ? 1
+                                                                                                           : 0>
+struct KeySearch
+{
+    template <typename K>
+    static std::size_t countNotGreater(const Key *keys, std::size_t n, const K &key, const Compare &comp)
+    {
+        return std::upper_bound(keys, keys + n, key, comp) - keys;
+    }
+    template <typename Item, typename K>
+    static std::size_t countLessItems(const Item *items, std::size_t n, const K &key, const Compare &comp)
+    {
+        return key_search_detail::countItemsBinary<true>(items, n, key, comp);
+    }
+    template <typename Item, typename K>
+    static std::size_t countNotGreaterItems(const Item *items, std::size_t n, const K &key, const Compare &comp)
+    {
+        return key_search_detail::countItemsBinary<false>(items, n, key, comp);
+    }
+};
+
+/**
+ * Other arithmetic keys under std::less: a branch-free scalar count.
+ */
+template <typename Key, typename Compare>
+struct KeySearch<Key, Compare, 1>
+{
+    static std::size_t countNotGreater(const Key *keys, std::size_t n, const Key &key, const Compare &)
+    {
+        return key_search_detail::countNotGreaterScalar(keys, n, key);
+    }
+    template <typename Item>
+    static std::size_t countLessItems(const Item *items, std::size_t n, const Key &key, const Compare &comp)
+    {
+        return key_search_detail::countItemsScalar<true>(items, n, key, comp);
+    }
+    template <typename Item>
+    static std::size_t countNotGreaterItems(const Item *items, std::size_t n, const Key &key, const Compare &comp)
+    {
+        return key_search_detail::countItemsScalar<false>(items, n, key, comp);
+    }
+};
+
+/**
+ * 32- and 64-bit integers under std::less: compare blocks of keys at once.
+ */
+template <typename Key, typename Compare>
+struct KeySearch<Key, Compare, 2>
+{
+    static std::size_t countNotGreater(const Key *keys, std::size_t n, const Key &key, const Compare &)
+    {
+#ifdef KEY_SEARCH_X86
+        const std::uint64_t flip = key_search_detail::SignFlip<Key>::value;
+        if (sizeof(Key) == 4)
+        {
+            return key_search_detail::countNotGreater32(reinterpret_cast<const std::int32_t *>(keys), n,
+                                                        static_cast<std::int32_t>(key), static_cast<std::uint32_t>(flip));
+        }
+        if (key_search_detail::haveAvx2())
+        {
+            return key_search_detail::countNotGreater64Avx2(reinterpret_cast<const std::int64_t *>(keys), n,
+                                                            static_cast<std::int64_t>(key), flip);
+        }
+#endif
+        return key_search_detail::countNotGreaterScalar(keys, n, key);
+    }
+    template <typename Item>
+    static std::size_t countLessItems(const Item *items, std::size_t n, const Key &key, const Compare &comp)
+    {
+        return key_search_detail::countItemsScalar<true>(items, n, key, comp);
+    }
+    template <typename Item>
+    static std::size_t countNotGreaterItems(const Item *items, std::size_t n, const Key &key, const Compare &comp)
+    {
+        return key_search_detail::countItemsScalar<false>(items, n, key, comp);
+    }
+};
+
+#endif
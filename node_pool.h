@@ -0,0 +1,314 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <cstddef>
+#include <new>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * A slab allocator for the nodes of a search tree.
+ * Nodes are carved out of large chunks, and freed nodes are kept on an
+ * intrusive free list so the next insert can reuse them. Every node
+ * handed out by one pool must have the same size and alignment (one pool
+ * per node type), and release() gives all of the chunks back at once.
+ * Alignments beyond std::max_align_t, e.g. to a cache line, are honored.
+ *
+ * Chunks are reference counted so that trees can hand nodes to each other
+ * (AVLTree::split and join): after a.adopt(b), pool a keeps b's chunks
+ * alive and may take b's nodes in deallocate(). Chunks shared this way are
+ * only freed once every pool holding them has released them.
+ */
+class NodePool
+{
+public:
+    // release() frees every node, so a tree may skip per-node deallocation
+    static const bool bulkRelease = true;
+
+    NodePool();
+    ~NodePool();
+
+    void *allocate(std::size_t size, std::size_t align);
+    void deallocate(void *p);
+    void release();
+    void adopt(NodePool &other); // co-own other's chunks, so its nodes may move here
+
+private:
+    // a pool owns its chunks, so it can't be copied
+    NodePool(const NodePool &);
+    NodePool &operator=(const NodePool &);
+
+    void grow();
+
+    struct FreeSlot
+    {
+        FreeSlot *next;
+    };
+    // header at the front of every chunk, padded so slots stay aligned
+    union Chunk
+    {
+        Chunk *next;
+        std::max_align_t pad;
+    };
+    // a list of chunks, freed when the last pool holding it lets go
+    struct ChunkList
+    {
+        ChunkList() : head(NULL) {}
+        ~ChunkList();
+        Chunk *head;
+    };
+
+    static const std::size_t MIN_CHUNK_BYTES = 4096;
+    static const std::size_t MAX_CHUNK_BYTES = 1 << 20;
+
+    std::shared_ptr<ChunkList> chunks_;                // the chunks slots are carved from
+    std::vector<std::shared_ptr<ChunkList> > adopted_; // other pools' chunks kept alive
+    FreeSlot *freeList_;
+    char *cursor_;   // next never-used slot in the newest chunk
+    char *chunkEnd_; // end of the newest chunk
+    std::size_t slotSize_;
+    std::size_t slotAlign_;
+    std::size_t chunkBytes_;
+};
+
+/**
+ * A drop-in replacement for NodePool that goes straight to the heap.
+ * Useful when nodes must be freed back to the system one at a time.
+ */
+class HeapAllocator
+{
+public:
+    static const bool bulkRelease = false;
+
+    void *allocate(std::size_t size, std::size_t /*align*/)
+    {
+        return ::operator new(size);
+    }
+    void deallocate(void *p)
+    {
+        ::operator delete(p);
+    }
+    void release()
+    {
+    }
+    void adopt(HeapAllocator & /*other*/)
+    {
+        // every node owns its own memory already
+    }
+};
+
+/**
+ * A NodePool that never gives memory back while it is alive: release() is a
+ * no-op and clear() frees nodes one at a time onto the free list instead.
+ * Freed nodes stay readable (and any child pointer in them points at another
+ * node of the pool), which is what lets optimistic readers in
+ * ConcurrentAVLTree chase pointers while a writer frees nodes under them.
+ * The free list is kept beside the slots rather than threaded through
+ * them, so freeing a node writes nothing over the bytes a reader may
+ * still be loading.
+ */
+class RetainingNodePool
+{
+public:
+    static const bool bulkRelease = false;
+
+    void *allocate(std::size_t size, std::size_t align)
+    {
+        if (free_.empty())
+        {
+            return pool_.allocate(size, align);
+        }
+        void *p = free_.back();
+        free_.pop_back();
+        return p;
+    }
+    void deallocate(void *p)
+    {
+        if (p == NULL)
+            return;
+        try
+        {
+            free_.push_back(p);
+        }
+        catch (const std::bad_alloc &)
+        {
+            // the slot is only lost for reuse, the pool still owns its memory
+        }
+    }
+    void release()
+    {
+    }
+    void adopt(RetainingNodePool &other)
+    {
+        pool_.adopt(other.pool_);
+    }
+
+private:
+    NodePool pool_;
+    std::vector<void *> free_; // freed slots, reused last in first out
+};
+
+/*
+  -----------------------------------------
+  Begin implementations for the NodePool class.
+  -----------------------------------------
+*/
+
+/**
+ * Constructs an empty pool. No memory is reserved until the first allocate().
+ */
+inline NodePool::NodePool() : freeList_(NULL),
+                              cursor_(NULL),
+                              chunkEnd_(NULL),
+                              slotSize_(0),
+                              slotAlign_(1),
+                              chunkBytes_(MIN_CHUNK_BYTES)
+{
+}
+
+/**
+ * Destructor, which frees every chunk still owned by the pool.
+ */
+inline NodePool::~NodePool()
+{
+    release();
+}
+
+/**
+ * Returns uninitialized storage for one node. Freed slots are reused first,
+ * then slots are bumped off the newest chunk, and a new chunk is only
+ * requested from the heap once both run out.
+ */
+inline void *NodePool::allocate(std::size_t size, std::size_t align)
+{
+    if (slotSize_ == 0)
+    {
+        // first allocation fixes the slot size for the life of the pool
+        std::size_t slot = (size < sizeof(FreeSlot)) ? sizeof(FreeSlot) : size;
+        slotSize_ = (slot + align - 1) / align * align;
+        slotAlign_ = align;
+    }
+
+    if (freeList_ != NULL)
+    {
+        FreeSlot *slot = freeList_;
+        freeList_ = slot->next;
+        return slot;
+    }
+
+    if (cursor_ == NULL || chunkEnd_ - cursor_ < static_cast<std::ptrdiff_t>(slotSize_))
+    {
+        grow();
+    }
+    void *slot = cursor_;
+    cursor_ += slotSize_;
+    return slot;
+}
+
+/**
+ * Puts a node's storage back on the free list. The memory stays owned by the pool.
+ */
+inline void NodePool::deallocate(void *p)
+{
+    if (p == NULL)
+        return;
+    FreeSlot *slot = static_cast<FreeSlot *>(p);
+    slot->next = freeList_;
+    freeList_ = slot;
+}
+
+/**
+ * Frees every chunk at once, in time proportional to the number of chunks.
+ * Any node that has not been destroyed yet is simply dropped. Chunks that
+ * another pool also holds (see adopt()) are left to that pool.
+ */
+inline void NodePool::release()
+{
+    chunks_.reset();
+    adopted_.clear();
+    freeList_ = NULL;
+    cursor_ = NULL;
+    chunkEnd_ = NULL;
+    chunkBytes_ = MIN_CHUNK_BYTES;
+}
+
+/**
+ * Adds a new chunk to the pool. Chunk sizes double up to MAX_CHUNK_BYTES so
+ * that small trees stay small and big trees make few calls to the heap.
+ * The first slot is aligned up to slotAlign_, and since the slot size is a
+ * multiple of it, so is every slot after it.
+ */
+inline void NodePool::grow()
+{
+    std::size_t bytes = chunkBytes_;
+    if (bytes < sizeof(Chunk) + slotAlign_ + slotSize_)
+    {
+        bytes = sizeof(Chunk) + slotAlign_ + slotSize_;
+    }
+    if (!chunks_)
+    {
+        chunks_ = std::make_shared<ChunkList>();
+    }
+    Chunk *chunk = static_cast<Chunk *>(::operator new(bytes));
+    chunk->next = chunks_->head;
+    chunks_->head = chunk;
+    std::uintptr_t first = reinterpret_cast<std::uintptr_t>(chunk) + sizeof(Chunk);
+    first = (first + slotAlign_ - 1) / slotAlign_ * slotAlign_;
+    cursor_ = reinterpret_cast<char *>(first);
+    chunkEnd_ = reinterpret_cast<char *>(chunk) + bytes;
+
+    if (chunkBytes_ < MAX_CHUNK_BYTES)
+    {
+        chunkBytes_ *= 2;
+    }
+}
+
+/**
+ * Makes this pool a co-owner of every chunk other owns or has adopted, so
+ * nodes allocated by other may be moved into this pool's tree: they stay
+ * valid for as long as either pool holds the chunks, and deallocate() here
+ * takes them onto this pool's free list. Both pools must hand out the same
+ * node type. O(number of pools adopted so far).
+ */
+inline void NodePool::adopt(NodePool &other)
+{
+    if (&other == this)
+        return;
+    std::vector<std::shared_ptr<ChunkList> > lists(other.adopted_);
+    if (other.chunks_)
+        lists.push_back(other.chunks_);
+    for (std::size_t i = 0; i < lists.size(); ++i)
+    {
+        if (lists[i] == chunks_)
+            continue;
+        bool held = false;
+        for (std::size_t j = 0; j < adopted_.size() && !held; ++j)
+        {
+            held = (adopted_[j] == lists[i]);
+        }
+        if (!held)
+            adopted_.push_back(lists[i]);
+    }
+}
+
+/**
+ * Frees the chunks in the list.
+ */
+inline NodePool::ChunkList::~ChunkList()
+{
+    while (head != NULL)
+    {
+        Chunk *next = head->next;
+        ::operator delete(head);
+        head = next;
+    }
+}
+
+/*
+  ---------------------------------------
+  End implementations for the NodePool class.
+  ---------------------------------------
+*/
+
+#endif
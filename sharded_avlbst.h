@@ -0,0 +1,805 @@
+#ifndef SHARDED_AVLBST_H
+#define SHARDED_AVLBST_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+#include "avlbst.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SHARDED_AVLBST_RWLOCK 1
+#include <pthread.h>
+#endif
+
+namespace sharded_detail
+{
+    /**
+     * A reader-writer lock: one exclusive holder (lock/unlock, so it works
+     * with std::lock_guard) or any number of shared ones. C++11 has no
+     * std::shared_mutex, so this wraps pthread_rwlock_t, preferring
+     * writers where glibc lets us choose so that a steady stream of
+     * lookups can't starve them. Off POSIX systems it is a plain mutex,
+     * and readers simply take turns.
+     */
+    class SharedMutex
+    {
+    public:
+#ifdef SHARDED_AVLBST_RWLOCK
+        SharedMutex()
+        {
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+            pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+            int error = pthread_rwlock_init(&lock_, &attr);
+            pthread_rwlockattr_destroy(&attr);
+            if (error != 0)
+                throw std::runtime_error("SharedMutex: pthread_rwlock_init failed");
+        }
+        ~SharedMutex() { pthread_rwlock_destroy(&lock_); }
+        void lock() { pthread_rwlock_wrlock(&lock_); }
+        void unlock() { pthread_rwlock_unlock(&lock_); }
+        void lock_shared() { pthread_rwlock_rdlock(&lock_); }
+        void unlock_shared() { pthread_rwlock_unlock(&lock_); }
+
+    private:
+        pthread_rwlock_t lock_;
+#else
+        void lock() { lock_.lock(); }
+        void unlock() { lock_.unlock(); }
+        void lock_shared() { lock_.lock(); }
+        void unlock_shared() { lock_.unlock(); }
+
+    private:
+        std::mutex lock_;
+#endif
+        SharedMutex(const SharedMutex &);
+        SharedMutex &operator=(const SharedMutex &);
+    };
+
+#ifdef TREE_STATS
+    // lookups bump the tree's counters, so they can't share a shard
+    static const bool SHARED_READS = false;
+#else
+    static const bool SHARED_READS = true;
+#endif
+
+    /**
+     * Holds a SharedMutex for a lookup for a scope: shared, unless
+     * SHARED_READS is off. With std::adopt_lock it takes over a hold
+     * already made the same way.
+     */
+    class ReadGuard
+    {
+    public:
+        explicit ReadGuard(SharedMutex &mutex) : mutex_(mutex)
+        {
+            if (SHARED_READS)
+                mutex_.lock_shared();
+            else
+                mutex_.lock();
+        }
+        ReadGuard(SharedMutex &mutex, std::adopt_lock_t) : mutex_(mutex) {}
+        ~ReadGuard()
+        {
+            if (SHARED_READS)
+                mutex_.unlock_shared();
+            else
+                mutex_.unlock();
+        }
+
+    private:
+        SharedMutex &mutex_;
+        ReadGuard(const ReadGuard &);
+        ReadGuard &operator=(const ReadGuard &);
+    };
+
+    /**
+     * Holds two SharedMutexes exclusively for a scope, taking them in
+     * address order: shards are reused, so the same two can meet as either
+     * left or right, and a fixed order keeps the lock graph acyclic.
+     */
+    class PairGuard
+    {
+    public:
+        PairGuard(SharedMutex &a, SharedMutex &b)
+            : first_(std::less<SharedMutex *>()(&a, &b) ? a : b), second_(&first_ == &a ? b : a)
+        {
+            first_.lock();
+            second_.lock();
+        }
+        ~PairGuard()
+        {
+            second_.unlock();
+            first_.unlock();
+        }
+
+    private:
+        SharedMutex &first_;
+        SharedMutex &second_;
+        PairGuard(const PairGuard &);
+        PairGuard &operator=(const PairGuard &);
+    };
+
+    /**
+     * Tells a resplit when no thread can still be reading a layout it
+     * replaced. A thread looks at layouts only between enter() and
+     * leave(), which count it against the epoch it entered in, on a
+     * stripe picked by its thread id so threads rarely share a count.
+     * tryAdvance() moves the epoch on only once nobody is left in the one
+     * before the current, so a layout retired in epoch e is unreachable
+     * once current() reaches e + 2. Nothing here waits: a thread stuck
+     * between enter() and leave() just holds retired layouts back.
+     */
+    class Epochs
+    {
+    public:
+        Epochs() : epoch_(0)
+        {
+            for (std::size_t i = 0; i < STRIPES; ++i)
+            {
+                stripes_[i].active[0].store(0, std::memory_order_relaxed);
+                stripes_[i].active[1].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        // returns the count to pass to leave()
+        std::atomic<std::size_t> *enter()
+        {
+            static thread_local std::size_t stripe = std::hash<std::thread::id>()(std::this_thread::get_id()) % STRIPES;
+            for (;;)
+            {
+                std::uint64_t epoch = epoch_.load();
+                std::atomic<std::size_t> *active = &stripes_[stripe].active[epoch & 1];
+                active->fetch_add(1);
+                if (epoch_.load() == epoch)
+                    return active;
+                active->fetch_sub(1); // raced an advance, which may not have seen us
+            }
+        }
+        void leave(std::atomic<std::size_t> *active) { active->fetch_sub(1); }
+
+        std::uint64_t current() const { return epoch_.load(); }
+        bool tryAdvance() // only one thread at a time
+        {
+            std::uint64_t epoch = epoch_.load();
+            for (std::size_t i = 0; i < STRIPES; ++i)
+            {
+                if (stripes_[i].active[(epoch + 1) & 1].load() != 0)
+                    return false;
+            }
+            epoch_.store(epoch + 1);
+            return true;
+        }
+
+    private:
+        static const std::size_t STRIPES = 16;
+        struct Stripe
+        {
+            std::atomic<std::size_t> active[2]; // threads inside, by epoch parity
+            char padding[64];
+        };
+        std::atomic<std::uint64_t> epoch_;
+        Stripe stripes_[STRIPES];
+        Epochs(const Epochs &);
+        Epochs &operator=(const Epochs &);
+    };
+
+    /**
+     * Stays inside an epoch (Epochs::enter) for a scope.
+     */
+    class EpochGuard
+    {
+    public:
+        explicit EpochGuard(Epochs &epochs) : epochs_(epochs), active_(epochs.enter()) {}
+        ~EpochGuard() { epochs_.leave(active_); }
+
+    private:
+        Epochs &epochs_;
+        std::atomic<std::size_t> *active_;
+        EpochGuard(const EpochGuard &);
+        EpochGuard &operator=(const EpochGuard &);
+    };
+}
+
+/**
+ * An ordered map split by key range over several AVLTrees ("shards"), each
+ * with its own lock and node pool, so writers to different ranges don't
+ * wait on each other.
+ *
+ * A write finds its shard by binary search over the shard boundaries,
+ * locks just that shard, and runs the ordinary AVLTree insert or remove.
+ * Each shard's lock is a reader-writer lock, so lookups in one shard run
+ * side by side and only wait for writers (except in TREE_STATS builds,
+ * where lookups update counters and so lock shards exclusively).
+ * The boundaries live in an immutable Layout that is swapped atomically
+ * when they change; a writer that locked its shard under an old layout
+ * notices and retries, so it never touches the wrong range.
+ *
+ * The shards adapt to the load. Each counts its writes, and every
+ * RESPLIT_CHECK_WRITES writes to a shard the map looks for the hottest
+ * one and splits it at its median key (AVLTree::split, O(log n)), until
+ * there are maxShards; after that a shard doing more than twice its share
+ * of the writes is split by first joining the coldest pair of neighbours
+ * (AVLTree::join). A shard whose inserts nearly all land past the highest
+ * key it has taken (ascending keys, say) is left alone: a split would only
+ * move the appends into its upper half. Start with one shard and let it
+ * grow, or pass the boundaries of a known key distribution to the
+ * constructor.
+ *
+ * Since shards hold disjoint, ordered ranges, visiting them in order gives
+ * the items in key order, with no merging. forEach() does that one shard
+ * at a time, sharing its lock and then going on from its upper bound in
+ * whatever layout is current, so a resplit during the walk neither skips
+ * nor repeats keys; it sees each shard at one instant but not the whole
+ * map at one instant. There is no iterator, since one would have to hold
+ * a shard's lock between calls; forEach(lo, hi, visit) covers range
+ * scans, visiting only the shards that overlap the range.
+ *
+ * A shard emptied by a join is kept for the next split to reuse, since a
+ * thread may still lock it under an old layout (and then retry), so there
+ * are never more than maxShards. Old layouts are freed once no thread can
+ * still be reading them, tracked by sharded_detail::Epochs.
+ */
+template <class Key, class Value, class Compare = std::less<Key> >
+class ShardedAVLTree
+{
+public:
+    explicit ShardedAVLTree(std::size_t maxShards = 0, const Compare &comp = Compare());
+    ShardedAVLTree(const std::vector<Key> &bounds, std::size_t maxShards = 0, const Compare &comp = Compare());
+
+    // writers: lock only the shard holding the key
+    void insert(const std::pair<const Key, Value> &new_item);
+    void remove(const Key &key);
+    void clear();
+
+    // readers: share only the shard holding the key, results are copies
+    bool find(const Key &key, Value &value) const;
+    bool contains(const Key &key) const;
+
+    template <typename Visit>
+    void forEach(Visit visit) const; // visit(item) for every item, in key order
+    template <typename Visit>
+    void forEach(const Key &lo, const Key &hi, Visit visit) const; // the same, for keys in [lo, hi)
+    std::size_t size() const;
+    std::size_t shardCount() const;
+    void resplit(); // rebalance the shards now instead of waiting for the next check
+
+    // writes to a shard between checks for hot shards
+    static const std::uint64_t RESPLIT_CHECK_WRITES = 1 << 14;
+    // shards smaller than this are never split
+    static const std::size_t MIN_SPLIT_SIZE = 64;
+
+protected:
+    /**
+     * A shard's tree. Ranked, so the median to split at and the size are
+     * found in O(log n).
+     */
+    class ShardTree : public AVLTree<Key, Value, NodePool, true, Compare>
+    {
+    public:
+        explicit ShardTree(const Compare &comp) : AVLTree<Key, Value, NodePool, true, Compare>(comp) {}
+        std::size_t size() const
+        {
+            return this->sizeOf(static_cast<AVLNode<Key, Value> *>(this->root_));
+        }
+    };
+
+    struct Shard
+    {
+        explicit Shard(const Compare &comp) : tree(comp), writes(0), appends(0) {}
+        sharded_detail::SharedMutex lock; // shared by lookups, exclusive for writes
+        ShardTree tree;
+        std::atomic<std::uint64_t> writes;  // since the last check, only changed under lock
+        std::atomic<std::uint64_t> appends; // the inserts among them past highest
+        std::unique_ptr<Key> highest;       // the highest key inserted since the range last changed
+        // keeps the next shard's lock off this one's last cache line
+        char padding[64];
+    };
+
+    // shards[i] holds the keys in [bounds[i - 1], bounds[i])
+    struct Layout
+    {
+        std::vector<Key> bounds;
+        std::vector<Shard *> shards;
+    };
+
+    Shard *lockShardFor(const Key &key, bool shared = false) const; // the locked shard key belongs in
+    template <typename Visit>
+    void visitRange(const Key *lo, const Key *hi, Visit &visit) const; // null for no bound
+    void inserted(Shard *shard, const Key &key); // track appends past the shard's highest key
+    bool wrote(Shard *shard);                    // count a write and unlock; true if a check is due
+    void rebalanceShards(bool wait);
+    void publish(const Layout &layout);
+    Shard *newShard();
+    void retireShard(Shard *shard);
+
+    typedef std::pair<std::uint64_t, std::unique_ptr<const Layout> > RetiredLayout; // with the epoch it was replaced in
+
+    Compare comp_;
+    std::size_t maxShards_;
+    std::atomic<const Layout *> layout_;
+    mutable sharded_detail::Epochs epochs_;       // entered by every thread reading layout_
+    mutable std::mutex resplitLock_;              // held to change the layout
+    std::unique_ptr<const Layout> current_;       // the layout layout_ points to
+    std::vector<RetiredLayout> retired_;          // replaced, but maybe still being read
+    std::vector<std::unique_ptr<Shard> > shards_; // every shard made, at most maxShards
+    std::vector<Shard *> spares_;                 // emptied by joins, for newShard to reuse
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the ShardedAVLTree class.
+  -----------------------------------------------
+*/
+
+/**
+ * An empty map with one shard, which may grow to maxShards (by default
+ * four per hardware thread) as writes come in.
+ */
+template <class Key, class Value, class Compare>
+ShardedAVLTree<Key, Value, Compare>::ShardedAVLTree(std::size_t maxShards, const Compare &comp)
+    : comp_(comp), maxShards_(maxShards), layout_(nullptr)
+{
+    if (maxShards_ == 0)
+    {
+        maxShards_ = 4 * std::max(1u, std::thread::hardware_concurrency());
+    }
+    Layout layout;
+    layout.shards.push_back(newShard());
+    publish(layout);
+}
+
+/**
+ * An empty map already split at bounds, which must be sorted and unique:
+ * one shard below bounds[0], one from each bound to the next, and one from
+ * the last bound up. Throws std::invalid_argument otherwise.
+ */
+template <class Key, class Value, class Compare>
+ShardedAVLTree<Key, Value, Compare>::ShardedAVLTree(const std::vector<Key> &bounds, std::size_t maxShards, const Compare &comp)
+    : comp_(comp), maxShards_(maxShards), layout_(nullptr)
+{
+    if (maxShards_ == 0)
+    {
+        maxShards_ = 4 * std::max(1u, std::thread::hardware_concurrency());
+    }
+    maxShards_ = std::max(maxShards_, bounds.size() + 1);
+    for (std::size_t i = 1; i < bounds.size(); ++i)
+    {
+        if (!comp_(bounds[i - 1], bounds[i]))
+            throw std::invalid_argument("ShardedAVLTree: bounds must be sorted and unique");
+    }
+    Layout layout;
+    layout.bounds = bounds;
+    for (std::size_t i = 0; i <= bounds.size(); ++i)
+    {
+        layout.shards.push_back(newShard());
+    }
+    publish(layout);
+}
+
+/**
+ * Inserts or overwrites an item, holding only its shard's lock.
+ */
+template <class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value> &new_item)
+{
+    bool check;
+    {
+        sharded_detail::EpochGuard epochGuard(epochs_);
+        Shard *shard = lockShardFor(new_item.first);
+        try
+        {
+            shard->tree.insert(new_item);
+            inserted(shard, new_item.first);
+        }
+        catch (...)
+        {
+            shard->lock.unlock();
+            throw;
+        }
+        check = wrote(shard);
+    }
+    if (check)
+        rebalanceShards(false);
+}
+
+/**
+ * Removes a key if it is present, holding only its shard's lock.
+ */
+template <class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::remove(const Key &key)
+{
+    bool check;
+    {
+        sharded_detail::EpochGuard epochGuard(epochs_);
+        Shard *shard = lockShardFor(key);
+        shard->tree.remove(key);
+        check = wrote(shard);
+    }
+    if (check)
+        rebalanceShards(false);
+}
+
+/**
+ * Removes every item, keeping the shards and their boundaries.
+ */
+template <class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::clear()
+{
+    std::lock_guard<std::mutex> guard(resplitLock_);
+    const Layout *layout = layout_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < layout->shards.size(); ++i)
+    {
+        std::lock_guard<sharded_detail::SharedMutex> shardGuard(layout->shards[i]->lock);
+        layout->shards[i]->tree.clear();
+        layout->shards[i]->highest.reset();
+    }
+}
+
+/**
+ * Looks up key, copying its value out if it is present.
+ */
+template <class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::find(const Key &key, Value &value) const
+{
+    sharded_detail::EpochGuard epochGuard(epochs_);
+    Shard *shard = lockShardFor(key, true);
+    sharded_detail::ReadGuard guard(shard->lock, std::adopt_lock);
+    typename ShardTree::iterator it = shard->tree.find(key);
+    if (it == shard->tree.end())
+    {
+        return false;
+    }
+    value = it->second;
+    return true;
+}
+
+/**
+ * Returns true if key is present.
+ */
+template <class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::contains(const Key &key) const
+{
+    sharded_detail::EpochGuard epochGuard(epochs_);
+    Shard *shard = lockShardFor(key, true);
+    sharded_detail::ReadGuard guard(shard->lock, std::adopt_lock);
+    return shard->tree.find(key) != shard->tree.end();
+}
+
+/**
+ * Calls visit(item) for every item, in key order: shard by shard, each
+ * under its own lock (see visitRange). visit must not write to the map.
+ */
+template <class Key, class Value, class Compare>
+template <typename Visit>
+void ShardedAVLTree<Key, Value, Compare>::forEach(Visit visit) const
+{
+    visitRange(nullptr, nullptr, visit);
+}
+
+/**
+ * Calls visit(item) for every item with a key in [lo, hi), in key order,
+ * as forEach(visit) does but visiting only the shards the range overlaps.
+ */
+template <class Key, class Value, class Compare>
+template <typename Visit>
+void ShardedAVLTree<Key, Value, Compare>::forEach(const Key &lo, const Key &hi, Visit visit) const
+{
+    if (comp_(lo, hi))
+    {
+        visitRange(&lo, &hi, visit);
+    }
+}
+
+/**
+ * Returns the number of items, summed shard by shard.
+ */
+template <class Key, class Value, class Compare>
+std::size_t ShardedAVLTree<Key, Value, Compare>::size() const
+{
+    std::lock_guard<std::mutex> guard(resplitLock_);
+    const Layout *layout = layout_.load(std::memory_order_acquire);
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < layout->shards.size(); ++i)
+    {
+        sharded_detail::ReadGuard shardGuard(layout->shards[i]->lock);
+        total += layout->shards[i]->tree.size();
+    }
+    return total;
+}
+
+/**
+ * Returns the number of shards the keys are currently split over.
+ */
+template <class Key, class Value, class Compare>
+std::size_t ShardedAVLTree<Key, Value, Compare>::shardCount() const
+{
+    sharded_detail::EpochGuard epochGuard(epochs_);
+    return layout_.load(std::memory_order_acquire)->shards.size();
+}
+
+/**
+ * Splits the hottest shard now, if the writes since the last check call for
+ * it, rather than waiting for RESPLIT_CHECK_WRITES more.
+ */
+template <class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::resplit()
+{
+    rebalanceShards(true);
+}
+
+/**
+ * Finds and locks the shard that key belongs in, shared if shared is set
+ * and lookups may share (see sharded_detail::ReadGuard). The layout is read
+ * without a lock, so after locking the shard it is checked again: layouts
+ * only change with the shards they touch locked exclusively, so an
+ * unchanged layout means the shard is still the right one. The caller
+ * must be inside epochs_, which keeps the layout from being freed (and
+ * its address reused) meanwhile.
+ */
+template <class Key, class Value, class Compare>
+typename ShardedAVLTree<Key, Value, Compare>::Shard *ShardedAVLTree<Key, Value, Compare>::lockShardFor(const Key &key, bool shared) const
+{
+    shared = shared && sharded_detail::SHARED_READS;
+    for (;;)
+    {
+        const Layout *layout = layout_.load(std::memory_order_acquire);
+        std::size_t index = std::upper_bound(layout->bounds.begin(), layout->bounds.end(), key, comp_) - layout->bounds.begin();
+        Shard *shard = layout->shards[index];
+        if (shared)
+            shard->lock.lock_shared();
+        else
+            shard->lock.lock();
+        if (layout_.load(std::memory_order_acquire) == layout)
+        {
+            return shard;
+        }
+        if (shared)
+            shard->lock.unlock_shared();
+        else
+            shard->lock.unlock();
+    }
+}
+
+/**
+ * Visits the items from *lo up to *hi, starting from the first item if lo
+ * is null and going to the last if hi is. Each step shares the lock of the
+ * shard holding the next key, checks the layout as lockShardFor does, and
+ * visits that shard's part of the range; the next step starts from the
+ * shard's upper bound in the layout it was found in. Resplits only move
+ * bounds with the shards they touch locked, so the walk goes on from
+ * exactly where the last shard ended, whatever the layout is by then.
+ * Each step is inside epochs_ only while it uses its layout, so a long
+ * walk doesn't hold back the freeing of old ones.
+ */
+template <class Key, class Value, class Compare>
+template <typename Visit>
+void ShardedAVLTree<Key, Value, Compare>::visitRange(const Key *lo, const Key *hi, Visit &visit) const
+{
+    std::unique_ptr<Key> from; // the key to go on from, after the first shard
+    for (;;)
+    {
+        const Key *start = from ? from.get() : lo;
+        sharded_detail::EpochGuard epochGuard(epochs_);
+        const Layout *layout = layout_.load(std::memory_order_acquire);
+        std::size_t index = start ? std::upper_bound(layout->bounds.begin(), layout->bounds.end(), *start, comp_) - layout->bounds.begin() : 0;
+        Shard *shard = layout->shards[index];
+        sharded_detail::ReadGuard shardGuard(shard->lock);
+        if (layout_.load(std::memory_order_acquire) != layout)
+        {
+            continue;
+        }
+        const ShardTree &tree = shard->tree;
+        for (typename ShardTree::iterator it = start ? tree.lower_bound(*start) : tree.begin(); it != tree.end(); ++it)
+        {
+            if (hi && !comp_(it->first, *hi))
+                return;
+            visit(*it);
+        }
+        if (index == layout->bounds.size() || (hi && !comp_(layout->bounds[index], *hi)))
+        {
+            return;
+        }
+        from.reset(new Key(layout->bounds[index]));
+    }
+}
+
+/**
+ * Counts an insert of key into the locked shard as an append if it is past
+ * the highest key the shard has taken. Removes don't lower highest, so
+ * this errs towards not counting appends.
+ */
+template <class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::inserted(Shard *shard, const Key &key)
+{
+    if (shard->highest && !comp_(*shard->highest, key))
+    {
+        return;
+    }
+    if (shard->highest)
+        *shard->highest = key;
+    else
+        shard->highest.reset(new Key(key));
+    shard->appends.store(shard->appends.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/**
+ * Counts a write to shard and releases it. Returns true every
+ * RESPLIT_CHECK_WRITES writes, when the caller should check for hot
+ * shards, once out of epochs_. If another thread holds resplitLock_
+ * (resplitting, clearing or counting) the check is tried again on
+ * the next write, until one gets through and resets the counts.
+ */
+template <class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::wrote(Shard *shard)
+{
+    std::uint64_t writes = shard->writes.load(std::memory_order_relaxed) + 1;
+    shard->writes.store(writes, std::memory_order_relaxed);
+    shard->lock.unlock();
+    return writes >= RESPLIT_CHECK_WRITES;
+}
+
+/**
+ * Splits the shard with the most writes since the last check at its
+ * median, if it is big enough and either there is room for another shard
+ * or it had over twice the average share of writes, unless at least 7/8
+ * of them were appends (see inserted). At maxShards, the neighbouring pair
+ * with the fewest writes is joined first to make room.
+ * With wait unset, gives up at once if another thread holds resplitLock_.
+ */
+template <class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::rebalanceShards(bool wait)
+{
+    std::unique_lock<std::mutex> guard(resplitLock_, std::defer_lock);
+    if (wait)
+        guard.lock();
+    else if (!guard.try_lock())
+        return;
+
+    Layout layout = *layout_.load(std::memory_order_acquire);
+    std::size_t n = layout.shards.size();
+    std::vector<std::uint64_t> writes(n);
+    std::vector<std::uint64_t> appends(n);
+    std::uint64_t total = 0;
+    std::size_t hot = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        // only counts, so losing a racing increment doesn't matter
+        writes[i] = layout.shards[i]->writes.exchange(0, std::memory_order_relaxed);
+        appends[i] = layout.shards[i]->appends.exchange(0, std::memory_order_relaxed);
+        total += writes[i];
+        if (writes[i] > writes[hot])
+            hot = i;
+    }
+    bool room = n < maxShards_;
+    if (writes[hot] == 0 || (!room && (n < 3 || writes[hot] * n <= 2 * total)))
+    {
+        return;
+    }
+    if (appends[hot] * 8 >= writes[hot] * 7)
+    {
+        return; // the upper half would just take over the appends
+    }
+    Shard *hotShard = layout.shards[hot];
+    {
+        std::lock_guard<sharded_detail::SharedMutex> hotGuard(hotShard->lock);
+        if (hotShard->tree.size() < MIN_SPLIT_SIZE)
+            return;
+    }
+
+    if (!room)
+    {
+        // the coldest neighbours that don't include the hot shard
+        std::size_t cold = n;
+        for (std::size_t i = 0; i + 1 < n; ++i)
+        {
+            if (i == hot || i + 1 == hot)
+                continue;
+            if (cold == n || writes[i] + writes[i + 1] < writes[cold] + writes[cold + 1])
+                cold = i;
+        }
+        if (cold == n || 2 * (writes[cold] + writes[cold + 1]) >= writes[hot])
+            return; // nothing to join, or joining would make a new hot shard
+        Shard *left = layout.shards[cold];
+        Shard *right = layout.shards[cold + 1];
+        sharded_detail::PairGuard pairGuard(left->lock, right->lock);
+        left->tree.join(right->tree);
+        left->highest.reset();
+        retireShard(right);
+        layout.bounds.erase(layout.bounds.begin() + cold);
+        layout.shards.erase(layout.shards.begin() + cold + 1);
+        publish(layout);
+        hot = std::find(layout.shards.begin(), layout.shards.end(), hotShard) - layout.shards.begin();
+    }
+
+    // a reused shard may still be locked by threads on an old layout
+    Shard *upper = newShard();
+    sharded_detail::PairGuard pairGuard(hotShard->lock, upper->lock);
+    std::size_t size = hotShard->tree.size();
+    if (size < 2)
+    {
+        spares_.push_back(upper);
+        return; // emptied by removes since the check above
+    }
+    Key middle = hotShard->tree.select(size / 2)->first;
+    hotShard->tree.split(middle, upper->tree);
+    hotShard->highest.reset();
+    layout.bounds.insert(layout.bounds.begin() + hot, middle);
+    layout.shards.insert(layout.shards.begin() + hot + 1, upper);
+    publish(layout);
+}
+
+/**
+ * Makes a copy of layout the current one. Needs resplitLock_, and the
+ * locks of any shard whose range changed. The old layout is retired,
+ * tagged with the epoch after the swap: a thread that could have read it
+ * entered epochs_ no later than that. Then the epoch is moved on if it
+ * can be, and the retired layouts nobody can reach any more are freed.
+ */
+template <class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::publish(const Layout &layout)
+{
+    std::unique_ptr<const Layout> next(new Layout(layout));
+    retired_.reserve(retired_.size() + 1);
+    layout_.store(next.get(), std::memory_order_seq_cst);
+    std::swap(current_, next);
+    if (next)
+        retired_.push_back(RetiredLayout(epochs_.current(), std::move(next)));
+
+    epochs_.tryAdvance();
+    std::uint64_t epoch = epochs_.current();
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < retired_.size(); ++i)
+    {
+        if (retired_[i].first + 2 > epoch)
+            std::swap(retired_[kept++], retired_[i]);
+    }
+    retired_.resize(kept);
+}
+
+/**
+ * Returns an empty shard owned by the map: one a join emptied, or else a
+ * new one.
+ */
+template <class Key, class Value, class Compare>
+typename ShardedAVLTree<Key, Value, Compare>::Shard *ShardedAVLTree<Key, Value, Compare>::newShard()
+{
+    if (!spares_.empty())
+    {
+        Shard *shard = spares_.back();
+        spares_.pop_back();
+        return shard;
+    }
+    shards_.push_back(std::unique_ptr<Shard>(new Shard(comp_)));
+    return shards_.back().get();
+}
+
+/**
+ * Keeps a shard a join emptied for newShard to hand out again; it can't be
+ * freed, since threads on an old layout may still lock it. Needs its lock
+ * and resplitLock_.
+ */
+template <class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::retireShard(Shard *shard)
+{
+    shard->writes.store(0, std::memory_order_relaxed);
+    shard->appends.store(0, std::memory_order_relaxed);
+    shard->highest.reset();
+    spares_.push_back(shard);
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the ShardedAVLTree class.
+  -----------------------------------------------
+*/
+
+#endif
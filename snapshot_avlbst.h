@@ -0,0 +1,1173 @@
+#ifndef SNAPSHOT_AVLBST_H
+#define SNAPSHOT_AVLBST_H
+
+#include <memory>
+#include <vector>
+#include "avlbst.h"
+
+/**
+ * An AVLNode stamped with the epoch it was created in, so the tree can
+ * tell which nodes a snapshot might still be looking at.
+ */
+template <typename Key, typename Value>
+class SnapshotAVLNode : public AVLNode<Key, Value>
+{
+public:
+    SnapshotAVLNode(const Key &key, const Value &value, AVLNode<Key, Value> *parent);
+    SnapshotAVLNode(Key &&key, Value &&value, AVLNode<Key, Value> *parent);
+    SnapshotAVLNode(const ItemMaker<Key, Value> &maker, AVLNode<Key, Value> *parent);
+
+    unsigned long getEpoch() const;
+    void setEpoch(unsigned long epoch);
+
+protected:
+    unsigned long epoch_;
+};
+
+/*
+  -------------------------------------------------
+  Begin implementations for the SnapshotAVLNode class.
+  -------------------------------------------------
+*/
+
+/**
+ * An explicit constructor. The tree sets the epoch once the node exists.
+ */
+template <class Key, class Value>
+SnapshotAVLNode<Key, Value>::SnapshotAVLNode(const Key &key, const Value &value, AVLNode<Key, Value> *parent) : AVLNode<Key, Value>(key, value, parent), epoch_(0)
+{
+}
+
+/**
+ * As above, but moves the key and value into the node.
+ */
+template <class Key, class Value>
+SnapshotAVLNode<Key, Value>::SnapshotAVLNode(Key &&key, Value &&value, AVLNode<Key, Value> *parent) : AVLNode<Key, Value>(std::move(key), std::move(value), parent), epoch_(0)
+{
+}
+
+/**
+ * As above, but builds the item in place from maker.
+ */
+template <class Key, class Value>
+SnapshotAVLNode<Key, Value>::SnapshotAVLNode(const ItemMaker<Key, Value> &maker, AVLNode<Key, Value> *parent) : AVLNode<Key, Value>(maker, parent), epoch_(0)
+{
+}
+
+/**
+ * A getter for the epoch the node was created in.
+ */
+template <class Key, class Value>
+unsigned long SnapshotAVLNode<Key, Value>::getEpoch() const
+{
+    return epoch_;
+}
+
+/**
+ * A setter for the epoch the node was created in.
+ */
+template <class Key, class Value>
+void SnapshotAVLNode<Key, Value>::setEpoch(unsigned long epoch)
+{
+    epoch_ = epoch;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the SnapshotAVLNode class.
+  -----------------------------------------------
+*/
+
+/**
+ * An AVLTree that can hand out O(1), read-only, point-in-time snapshots.
+ *
+ * A snapshot is just the root pointer at the time it was taken. After that,
+ * every node that existed is frozen: before insert or remove changes a frozen
+ * node's children or value, the node is copied and the copy takes its place
+ * in the live tree (path copying, from the root down), so the snapshot keeps
+ * seeing the old nodes and the live tree shares every subtree it did not
+ * touch. The old nodes are freed once no snapshot that can reach them is left.
+ *
+ * Snapshots only read keys, values and child pointers, never parent pointers
+ * or balances (which the live tree keeps changing in place), so a snapshot
+ * can be scanned on another thread while the owner keeps writing. The tree
+ * itself is still single-writer: insert/remove/clear/snapshot() must not run
+ * concurrently, and snapshots must not outlive the tree. The live tree's
+ * iterators are read-only, since writing through one would change a node
+ * in place; operator[] copies the path to its key first, and the reference
+ * it returns is only good until the next snapshot().
+ */
+template <class Key, class Value, class Alloc = NodePool, class Compare = std::less<Key> >
+class SnapshotAVLTree : public AVLTree<Key, Value, Alloc, false, Compare>
+{
+public:
+    /**
+     * A read-only view of the tree as it was when snapshot() was called.
+     */
+    class Snapshot
+    {
+    public:
+        /**
+         * An in-order iterator over a snapshot. It keeps the path from the
+         * root in a small stack, since parent pointers belong to the live tree.
+         */
+        class iterator
+        {
+        public:
+            iterator();
+
+            const std::pair<const Key, Value> &operator*() const;
+            const std::pair<const Key, Value> *operator->() const;
+
+            bool operator==(const iterator &rhs) const;
+            bool operator!=(const iterator &rhs) const;
+
+            iterator &operator++();
+
+        protected:
+            friend class Snapshot;
+            void pushLeftSpine(const Node<Key, Value> *node);
+            // back() is the current node, the rest are ancestors still to visit
+            std::vector<const Node<Key, Value> *> stack_;
+        };
+
+        Snapshot();
+
+        iterator begin() const;
+        iterator end() const;
+        iterator find(const Key &key) const;
+        iterator lower_bound(const Key &key) const;
+        bool empty() const;
+
+    protected:
+        friend class SnapshotAVLTree<Key, Value, Alloc, Compare>;
+        Snapshot(const Node<Key, Value> *root, const std::shared_ptr<void> &token, const Compare &comp);
+
+        const Node<Key, Value> *root_;
+        std::shared_ptr<void> token_; // keeps this snapshot's nodes alive
+        Compare comp_;
+    };
+
+protected:
+    typedef AVLTree<Key, Value, Alloc, false, Compare> Base;
+
+public:
+    /**
+     * An iterator over the live tree, like AVLTree's but read-only: any
+     * node it reaches may be frozen, so writes go through operator[],
+     * insert or emplace, which copy the nodes they change.
+     */
+    class iterator : public Base::iterator
+    {
+    public:
+        typedef const std::pair<const Key, Value> *pointer;
+        typedef const std::pair<const Key, Value> &reference;
+
+        iterator();
+        iterator(const typename Base::iterator &it);
+
+        const std::pair<const Key, Value> &operator*() const;
+        const std::pair<const Key, Value> *operator->() const;
+
+        iterator &operator++();
+        iterator operator++(int);
+        iterator &operator--();
+        iterator operator--(int);
+    };
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    /**
+     * RangeView's read-only counterpart, for range().
+     */
+    class RangeView
+    {
+    public:
+        RangeView(const iterator &first, const iterator &last);
+        iterator begin() const;
+        iterator end() const;
+        bool empty() const;
+
+    private:
+        iterator first_;
+        iterator last_;
+    };
+
+    SnapshotAVLTree();
+    virtual ~SnapshotAVLTree();
+
+    // the lookups, returning read-only iterators
+    iterator begin() const;
+    iterator end() const;
+    reverse_iterator rbegin() const;
+    reverse_iterator rend() const;
+    iterator find(const Key &key) const;
+    iterator find(const iterator &hint, const Key &key) const;
+    iterator lower_bound(const Key &key) const;
+    iterator upper_bound(const Key &key) const;
+    std::pair<iterator, iterator> equal_range(const Key &key) const;
+    RangeView range(const Key &lo, const Key &hi) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K &key) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K &key) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K &key) const;
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<iterator, iterator> equal_range(const K &key) const;
+
+    Value &operator[](const Key &key); // copies the path to key first
+    Value const &operator[](const Key &key) const;
+
+    using AVLTree<Key, Value, Alloc, false, Compare>::insert; // keep insert(&&) visible
+    virtual void insert(const std::pair<const Key, Value> &new_item);
+    iterator insert(const iterator &hint, const std::pair<const Key, Value> &new_item);
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args &&...args);
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key &key, Args &&...args);
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(Key &&key, Args &&...args);
+    virtual void remove(const Key &key);
+    virtual void clear();
+    Snapshot snapshot();
+
+    // snapshots may still see any node, so nodes can't move between trees
+    void split(const Key &key, SnapshotAVLTree &right) = delete;
+    void join(SnapshotAVLTree &right) = delete;
+    void unionWith(SnapshotAVLTree &other) = delete;
+    void intersectWith(SnapshotAVLTree &other) = delete;
+    void differenceWith(SnapshotAVLTree &other) = delete;
+
+protected:
+    typedef SnapshotAVLNode<Key, Value> VersionedNode;
+
+    virtual void destroyNode(Node<Key, Value> *node);
+    virtual Node<Key, Value> *buildNode(const Key &key, const Value &value, int balance, std::size_t size);
+    virtual Node<Key, Value> *buildNode(Key &&key, Value &&value, int balance, std::size_t size);
+    virtual Node<Key, Value> *buildNode(const ItemMaker<Key, Value> &maker, int balance, std::size_t size);
+    virtual void prepareInsert(const Key &key);
+    virtual std::pair<Node<Key, Value> *, bool> insertMoved(Key &&key, Value &&value, bool overwrite);
+    virtual std::pair<Node<Key, Value> *, bool> insertNear(Node<Key, Value> *finger, const Key &key, const Value &value);
+    virtual void mergeSorted(std::vector<std::pair<Key, Value> > &items);
+
+    bool isFrozen(const Node<Key, Value> *node) const;
+    AVLNode<Key, Value> *writable(AVLNode<Key, Value> *node); // copy a frozen node in place
+    AVLNode<Key, Value> *copyPath(const Key &key);             // writable root-to-key path
+    void copyRemovalArea(const Key &key);                       // everything remove may rotate
+    void refreshSnapshots();                                    // forget dead snapshots
+    void reclaim();                                             // free unreachable retired nodes
+
+    unsigned long epoch_;      // stamped on new nodes; snapshots take the value before it
+    unsigned long newestLive_; // epoch of the newest live snapshot, 0 if there are none
+    std::vector<std::pair<unsigned long, std::weak_ptr<void> > > snapshots_;
+    // frozen nodes that left the live tree, with the epoch they left in
+    std::vector<std::pair<Node<Key, Value> *, unsigned long> > retired_;
+};
+
+/*
+--------------------------------------------------------------
+Begin implementations for the SnapshotAVLTree::Snapshot class.
+--------------------------------------------------------------
+*/
+
+/**
+ * A default constructor that initializes the iterator to the end.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator::iterator()
+{
+}
+
+/**
+ * Provides access to the item.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+const std::pair<const Key, Value> &
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator::operator*() const
+{
+    return stack_.back()->getItem();
+}
+
+/**
+ * Provides access to the address of the item.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+const std::pair<const Key, Value> *
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator::operator->() const
+{
+    return &(stack_.back()->getItem());
+}
+
+/**
+ * Checks if both iterators are at the same node (or both at the end).
+ */
+template <class Key, class Value, class Alloc, class Compare>
+bool SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator::operator==(const iterator &rhs) const
+{
+    const Node<Key, Value> *mine = stack_.empty() ? nullptr : stack_.back();
+    const Node<Key, Value> *theirs = rhs.stack_.empty() ? nullptr : rhs.stack_.back();
+    return mine == theirs;
+}
+
+/**
+ * Checks if the iterators are at different nodes.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+bool SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator::operator!=(const iterator &rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+ * Advances to the next item in key order.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator &
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator::operator++()
+{
+    if (stack_.empty())
+    {
+        return *this;
+    }
+    const Node<Key, Value> *current = stack_.back();
+    stack_.pop_back();
+    // next is the leftmost node of the right subtree, if there is one,
+    // otherwise the nearest ancestor we went left from (already on the stack)
+    pushLeftSpine(current->getRight());
+    return *this;
+}
+
+/**
+ * Pushes node and all of its left descendants, so the smallest ends up on top.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator::pushLeftSpine(const Node<Key, Value> *node)
+{
+    for (; node != nullptr; node = node->getLeft())
+    {
+        stack_.push_back(node);
+    }
+}
+
+/**
+ * A default constructor for an empty snapshot.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::Snapshot() : root_(nullptr)
+{
+}
+
+/**
+ * Constructs a snapshot of the tree rooted at root.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::Snapshot(const Node<Key, Value> *root, const std::shared_ptr<void> &token, const Compare &comp) : root_(root),
+                                                                                                                                             token_(token),
+                                                                                                                                             comp_(comp)
+{
+}
+
+/**
+ * Returns an iterator to the smallest item in the snapshot.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::begin() const
+{
+    iterator it;
+    it.pushLeftSpine(root_);
+    return it;
+}
+
+/**
+ * Returns the end iterator.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::end() const
+{
+    return iterator();
+}
+
+/**
+ * Returns an iterator to the item with the given key, or the end iterator.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::find(const Key &key) const
+{
+    iterator it = lower_bound(key);
+    if (it != end() && comp_(key, it->first))
+    {
+        return end();
+    }
+    return it;
+}
+
+/**
+ * Returns an iterator to the first item whose key is not less than key.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::iterator
+SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::lower_bound(const Key &key) const
+{
+    iterator it;
+    const Node<Key, Value> *current = root_;
+    while (current != nullptr)
+    {
+        if (comp_(current->getKey(), key))
+        {
+            current = current->getRight();
+        }
+        else
+        {
+            // a candidate, and an ancestor to come back to
+            it.stack_.push_back(current);
+            current = current->getLeft();
+        }
+    }
+    return it;
+}
+
+/**
+ * Returns true if the snapshot has no items.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+bool SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot::empty() const
+{
+    return root_ == nullptr;
+}
+
+/*
+------------------------------------------------------------
+End implementations for the SnapshotAVLTree::Snapshot class.
+------------------------------------------------------------
+*/
+
+/*
+--------------------------------------------------------------
+Begin implementations for the SnapshotAVLTree::iterator class.
+--------------------------------------------------------------
+*/
+
+/**
+ * A default constructor that initializes the iterator to NULL.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator::iterator()
+{
+}
+
+/**
+ * Wraps an AVLTree iterator, so that it only reads.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator::iterator(const typename Base::iterator &it) : Base::iterator(it)
+{
+}
+
+/**
+ * Provides read-only access to the item.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+const std::pair<const Key, Value> &SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator::operator*() const
+{
+    return Base::iterator::operator*();
+}
+
+/**
+ * Provides read-only access to the address of the item.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+const std::pair<const Key, Value> *SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator::operator->() const
+{
+    return Base::iterator::operator->();
+}
+
+/**
+ * Advances the iterator.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator &SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator::operator++()
+{
+    Base::iterator::operator++();
+    return *this;
+}
+
+/**
+ * Advances the iterator, returning where it was.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator::operator++(int)
+{
+    iterator before(*this);
+    Base::iterator::operator++();
+    return before;
+}
+
+/**
+ * Moves the iterator back; end() moves to the largest item.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator &SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator::operator--()
+{
+    Base::iterator::operator--();
+    return *this;
+}
+
+/**
+ * Moves the iterator back, returning where it was.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator::operator--(int)
+{
+    iterator before(*this);
+    Base::iterator::operator--();
+    return before;
+}
+
+/**
+ * Constructs a view of the items from first up to, but not including, last.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::RangeView::RangeView(const iterator &first, const iterator &last) : first_(first),
+                                                                                                                 last_(last)
+{
+}
+
+/**
+ * Returns the first item of the view.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::RangeView::begin() const
+{
+    return first_;
+}
+
+/**
+ * Returns the iterator past the last item of the view.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::RangeView::end() const
+{
+    return last_;
+}
+
+/**
+ * Returns true if the view holds no items.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+bool SnapshotAVLTree<Key, Value, Alloc, Compare>::RangeView::empty() const
+{
+    return first_ == last_;
+}
+
+/*
+------------------------------------------------------------
+End implementations for the SnapshotAVLTree::iterator class.
+------------------------------------------------------------
+*/
+
+/*
+-----------------------------------------------------
+Begin implementations for the SnapshotAVLTree class.
+-----------------------------------------------------
+*/
+
+/**
+ * Default constructor for an empty tree with no snapshots.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::SnapshotAVLTree() : epoch_(1),
+                                                        newestLive_(0)
+{
+}
+
+/**
+ * Destructor, which also frees the nodes that only snapshots could see.
+ * Every snapshot must be gone by now.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::~SnapshotAVLTree()
+{
+    clear();
+    for (std::size_t i = 0; i < retired_.size(); ++i)
+    {
+        destroyNode(retired_[i].first);
+    }
+    retired_.clear();
+}
+
+/**
+ * Returns a read-only iterator to the smallest item.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::begin() const
+{
+    return Base::begin();
+}
+
+/**
+ * Returns the read-only end iterator.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::end() const
+{
+    return Base::end();
+}
+
+/**
+ * Returns a read-only reverse iterator to the largest item.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::reverse_iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::rbegin() const
+{
+    return reverse_iterator(end());
+}
+
+/**
+ * Returns the read-only reverse iterator past the smallest item.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::reverse_iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::rend() const
+{
+    return reverse_iterator(begin());
+}
+
+/**
+ * AVLTree::find, read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::find(const Key &key) const
+{
+    return Base::find(key);
+}
+
+/**
+ * The finger search, read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::find(const iterator &hint, const Key &key) const
+{
+    return Base::find(hint, key);
+}
+
+/**
+ * AVLTree::lower_bound, read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::lower_bound(const Key &key) const
+{
+    return Base::lower_bound(key);
+}
+
+/**
+ * AVLTree::upper_bound, read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::upper_bound(const Key &key) const
+{
+    return Base::upper_bound(key);
+}
+
+/**
+ * AVLTree::equal_range, read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+std::pair<typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator, typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::equal_range(const Key &key) const
+{
+    std::pair<typename Base::iterator, typename Base::iterator> range = Base::equal_range(key);
+    return std::make_pair(iterator(range.first), iterator(range.second));
+}
+
+/**
+ * The items with keys in [lo, hi), read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::RangeView SnapshotAVLTree<Key, Value, Alloc, Compare>::range(const Key &lo, const Key &hi) const
+{
+    return RangeView(lower_bound(lo), lower_bound(hi));
+}
+
+/**
+ * Heterogeneous find, read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K, typename C, typename>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::find(const K &key) const
+{
+    return Base::find(key);
+}
+
+/**
+ * Heterogeneous lower_bound, read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K, typename C, typename>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::lower_bound(const K &key) const
+{
+    return Base::lower_bound(key);
+}
+
+/**
+ * Heterogeneous upper_bound, read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K, typename C, typename>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::upper_bound(const K &key) const
+{
+    return Base::upper_bound(key);
+}
+
+/**
+ * Heterogeneous equal_range, read-only.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename K, typename C, typename>
+std::pair<typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator, typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator>
+SnapshotAVLTree<Key, Value, Alloc, Compare>::equal_range(const K &key) const
+{
+    std::pair<typename Base::iterator, typename Base::iterator> range = Base::equal_range(key);
+    return std::make_pair(iterator(range.first), iterator(range.second));
+}
+
+/**
+ * Returns the value for key to be written through, throwing
+ * std::out_of_range if key is missing. While a snapshot is live, the path
+ * to key is copied first, so the value written is the copy's and snapshots
+ * keep the old one. Take a new reference after each snapshot().
+ */
+template <class Key, class Value, class Alloc, class Compare>
+Value &SnapshotAVLTree<Key, Value, Alloc, Compare>::operator[](const Key &key)
+{
+    refreshSnapshots();
+    if (newestLive_ == 0)
+    {
+        return Base::operator[](key);
+    }
+    // check first, so a missing key copies nothing
+    if (this->internalFind(key) == nullptr)
+        throw std::out_of_range("Invalid key");
+    return copyPath(key)->getValue();
+}
+
+/**
+ * Returns the value for key, throwing std::out_of_range if key is missing.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+Value const &SnapshotAVLTree<Key, Value, Alloc, Compare>::operator[](const Key &key) const
+{
+    return Base::operator[](key);
+}
+
+/**
+ * The hinted insert, returning a read-only iterator (see insertNear).
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator SnapshotAVLTree<Key, Value, Alloc, Compare>::insert(const iterator &hint, const std::pair<const Key, Value> &new_item)
+{
+    return Base::insert(hint, new_item);
+}
+
+/**
+ * AVLTree::emplace, returning a read-only iterator (see prepareInsert).
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename... Args>
+std::pair<typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator, bool> SnapshotAVLTree<Key, Value, Alloc, Compare>::emplace(Args &&...args)
+{
+    std::pair<typename Base::iterator, bool> result = Base::emplace(std::forward<Args>(args)...);
+    return std::make_pair(iterator(result.first), result.second);
+}
+
+/**
+ * AVLTree::try_emplace, returning a read-only iterator.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename... Args>
+std::pair<typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator, bool> SnapshotAVLTree<Key, Value, Alloc, Compare>::try_emplace(const Key &key, Args &&...args)
+{
+    std::pair<typename Base::iterator, bool> result = Base::try_emplace(key, std::forward<Args>(args)...);
+    return std::make_pair(iterator(result.first), result.second);
+}
+
+/**
+ * As above, moving key in.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+template <typename... Args>
+std::pair<typename SnapshotAVLTree<Key, Value, Alloc, Compare>::iterator, bool> SnapshotAVLTree<Key, Value, Alloc, Compare>::try_emplace(Key &&key, Args &&...args)
+{
+    std::pair<typename Base::iterator, bool> result = Base::try_emplace(std::move(key), std::forward<Args>(args)...);
+    return std::make_pair(iterator(result.first), result.second);
+}
+
+/**
+ * Inserts like AVLTree::insert, after copying any frozen node on the way
+ * down. Rotations after an insert only involve nodes on that path.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::insert(const std::pair<const Key, Value> &new_item)
+{
+    refreshSnapshots();
+    if (newestLive_ != 0)
+    {
+        copyPath(new_item.first);
+    }
+    Base::insert(new_item);
+}
+
+/**
+ * The same, for insert(&&).
+ */
+template <class Key, class Value, class Alloc, class Compare>
+std::pair<Node<Key, Value> *, bool> SnapshotAVLTree<Key, Value, Alloc, Compare>::insertMoved(Key &&key, Value &&value, bool overwrite)
+{
+    refreshSnapshots();
+    if (newestLive_ != 0)
+    {
+        copyPath(key);
+    }
+    return Base::insertMoved(std::move(key), std::move(value), overwrite);
+}
+
+/**
+ * The same, for emplace and try_emplace, which call this before they search.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::prepareInsert(const Key &key)
+{
+    refreshSnapshots();
+    if (newestLive_ != 0)
+    {
+        copyPath(key);
+    }
+}
+
+/**
+ * The same, for the hinted insert. Copying the path may replace the hint's
+ * node and its ancestors, so while any snapshot is live the search starts
+ * from the root after all.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+std::pair<Node<Key, Value> *, bool> SnapshotAVLTree<Key, Value, Alloc, Compare>::insertNear(Node<Key, Value> *finger, const Key &key, const Value &value)
+{
+    refreshSnapshots();
+    if (newestLive_ != 0)
+    {
+        copyPath(key);
+        finger = nullptr;
+    }
+    return Base::insertNear(finger, key, value);
+}
+
+/**
+ * The merge behind insertBatch. Splitting and joining relinks nodes all
+ * over the tree, so while any snapshot is live the items go in one at a
+ * time instead, each copying only its own path.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::mergeSorted(std::vector<std::pair<Key, Value> > &items)
+{
+    refreshSnapshots();
+    if (newestLive_ == 0)
+    {
+        Base::mergeSorted(items);
+        return;
+    }
+    for (typename std::vector<std::pair<Key, Value> >::iterator it = items.begin(); it != items.end(); ++it)
+    {
+        insertMoved(std::move(it->first), std::move(it->second), true);
+    }
+}
+
+/**
+ * Removes like AVLTree::remove, after copying every frozen node it could touch.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::remove(const Key &key)
+{
+    refreshSnapshots();
+    if (newestLive_ != 0)
+    {
+        copyRemovalArea(key);
+    }
+    Base::remove(key);
+}
+
+/**
+ * Removes every item from the live tree. Frozen nodes are retired rather
+ * than freed, and nothing is relinked on the way, so snapshots are unaffected.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::clear()
+{
+    refreshSnapshots();
+    std::vector<Node<Key, Value> *> pending;
+    if (this->root_ != nullptr)
+    {
+        pending.push_back(this->root_);
+    }
+    while (!pending.empty())
+    {
+        Node<Key, Value> *node = pending.back();
+        pending.pop_back();
+        if (node->getLeft() != nullptr)
+            pending.push_back(node->getLeft());
+        if (node->getRight() != nullptr)
+            pending.push_back(node->getRight());
+
+        if (isFrozen(node))
+        {
+            retired_.push_back(std::make_pair(node, epoch_));
+        }
+        else
+        {
+            destroyNode(node);
+        }
+    }
+    this->root_ = nullptr;
+}
+
+/**
+ * Returns a read-only view of the tree as it is now, in O(1).
+ * Counts as a write: call it from the thread that modifies the tree.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+typename SnapshotAVLTree<Key, Value, Alloc, Compare>::Snapshot
+SnapshotAVLTree<Key, Value, Alloc, Compare>::snapshot()
+{
+    refreshSnapshots();
+    std::shared_ptr<void> token = std::make_shared<char>(0);
+    snapshots_.push_back(std::make_pair(epoch_, std::weak_ptr<void>(token)));
+    newestLive_ = epoch_;
+    // everything that exists now is frozen, so new nodes need a later epoch
+    ++epoch_;
+    return Snapshot(this->root_, token, this->comp_);
+}
+
+/**
+ * Destroys a node as the SnapshotAVLNode it really is.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::destroyNode(Node<Key, Value> *node)
+{
+    VersionedNode *n = static_cast<VersionedNode *>(node);
+    n->~VersionedNode();
+    this->alloc_.deallocate(n);
+}
+
+/**
+ * Creates every node of the tree, stamped with the current epoch.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+Node<Key, Value> *SnapshotAVLTree<Key, Value, Alloc, Compare>::buildNode(const Key &key, const Value &value, int balance, std::size_t /*size*/)
+{
+    VersionedNode *n = this->template createNode<VersionedNode>(key, value, nullptr);
+    n->setBalance(balance);
+    n->setEpoch(epoch_);
+    return n;
+}
+
+/**
+ * As above, but moves the key and value into the new node.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+Node<Key, Value> *SnapshotAVLTree<Key, Value, Alloc, Compare>::buildNode(Key &&key, Value &&value, int balance, std::size_t /*size*/)
+{
+    VersionedNode *n = this->template createNode<VersionedNode>(std::move(key), std::move(value), nullptr);
+    n->setBalance(balance);
+    n->setEpoch(epoch_);
+    return n;
+}
+
+/**
+ * As above, but the item is built in place by maker.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+Node<Key, Value> *SnapshotAVLTree<Key, Value, Alloc, Compare>::buildNode(const ItemMaker<Key, Value> &maker, int balance, std::size_t /*size*/)
+{
+    VersionedNode *n = this->template createNode<VersionedNode>(maker, nullptr);
+    n->setBalance(balance);
+    n->setEpoch(epoch_);
+    return n;
+}
+
+/**
+ * Returns true if a live snapshot may be able to see node.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+bool SnapshotAVLTree<Key, Value, Alloc, Compare>::isFrozen(const Node<Key, Value> *node) const
+{
+    return static_cast<const VersionedNode *>(node)->getEpoch() <= newestLive_;
+}
+
+/**
+ * Returns node itself if the live tree may change it, otherwise a copy of it
+ * that has taken its place in the live tree. The node's parent must already
+ * be writable. The original is retired, untouched, for the snapshots.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+AVLNode<Key, Value> *SnapshotAVLTree<Key, Value, Alloc, Compare>::writable(AVLNode<Key, Value> *node)
+{
+    if (node == nullptr || !isFrozen(node))
+    {
+        return node;
+    }
+
+    AVLNode<Key, Value> *copy = static_cast<AVLNode<Key, Value> *>(buildNode(node->getKey(), node->getValue(), node->getBalance(), 1));
+    AVLNode<Key, Value> *parent = node->getParent();
+    copy->setParent(parent);
+    copy->setLeft(node->getLeft());
+    copy->setRight(node->getRight());
+
+    // parent pointers are only used by the live tree, so the shared
+    // children can point at the copy without disturbing any snapshot
+    if (node->getLeft() != nullptr)
+        node->getLeft()->setParent(copy);
+    if (node->getRight() != nullptr)
+        node->getRight()->setParent(copy);
+
+    if (parent == nullptr)
+        this->root_ = copy;
+    else if (parent->getLeft() == node)
+        parent->setLeft(copy);
+    else
+        parent->setRight(copy);
+
+    retired_.push_back(std::make_pair(static_cast<Node<Key, Value> *>(node), epoch_));
+    return copy;
+}
+
+/**
+ * Makes every node from the root down to key (or to where key would be
+ * inserted) writable. Returns the node with key, or NULL.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+AVLNode<Key, Value> *SnapshotAVLTree<Key, Value, Alloc, Compare>::copyPath(const Key &key)
+{
+    AVLNode<Key, Value> *current = writable(static_cast<AVLNode<Key, Value> *>(this->root_));
+    while (current != nullptr)
+    {
+        if (this->comp_(key, current->getKey()))
+        {
+            current = writable(current->getLeft());
+        }
+        else if (this->comp_(current->getKey(), key))
+        {
+            current = writable(current->getRight());
+        }
+        else
+        {
+            return current;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Makes writable everything AVLTree::remove(key) might change: the path down
+ * to key and on to its predecessor, and the children and grandchildren of
+ * every node on that path, which removeFix can rotate.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::copyRemovalArea(const Key &key)
+{
+    AVLNode<Key, Value> *deepest = copyPath(key);
+    if (deepest == nullptr)
+    {
+        return; // nothing will be removed
+    }
+    if (deepest->getLeft() != nullptr && deepest->getRight() != nullptr)
+    {
+        // continue down to the predecessor it will be swapped with
+        deepest = writable(deepest->getLeft());
+        while (deepest->getRight() != nullptr)
+        {
+            deepest = writable(deepest->getRight());
+        }
+    }
+
+    for (AVLNode<Key, Value> *node = deepest; node != nullptr; node = node->getParent())
+    {
+        AVLNode<Key, Value> *children[2] = {node->getLeft(), node->getRight()};
+        for (int i = 0; i < 2; ++i)
+        {
+            AVLNode<Key, Value> *child = writable(children[i]);
+            if (child != nullptr)
+            {
+                writable(child->getLeft());
+                writable(child->getRight());
+            }
+        }
+    }
+}
+
+/**
+ * Forgets snapshots that have been destroyed and works out which nodes are
+ * still frozen. If any snapshot went away, frees what nobody can see now.
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::refreshSnapshots()
+{
+    bool anyGone = false;
+    newestLive_ = 0;
+    for (std::size_t i = 0; i < snapshots_.size();)
+    {
+        // lock() rather than expired(), so that the reader's last accesses
+        // happen-before we free anything it was looking at
+        if (!snapshots_[i].second.lock())
+        {
+            snapshots_[i] = snapshots_.back();
+            snapshots_.pop_back();
+            anyGone = true;
+        }
+        else
+        {
+            newestLive_ = std::max(newestLive_, snapshots_[i].first);
+            ++i;
+        }
+    }
+    if (anyGone)
+    {
+        reclaim();
+    }
+}
+
+/**
+ * Frees every retired node that no live snapshot can reach. A node created in
+ * epoch c and retired in epoch r is only visible to snapshots taken in [c, r).
+ */
+template <class Key, class Value, class Alloc, class Compare>
+void SnapshotAVLTree<Key, Value, Alloc, Compare>::reclaim()
+{
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < retired_.size(); ++i)
+    {
+        unsigned long created = static_cast<VersionedNode *>(retired_[i].first)->getEpoch();
+        unsigned long gone = retired_[i].second;
+        bool visible = false;
+        for (std::size_t s = 0; s < snapshots_.size() && !visible; ++s)
+        {
+            visible = (snapshots_[s].first >= created && snapshots_[s].first < gone);
+        }
+        if (visible)
+        {
+            retired_[kept++] = retired_[i];
+        }
+        else
+        {
+            destroyNode(retired_[i].first);
+        }
+    }
+    retired_.resize(kept);
+}
+
+/*
+---------------------------------------------------
+End implementations for the SnapshotAVLTree class.
+---------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef STREAM_CODEC_H
+#define STREAM_CODEC_H
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * The pieces of the binary stream format written by
+ * BinarySearchTree::serialize() and read by deserialize():
+ *
+ *   "BSTS", version, key tag, value tag, key mode, item count, items...
+ *
+ * The tags, the count and every integer are LEB128 varints, so small
+ * numbers take one byte. Items come in key order. Each key and value is
+ * encoded by StreamCodec<T>, except that integer keys ordered by std::less
+ * are stored as the difference from the previous key, which is small for
+ * dense keys whatever their magnitude (key mode 1).
+ *
+ * StreamCodec covers integers, floating point, std::string and, as raw
+ * bytes, other trivially copyable types; specialize it for anything else.
+ * Integers and floating point are written byte order independent, so
+ * streams can move between machines; raw bytes can't.
+ */
+namespace stream_codec_detail
+{
+    inline void writeVarint(std::ostream &out, std::uint64_t x)
+    {
+        char bytes[10];
+        int n = 0;
+        while (x >= 0x80)
+        {
+            bytes[n++] = static_cast<char>((x & 0x7f) | 0x80);
+            x >>= 7;
+        }
+        bytes[n++] = static_cast<char>(x);
+        out.write(bytes, n);
+    }
+
+    inline std::uint64_t readVarint(std::istream &in)
+    {
+        std::uint64_t x = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            int byte = in.get();
+            if (byte == std::char_traits<char>::eof())
+                throw std::runtime_error("tree stream: unexpected end of input");
+            x |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return x;
+        }
+        throw std::runtime_error("tree stream: varint too long");
+    }
+
+    inline void readBytes(std::istream &in, char *bytes, std::size_t n)
+    {
+        if (!in.read(bytes, static_cast<std::streamsize>(n)))
+            throw std::runtime_error("tree stream: unexpected end of input");
+    }
+
+    // signed integers map to unsigned ones with small magnitudes kept small
+    inline std::uint64_t zigzag(std::int64_t x)
+    {
+        return (static_cast<std::uint64_t>(x) << 1) ^ static_cast<std::uint64_t>(x >> 63);
+    }
+    inline std::int64_t unzigzag(std::uint64_t x)
+    {
+        return static_cast<std::int64_t>(x >> 1) ^ -static_cast<std::int64_t>(x & 1);
+    }
+
+    // the tag identifying a type in the stream header: a kind and a size
+    enum Kind
+    {
+        UNSIGNED = 1,
+        SIGNED = 2,
+        FLOATING = 3,
+        STRING = 4,
+        RAW = 5
+    };
+    inline std::uint64_t makeTag(Kind kind, std::size_t size)
+    {
+        return (static_cast<std::uint64_t>(size) << 4) | kind;
+    }
+}
+
+/**
+ * How one key or value is written and read back. The general version
+ * copies the bytes of trivially copyable types; everything else needs a
+ * specialization with the same three members.
+ */
+template <typename T, typename Enable = void>
+struct StreamCodec
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "specialize StreamCodec to stream a type that isn't trivially copyable");
+
+    static std::uint64_t tag()
+    {
+        return stream_codec_detail::makeTag(stream_codec_detail::RAW, sizeof(T));
+    }
+    static void write(std::ostream &out, const T &x)
+    {
+        out.write(reinterpret_cast<const char *>(&x), sizeof(T));
+    }
+    static void read(std::istream &in, T &x)
+    {
+        stream_codec_detail::readBytes(in, reinterpret_cast<char *>(&x), sizeof(T));
+    }
+};
+
+/**
+ * Integers, as varints (zigzagged first when signed).
+ */
+template <typename T>
+struct StreamCodec<T, typename std::enable_if<std::is_integral<T>::value>::type>
+{
+    static std::uint64_t tag()
+    {
+        return stream_codec_detail::makeTag(std::is_signed<T>::value ? stream_codec_detail::SIGNED
+                                                                     : stream_codec_detail::UNSIGNED,
+                                            sizeof(T));
+    }
+    static void write(std::ostream &out, const T &x)
+    {
+        stream_codec_detail::writeVarint(out, std::is_signed<T>::value
+                                                  ? stream_codec_detail::zigzag(static_cast<std::int64_t>(x))
+                                                  : static_cast<std::uint64_t>(x));
+    }
+    static void read(std::istream &in, T &x)
+    {
+        std::uint64_t bits = stream_codec_detail::readVarint(in);
+        x = std::is_signed<T>::value ? static_cast<T>(stream_codec_detail::unzigzag(bits)) : static_cast<T>(bits);
+    }
+};
+
+/**
+ * float and double, as their bits in little-endian order.
+ */
+template <typename T>
+struct StreamCodec<T, typename std::enable_if<std::is_floating_point<T>::value && (sizeof(T) == 4 || sizeof(T) == 8)>::type>
+{
+    typedef typename std::conditional<sizeof(T) == 4, std::uint32_t, std::uint64_t>::type Bits;
+
+    static std::uint64_t tag()
+    {
+        return stream_codec_detail::makeTag(stream_codec_detail::FLOATING, sizeof(T));
+    }
+    static void write(std::ostream &out, const T &x)
+    {
+        Bits bits;
+        std::memcpy(&bits, &x, sizeof(T));
+        char bytes[sizeof(T)];
+        for (std::size_t i = 0; i < sizeof(T); ++i)
+            bytes[i] = static_cast<char>((bits >> (8 * i)) & 0xff);
+        out.write(bytes, sizeof(T));
+    }
+    static void read(std::istream &in, T &x)
+    {
+        unsigned char bytes[sizeof(T)];
+        stream_codec_detail::readBytes(in, reinterpret_cast<char *>(bytes), sizeof(T));
+        Bits bits = 0;
+        for (std::size_t i = 0; i < sizeof(T); ++i)
+            bits |= static_cast<Bits>(bytes[i]) << (8 * i);
+        std::memcpy(&x, &bits, sizeof(T));
+    }
+};
+
+/**
+ * std::string, as its length and then its bytes.
+ */
+template <>
+struct StreamCodec<std::string>
+{
+    static std::uint64_t tag()
+    {
+        return stream_codec_detail::makeTag(stream_codec_detail::STRING, 0);
+    }
+    static void write(std::ostream &out, const std::string &x)
+    {
+        stream_codec_detail::writeVarint(out, x.size());
+        out.write(x.data(), static_cast<std::streamsize>(x.size()));
+    }
+    static void read(std::istream &in, std::string &x)
+    {
+        std::uint64_t size = stream_codec_detail::readVarint(in);
+        x.clear();
+        // grow with what actually arrives, so a corrupt length can't reserve gigabytes
+        char buffer[4096];
+        while (size > 0)
+        {
+            std::size_t chunk = (size < sizeof(buffer)) ? static_cast<std::size_t>(size) : sizeof(buffer);
+            stream_codec_detail::readBytes(in, buffer, chunk);
+            x.append(buffer, chunk);
+            size -= chunk;
+        }
+    }
+};
+
+/**
+ * Writes and reads the keys of one stream in order. Integer keys under
+ * std::less are delta encoded; the rest go through StreamCodec<Key>.
+ */
+template <typename Key, typename Compare,
+          bool Delta = std::is_integral<Key>::value && std::is_same<Compare, std::less<Key> >::value>
+class KeyStreamCodec
+{
+public:
+    static const unsigned MODE = 0;
+
+    void write(std::ostream &out, const Key &key)
+    {
+        StreamCodec<Key>::write(out, key);
+    }
+    void read(std::istream &in, Key &key)
+    {
+        StreamCodec<Key>::read(in, key);
+    }
+};
+
+template <typename Key, typename Compare>
+class KeyStreamCodec<Key, Compare, true>
+{
+public:
+    static const unsigned MODE = 1;
+
+    KeyStreamCodec() : first_(true), previous_(0) {}
+
+    // the first key as is, then each as its (positive) step from the last
+    void write(std::ostream &out, const Key &key)
+    {
+        std::uint64_t bits = toBits(key);
+        if (first_)
+            StreamCodec<Key>::write(out, key);
+        else
+            stream_codec_detail::writeVarint(out, bits - previous_);
+        first_ = false;
+        previous_ = bits;
+    }
+    void read(std::istream &in, Key &key)
+    {
+        if (first_)
+        {
+            StreamCodec<Key>::read(in, key);
+            previous_ = toBits(key);
+        }
+        else
+        {
+            previous_ += stream_codec_detail::readVarint(in);
+            key = static_cast<Key>(previous_);
+        }
+        first_ = false;
+    }
+
+private:
+    // sign extended, so the difference of two sorted keys never wraps
+    static std::uint64_t toBits(const Key &key)
+    {
+        return std::is_signed<Key>::value ? static_cast<std::uint64_t>(static_cast<std::int64_t>(key))
+                                          : static_cast<std::uint64_t>(key);
+    }
+
+    bool first_;
+    std::uint64_t previous_;
+};
+
+#endif
@@ -0,0 +1,335 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * A fixed set of worker threads for fork-join parallelism, such as the
+ * recursive halves of AVLTree::unionWith.
+ *
+ * Every worker has its own deque of tasks. A worker pushes the tasks it
+ * forks onto the back of its own deque and takes them back from there, so
+ * it stays on the most recent (and most cache-warm) work; an idle worker
+ * steals from the front of another's deque, which holds the oldest and so
+ * usually the biggest pieces. Threads outside the pool share one more deque.
+ *
+ * Tasks are grouped (see Group), and waiting on a group runs other tasks
+ * in the meantime instead of blocking, so tasks may fork and wait on
+ * groups of their own without tying up workers.
+ */
+class TaskPool
+{
+public:
+    explicit TaskPool(unsigned threads = std::thread::hardware_concurrency());
+    ~TaskPool();
+
+    unsigned size() const; // number of worker threads
+
+    /**
+     * Tasks that are waited for together. wait() returns once all of them
+     * have run, and rethrows the first exception any of them threw.
+     */
+    class Group
+    {
+    public:
+        explicit Group(TaskPool &pool);
+        ~Group();
+
+        void run(const std::function<void()> &task);
+        void wait();
+
+    private:
+        friend class TaskPool;
+        Group(const Group &);
+        Group &operator=(const Group &);
+
+        TaskPool &pool_;
+        std::atomic<std::size_t> pending_;
+        std::mutex errorLock_;
+        std::exception_ptr error_;
+    };
+
+private:
+    TaskPool(const TaskPool &);
+    TaskPool &operator=(const TaskPool &);
+
+    struct Task
+    {
+        std::function<void()> fn;
+        Group *group;
+    };
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    void push(const Task &task);
+    bool runOne(); // runs one queued task, if there is any
+    void workerLoop(unsigned index);
+    unsigned currentQueue() const; // own deque of this thread
+    static std::pair<const TaskPool *, unsigned> &currentWorker();
+
+    std::vector<std::unique_ptr<Queue> > queues_; // one per worker, then the outside one
+    std::vector<std::thread> threads_;
+    std::atomic<std::size_t> queued_; // tasks waiting in any deque
+    std::atomic<bool> stopping_;
+    std::mutex sleepLock_;
+    std::condition_variable wake_;
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the TaskPool::Group class.
+  -----------------------------------------------
+*/
+
+/**
+ * An empty group of tasks for pool.
+ */
+inline TaskPool::Group::Group(TaskPool &pool) : pool_(pool), pending_(0)
+{
+}
+
+/**
+ * Waits for any tasks still running, since they may refer to the caller's
+ * stack. An exception from them is dropped here; call wait() to see it.
+ */
+inline TaskPool::Group::~Group()
+{
+    try
+    {
+        wait();
+    }
+    catch (...)
+    {
+    }
+}
+
+/**
+ * Queues task to run on the pool as part of this group.
+ */
+inline void TaskPool::Group::run(const std::function<void()> &task)
+{
+    pending_.fetch_add(1);
+    Task t;
+    t.fn = task;
+    t.group = this;
+    pool_.push(t);
+}
+
+/**
+ * Returns once every task of the group has finished, running queued tasks
+ * (of any group) while it waits.
+ */
+inline void TaskPool::Group::wait()
+{
+    while (pending_.load() != 0)
+    {
+        if (!pool_.runOne())
+        {
+            std::this_thread::yield();
+        }
+    }
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> guard(errorLock_);
+        std::swap(error, error_);
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the TaskPool::Group class.
+  -----------------------------------------------
+*/
+
+/*
+  -----------------------------------------------
+  Begin implementations for the TaskPool class.
+  -----------------------------------------------
+*/
+
+/**
+ * Starts the given number of worker threads, at least one.
+ */
+inline TaskPool::TaskPool(unsigned threads) : queued_(0), stopping_(false)
+{
+    if (threads == 0)
+    {
+        threads = 1;
+    }
+    for (unsigned i = 0; i <= threads; ++i)
+    {
+        queues_.push_back(std::unique_ptr<Queue>(new Queue));
+    }
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        threads_.push_back(std::thread(&TaskPool::workerLoop, this, i));
+    }
+}
+
+/**
+ * Stops the workers once the tasks already queued have run.
+ */
+inline TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleepLock_);
+        stopping_.store(true);
+    }
+    wake_.notify_all();
+    for (std::size_t i = 0; i < threads_.size(); ++i)
+    {
+        threads_[i].join();
+    }
+}
+
+/**
+ * Returns the number of worker threads.
+ */
+inline unsigned TaskPool::size() const
+{
+    return static_cast<unsigned>(threads_.size());
+}
+
+/**
+ * Which pool, and which worker of it, the calling thread is.
+ */
+inline std::pair<const TaskPool *, unsigned> &TaskPool::currentWorker()
+{
+    static thread_local std::pair<const TaskPool *, unsigned> current(nullptr, 0);
+    return current;
+}
+
+/**
+ * The deque the calling thread pushes to: its own if it is one of this
+ * pool's workers, otherwise the shared outside one.
+ */
+inline unsigned TaskPool::currentQueue() const
+{
+    const std::pair<const TaskPool *, unsigned> &current = currentWorker();
+    return (current.first == this) ? current.second : static_cast<unsigned>(threads_.size());
+}
+
+/**
+ * Adds a task to the back of the calling thread's deque and wakes a worker.
+ */
+inline void TaskPool::push(const Task &task)
+{
+    // counted first, so the count never drops below the tasks really queued
+    queued_.fetch_add(1);
+    Queue &queue = *queues_[currentQueue()];
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(task);
+    }
+    {
+        // taken so a worker can't miss the wakeup between checking and sleeping
+        std::lock_guard<std::mutex> guard(sleepLock_);
+    }
+    wake_.notify_one();
+}
+
+/**
+ * Runs one task: the newest from the calling thread's own deque if it has
+ * any, otherwise the oldest from the first other deque that does. Returns
+ * false if every deque was empty.
+ */
+inline bool TaskPool::runOne()
+{
+    if (queued_.load() == 0)
+    {
+        return false;
+    }
+
+    unsigned own = currentQueue();
+    Task task;
+    bool found = false;
+    for (std::size_t i = 0; i < queues_.size() && !found; ++i)
+    {
+        std::size_t index = (own + i) % queues_.size();
+        Queue &queue = *queues_[index];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty())
+        {
+            continue;
+        }
+        if (index == own)
+        {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        else
+        {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        found = true;
+    }
+    if (!found)
+    {
+        return false;
+    }
+    queued_.fetch_sub(1);
+
+    try
+    {
+        task.fn();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> guard(task.group->errorLock_);
+        if (!task.group->error_)
+        {
+            task.group->error_ = std::current_exception();
+        }
+    }
+    task.group->pending_.fetch_sub(1);
+    return true;
+}
+
+/**
+ * The body of worker index: run tasks while there are any, sleep otherwise.
+ */
+inline void TaskPool::workerLoop(unsigned index)
+{
+    currentWorker() = std::make_pair(static_cast<const TaskPool *>(this), index);
+    for (;;)
+    {
+        if (runOne())
+        {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepLock_);
+        while (queued_.load() == 0 && !stopping_.load())
+        {
+            wake_.wait(lock);
+        }
+        if (queued_.load() == 0 && stopping_.load())
+        {
+            return;
+        }
+    }
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the TaskPool class.
+  -----------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef TREE_STATS_H
+#define TREE_STATS_H
+
+#include <ostream>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Counters that show where a tree's operations spend their time: how deep
+ * searches go, how far rebalancing climbs, and which rotations it does.
+ *
+ * They are only kept when the build defines TREE_STATS (e.g. with
+ * make DEFS=-DTREE_STATS). Otherwise TREE_STATS_DO() drops its statement,
+ * the trees hold no counters, and stats() returns an all-zero TreeStats,
+ * so instrumented code costs nothing in a normal build.
+ *
+ * The counters are plain integers. Counting makes const lookups write to
+ * the tree, so don't share an instrumented tree between reading threads.
+ * The parallel set operations (AVLTree::unionWith with a TaskPool, and so
+ * on) are safe: each forked task counts its rotations separately, and they
+ * are added to the tree's counters when the task is joined.
+ */
+#ifdef TREE_STATS
+#define TREE_STATS_DO(...) __VA_ARGS__
+#else
+#define TREE_STATS_DO(...)
+#endif
+
+/**
+ * A histogram of small counts, e.g. levels per search. Values from
+ * BUCKETS - 1 up share the last bucket; the sum and max stay exact.
+ */
+struct TreeHistogram
+{
+    static const std::size_t BUCKETS = 64;
+
+    TreeHistogram() : events(0), sum(0), max(0)
+    {
+        for (std::size_t i = 0; i < BUCKETS; ++i)
+            counts[i] = 0;
+    }
+
+    void record(std::uint64_t value)
+    {
+        ++counts[value < BUCKETS ? value : BUCKETS - 1];
+        ++events;
+        sum += value;
+        if (value > max)
+            max = value;
+    }
+
+    double mean() const
+    {
+        return events == 0 ? 0.0 : static_cast<double>(sum) / static_cast<double>(events);
+    }
+
+    /**
+     * The smallest value v such that a fraction p (0 to 1) of the recorded
+     * values are at most v. Values past the last bucket report as max.
+     */
+    std::uint64_t percentile(double p) const
+    {
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < BUCKETS; ++i)
+        {
+            seen += counts[i];
+            if (seen > 0 && static_cast<double>(seen) >= p * static_cast<double>(events))
+                return (i == BUCKETS - 1) ? max : i;
+        }
+        return max;
+    }
+
+    std::uint64_t counts[BUCKETS]; // counts[v]: how often v was recorded
+    std::uint64_t events;          // values recorded
+    std::uint64_t sum;
+    std::uint64_t max;
+};
+
+/**
+ * Single and double rotations done by one rebalancing routine.
+ */
+struct RotationCounts
+{
+    RotationCounts() : single(0), doubled(0) {}
+    void add(const RotationCounts &other)
+    {
+        single += other.single;
+        doubled += other.doubled;
+    }
+    std::uint64_t single;
+    std::uint64_t doubled;
+};
+
+/**
+ * Everything counted for one tree. Every level of a search costs exactly
+ * one comparison, so the depths below are also the comparisons per
+ * operation (find adds one more, to check the node it stops at).
+ */
+struct TreeStats
+{
+    TreeStats() : removeFixCalls(0), nodeSwaps(0) {}
+
+    TreeHistogram lookupDepth;    // levels descended by each find, lower_bound, ...
+    TreeHistogram insertDepth;    // levels descended by each insert
+    TreeHistogram insertRetrace;  // ancestors whose balance an AVL insert updated
+    TreeHistogram removeFixDepth; // removeFix calls per AVL remove
+    RotationCounts rebalance;     // after inserts, joins and merges
+    RotationCounts removeFix;
+    std::uint64_t removeFixCalls; // all of them, across removes
+    std::uint64_t nodeSwaps;      // removals of nodes with two children
+
+    /**
+     * Writes one line per counter: name, then count, mean, p50, p99 and max
+     * for the histograms.
+     */
+    void print(std::ostream &out) const
+    {
+        printHistogram(out, "lookupDepth", lookupDepth);
+        printHistogram(out, "insertDepth", insertDepth);
+        printHistogram(out, "insertRetrace", insertRetrace);
+        printHistogram(out, "removeFixDepth", removeFixDepth);
+        out << "rotations rebalance " << rebalance.single << " single " << rebalance.doubled << " double\n";
+        out << "rotations removeFix " << removeFix.single << " single " << removeFix.doubled << " double\n";
+        out << "removeFixCalls " << removeFixCalls << "\n";
+        out << "nodeSwaps " << nodeSwaps << "\n";
+    }
+
+private:
+    static void printHistogram(std::ostream &out, const char *name, const TreeHistogram &h)
+    {
+        out << name << " count " << h.events << " mean " << h.mean() << " p50 " << h.percentile(0.5)
+            << " p99 " << h.percentile(0.99) << " max " << h.max << "\n";
+    }
+};
+
+#endif